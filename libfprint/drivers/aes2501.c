@@ -114,18 +114,16 @@ static void read_regs_rq_cb(struct fp_img_dev *dev, int result, void *user_data)
 {
 	struct aes2501_read_regs *rdata = user_data;
 	fpi_usb_transfer *transfer;
-	unsigned char *data;
 	int r;
 
 	g_free(rdata->regwrite);
 	if (result != 0)
 		goto err;
 
-	data = g_malloc(READ_REGS_LEN);
 	transfer = fpi_usb_fill_bulk_transfer(FP_DEV(dev),
 					      NULL,
 					      EP_IN,
-					      data,
+					      NULL,
 					      READ_REGS_LEN,
 					      read_regs_data_cb,
 					      rdata,
@@ -210,14 +208,12 @@ static void generic_ignore_data_cb(struct libusb_transfer *transfer,
 static void generic_read_ignore_data(fpi_ssm *ssm, struct fp_dev *dev, size_t bytes)
 {
 	fpi_usb_transfer *transfer;
-	unsigned char *data;
 	int r;
 
-	data = g_malloc(bytes);
 	transfer = fpi_usb_fill_bulk_transfer(dev,
 					      ssm,
 					      EP_IN,
-					      data,
+					      NULL,
 					      bytes,
 					      generic_ignore_data_cb,
 					      NULL,
@@ -234,7 +230,7 @@ static int sum_histogram_values(unsigned char *data, uint8_t threshold)
 {
 	int r = 0;
 	int i;
-	uint16_t *histogram = (uint16_t *)(data + 1);
+	const unsigned char *histogram = data + 1;
 
 	if (*data != 0xde)
 		return -EILSEQ;
@@ -242,10 +238,10 @@ static int sum_histogram_values(unsigned char *data, uint8_t threshold)
 	if (threshold > 0x0f)
 		return -EINVAL;
 
-	/* FIXME endianness */
+	/* The sensor sends 16 little-endian 16-bit bins */
 	for (i = threshold; i < 16; i++)
-		r += histogram[i];
-	
+		r += histogram[i * 2] | (histogram[i * 2 + 1] << 8);
+
 	return r;
 }
 
@@ -455,11 +455,12 @@ static void msg_set_mode_control(struct etes603_dev *dev, uint8_t mode)
  */
 static unsigned int process_get_brightness(uint8_t *f, size_t s)
 {
+	guint32 hist[16];
 	unsigned int i, sum = 0;
-	for (i = 0; i < s; i++) {
-		sum += f[i] >> 4;
-		sum += f[i] & 0x0F;
-	}
+
+	fpi_img_histogram_4bpp(f, s, hist);
+	for (i = 1; i < 16; i++)
+		sum += i * hist[i];
 	return sum;
 }
 
@@ -468,19 +469,15 @@ static unsigned int process_get_brightness(uint8_t *f, size_t s)
  */
 static void process_hist(uint8_t *f, size_t s, float stat[5])
 {
+	guint32 count[16];
 	float hist[16];
 	float black_mean, white_mean;
 	int i;
-	/* Clean histogram */
-	for (i = 0; i < 16; i++)
-		hist[i] = 0.0;
-	for (i = 0; i < s; i++) {
-		hist[f[i] >> 4]++;
-		hist[f[i] & 0x0F]++;
-	}
+
+	fpi_img_histogram_4bpp(f, s, count);
 	/* histogram average */
 	for (i = 0; i < 16; i++) {
-		hist[i] = hist[i] / (s * 2);
+		hist[i] = (float) count[i] / (s * 2);
 	}
 	/* Average black/white pixels (full black and full white pixels
 	 * are excluded). */
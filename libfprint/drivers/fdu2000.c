@@ -238,8 +238,11 @@ read:
 		goto out;
 	}
 
-	img = fpi_img_new_for_imgdev(dev);
-	memcpy(img->data, image, RAW_IMAGE_SIZE);
+	img = fpi_img_new_from_buffer((unsigned char *) image, RAW_IMAGE_SIZE,
+				      image, g_free);
+	image = NULL;
+	img->width = RAW_IMAGE_WIDTH;
+	img->height = RAW_IMAGE_HEIGTH;
 	img->flags = FP_IMG_COLORS_INVERTED | FP_IMG_V_FLIPPED | FP_IMG_H_FLIPPED;
 	*ret = img;
 
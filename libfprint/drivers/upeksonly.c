@@ -44,19 +44,9 @@ enum {
 	UPEKSONLY_1001,
 };
 
-struct img_transfer_data {
-	int idx;
-	struct fp_img_dev *dev;
-	gboolean flying;
-	gboolean cancelling;
-};
-
 enum sonly_kill_transfers_action {
 	NOT_KILLING = 0,
 
-	/* abort a SSM with an error code */
-	ABORT_SSM,
-
 	/* report an image session error */
 	IMG_SESSION_ERROR,
 
@@ -82,9 +72,7 @@ struct sonly_dev {
 	int img_width;
 
 	fpi_ssm *loopsm;
-	struct libusb_transfer *img_transfer[NUM_BULK_TRANSFERS];
-	struct img_transfer_data *img_transfer_data;
-	int num_flying;
+	fpi_usb_stream *img_stream;
 
 	GSList *rows;
 	size_t num_rows;
@@ -163,28 +151,10 @@ static struct fpi_line_asmbl_ctx assembling_ctx = {
 
 /***** IMAGE PROCESSING *****/
 
-static void free_img_transfers(struct sonly_dev *sdev)
-{
-	int i;
-	for (i = 0; i < NUM_BULK_TRANSFERS; i++) {
-		struct libusb_transfer *transfer = sdev->img_transfer[i];
-		if (!transfer)
-			continue;
-
-		g_free(transfer->buffer);
-		libusb_free_transfer(transfer);
-	}
-	g_free(sdev->img_transfer_data);
-}
-
 static void last_transfer_killed(struct fp_img_dev *dev)
 {
 	struct sonly_dev *sdev = FP_INSTANCE_DATA(FP_DEV(dev));
 	switch (sdev->killing_transfers) {
-	case ABORT_SSM:
-		fp_dbg("abort ssm error %d", sdev->kill_status_code);
-		fpi_ssm_mark_failed(sdev->kill_ssm, sdev->kill_status_code);
-		return;
 	case ITERATE_SSM:
 		fp_dbg("iterate ssm");
 		fpi_ssm_next_state(sdev->kill_ssm);
@@ -198,26 +168,27 @@ static void last_transfer_killed(struct fp_img_dev *dev)
 	}
 }
 
-static void cancel_img_transfers(struct fp_img_dev *dev)
+static void img_stream_stopped(fpi_usb_stream *stream,
+			       struct fp_dev  *_dev,
+			       int             status,
+			       void           *user_data)
 {
-	struct sonly_dev *sdev = FP_INSTANCE_DATA(FP_DEV(dev));
-	int i;
+	struct fp_img_dev *dev = user_data;
+	struct sonly_dev *sdev = FP_INSTANCE_DATA(_dev);
 
-	if (sdev->num_flying == 0) {
-		last_transfer_killed(dev);
-		return;
+	if (status != 0 && !sdev->killing_transfers) {
+		fp_warn("bad status %d, terminating session", status);
+		sdev->killing_transfers = IMG_SESSION_ERROR;
+		sdev->kill_status_code = status;
 	}
+	last_transfer_killed(dev);
+}
 
-	for (i = 0; i < NUM_BULK_TRANSFERS; i++) {
-		struct img_transfer_data *idata = &sdev->img_transfer_data[i];
-		if (!idata->flying || idata->cancelling)
-			continue;
-		fp_dbg("cancelling transfer %d", i);
-		int r = libusb_cancel_transfer(sdev->img_transfer[i]);
-		if (r < 0)
-			fp_dbg("cancel failed error %d", r);
-		idata->cancelling = TRUE;
-	}
+static void cancel_img_transfers(struct fp_img_dev *dev)
+{
+	struct sonly_dev *sdev = FP_INSTANCE_DATA(FP_DEV(dev));
+
+	fpi_usb_stream_stop(sdev->img_stream);
 }
 
 static gboolean is_capturing(struct sonly_dev *sdev)
@@ -469,147 +440,54 @@ static void handle_packet(struct fp_img_dev *dev, unsigned char *data)
 		start_new_row(sdev, data + diff, 62 - diff);
 }
 
-static void img_data_cb(struct libusb_transfer *transfer)
+static void img_data_cb(fpi_usb_stream *stream,
+			struct fp_dev  *_dev,
+			unsigned char  *data,
+			int             length,
+			void           *user_data)
 {
-	struct img_transfer_data *idata = transfer->user_data;
-	struct fp_img_dev *dev = idata->dev;
-	struct sonly_dev *sdev = FP_INSTANCE_DATA(FP_DEV(dev));
+	struct fp_img_dev *dev = user_data;
+	struct sonly_dev *sdev = FP_INSTANCE_DATA(_dev);
 	int i;
 
-	idata->flying = FALSE;
-	idata->cancelling = FALSE;
-	sdev->num_flying--;
-
-	if (sdev->killing_transfers) {
-		if (sdev->num_flying == 0)
-			last_transfer_killed(dev);
-
-		/* don't care about error or success if we're terminating */
-		return;
-	}
-
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-		fp_warn("bad status %d, terminating session", transfer->status);
-		sdev->killing_transfers = IMG_SESSION_ERROR;
-		sdev->kill_status_code = transfer->status;
-		cancel_img_transfers(dev);
-	}
-
 	/* there are 64 packets in the transfer buffer
 	 * each packet is 64 bytes in length
 	 * the first 2 bytes are a sequence number
 	 * then there are 62 bytes for image data
+	 *
+	 * the stream is stopped once the image is complete
 	 */
-	for (i = 0; i < 4096; i += 64) {
+	for (i = 0; i + 64 <= length; i += 64) {
 		if (!is_capturing(sdev))
 			return;
-		handle_packet(dev, transfer->buffer + i);
-	}
-
-	if (is_capturing(sdev)) {
-		int r = libusb_submit_transfer(transfer);
-		if (r < 0) {
-			fp_warn("failed resubmit, error %d", r);
-			sdev->killing_transfers = IMG_SESSION_ERROR;
-			sdev->kill_status_code = r;
-			cancel_img_transfers(dev);
-			return;
-		}
-		sdev->num_flying++;
-		idata->flying = TRUE;
+		handle_packet(dev, data + i);
 	}
 }
 
 /***** STATE MACHINE HELPERS *****/
 
-struct write_regs_data {
-	fpi_ssm *ssm;
-	struct libusb_transfer *transfer;
-	const struct sonly_regwrite *regs;
-	size_t num_regs;
-	size_t regs_written;
+/* Registers are written one per control transfer, addressed by wIndex */
+static const struct fpi_usb_regs_protocol sonly_regs_protocol = {
+	.request_type = 0x40,
+	.request = 0x0c,
+	.reg_in_index = TRUE,
+	.max_regs = 1,
+	.max_in_flight = 8,
+	.timeout = CTRL_TIMEOUT,
 };
 
-static void write_regs_finished(struct write_regs_data *wrdata, int result)
-{
-	g_free(wrdata->transfer->buffer);
-	libusb_free_transfer(wrdata->transfer);
-	if (result == 0)
-		fpi_ssm_next_state(wrdata->ssm);
-	else
-		fpi_ssm_mark_failed(wrdata->ssm, result);
-	g_free(wrdata);
-}
-
-
-static void write_regs_iterate(struct write_regs_data *wrdata)
+static void
+sm_write_regs(fpi_ssm                  *ssm,
+	      struct fp_dev            *dev,
+	      const struct fpi_usb_reg *regs,
+	      size_t                    num_regs)
 {
-	struct libusb_control_setup *setup;
-	const struct sonly_regwrite *regwrite;
 	int r;
 
-	if (wrdata->regs_written >= wrdata->num_regs) {
-		write_regs_finished(wrdata, 0);
-		return;
-	}
-
-	regwrite = &wrdata->regs[wrdata->regs_written];
-
-	fp_dbg("set %02x=%02x", regwrite->reg, regwrite->value);
-	setup = libusb_control_transfer_get_setup(wrdata->transfer);
-	setup->wIndex = regwrite->reg;
-	wrdata->transfer->buffer[LIBUSB_CONTROL_SETUP_SIZE] = regwrite->value;
-
-	r = libusb_submit_transfer(wrdata->transfer);
+	r = fpi_usb_write_regs(dev, ssm, &sonly_regs_protocol, regs, num_regs,
+		NULL, NULL);
 	if (r < 0)
-		write_regs_finished(wrdata, r);
-}
-
-static void write_regs_cb(struct libusb_transfer *transfer)
-{
-	struct write_regs_data *wrdata = transfer->user_data;
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
-		write_regs_finished(wrdata, transfer->status);
-		return;
-	}
-
-	wrdata->regs_written++;
-	write_regs_iterate(wrdata);
-}
-
-static void
-sm_write_regs(fpi_ssm                     *ssm,
-	      struct fp_dev               *dev,
-	      const struct sonly_regwrite *regs,
-	      size_t                       num_regs)
-{
-	struct write_regs_data *wrdata = g_malloc(sizeof(*wrdata));
-	unsigned char *data;
-
-	wrdata->transfer = fpi_usb_alloc();
-	data = g_malloc(LIBUSB_CONTROL_SETUP_SIZE + 1);
-	libusb_fill_control_setup(data, 0x40, 0x0c, 0, 0, 1);
-	libusb_fill_control_transfer(wrdata->transfer,
-		fpi_dev_get_usb_dev(dev), data,
-		write_regs_cb, wrdata, CTRL_TIMEOUT);
-	wrdata->transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK;
-
-	wrdata->ssm = ssm;
-	wrdata->regs = regs;
-	wrdata->num_regs = num_regs;
-	wrdata->regs_written = 0;
-	write_regs_iterate(wrdata);
-}
-
-static void sm_write_reg_cb(struct libusb_transfer *transfer)
-{
-	fpi_ssm *ssm = transfer->user_data;
-	g_free(transfer->buffer);
-	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
-		fpi_ssm_mark_failed(ssm, -EIO);
-	else
-		fpi_ssm_next_state(ssm);
-
+		fpi_ssm_mark_failed(ssm, r);
 }
 
 static void
@@ -618,34 +496,17 @@ sm_write_reg(fpi_ssm           *ssm,
 	     uint8_t            reg,
 	     uint8_t            value)
 {
-	struct libusb_transfer *transfer = fpi_usb_alloc();
-	unsigned char *data;
-	int r;
-
-	fp_dbg("set %02x=%02x", reg, value);
-	data = g_malloc(LIBUSB_CONTROL_SETUP_SIZE + 1);
-	libusb_fill_control_setup(data, 0x40, 0x0c, 0, reg, 1);
-	libusb_fill_control_transfer(transfer, fpi_dev_get_usb_dev(FP_DEV(dev)),
-		data, sm_write_reg_cb,
-		ssm, CTRL_TIMEOUT);
+	struct fpi_usb_reg regwrite = { reg, value };
 
-	data[LIBUSB_CONTROL_SETUP_SIZE] = value;
-	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK |
-		LIBUSB_TRANSFER_FREE_TRANSFER;
-
-	r = libusb_submit_transfer(transfer);
-	if (r < 0) {
-		g_free(data);
-		libusb_free_transfer(transfer);
-		fpi_ssm_mark_failed(ssm, r);
-	}
+	sm_write_regs(ssm, FP_DEV(dev), &regwrite, 1);
 }
 
-static void sm_read_reg_cb(struct libusb_transfer *transfer)
+static void sm_read_reg_cb(struct libusb_transfer *transfer,
+			   struct fp_dev          *dev,
+			   fpi_ssm                *ssm,
+			   void                   *user_data)
 {
-	fpi_ssm *ssm = transfer->user_data;
-	struct fp_img_dev *dev = fpi_ssm_get_user_data(ssm);
-	struct sonly_dev *sdev = FP_INSTANCE_DATA(FP_DEV(dev));
+	struct sonly_dev *sdev = FP_INSTANCE_DATA(dev);
 
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
 		fpi_ssm_mark_failed(ssm, -EIO);
@@ -654,8 +515,6 @@ static void sm_read_reg_cb(struct libusb_transfer *transfer)
 		fp_dbg("read reg result = %02x", sdev->read_reg_result);
 		fpi_ssm_next_state(ssm);
 	}
-
-	g_free(transfer->buffer);
 }
 
 static void
@@ -663,25 +522,17 @@ sm_read_reg(fpi_ssm           *ssm,
 	    struct fp_img_dev *dev,
 	    uint8_t            reg)
 {
-	struct libusb_transfer *transfer = fpi_usb_alloc();
-	unsigned char *data;
+	fpi_usb_transfer *transfer;
 	int r;
 
 	fp_dbg("read reg %02x", reg);
-	data = g_malloc(LIBUSB_CONTROL_SETUP_SIZE + 8);
-	libusb_fill_control_setup(data, 0xc0, 0x0c, 0, reg, 8);
-	libusb_fill_control_transfer(transfer, fpi_dev_get_usb_dev(FP_DEV(dev)),
-		data, sm_read_reg_cb,
-		ssm, CTRL_TIMEOUT);
-	transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK |
-		LIBUSB_TRANSFER_FREE_TRANSFER;
+	transfer = fpi_usb_fill_control_transfer(FP_DEV(dev), ssm,
+		0xc0, 0x0c, 0, reg, NULL, 8,
+		sm_read_reg_cb, NULL, CTRL_TIMEOUT);
 
-	r = libusb_submit_transfer(transfer);
-	if (r < 0) {
-		g_free(data);
-		libusb_free_transfer(transfer);
+	r = fpi_usb_submit_transfer(transfer);
+	if (r < 0)
 		fpi_ssm_mark_failed(ssm, r);
-	}
 }
 
 static void sm_await_intr_cb(struct libusb_transfer *transfer)
@@ -844,29 +695,15 @@ static void
 capsm_fire_bulk(fpi_ssm       *ssm,
 		struct fp_dev *_dev)
 {
-	struct fp_img_dev *dev = FP_IMG_DEV(_dev);
 	struct sonly_dev *sdev = FP_INSTANCE_DATA(_dev);
-	int i;
-	for (i = 0; i < NUM_BULK_TRANSFERS; i++) {
-		int r = libusb_submit_transfer(sdev->img_transfer[i]);
-		if (r < 0) {
-			if (i == 0) {
-				/* first one failed: easy peasy */
-				fpi_ssm_mark_failed(ssm, r);
-				return;
-			}
+	int r;
 
-			/* cancel all flying transfers, and request that the SSM
-			 * gets aborted when the last transfer has dropped out of
-			 * the sky */
-			sdev->killing_transfers = ABORT_SSM;
-			sdev->kill_ssm = ssm;
-			sdev->kill_status_code = r;
-			cancel_img_transfers(dev);
-			return;
-		}
-		sdev->img_transfer_data[i].flying = TRUE;
-		sdev->num_flying++;
+	/* if only some of the transfers could be submitted, the stream
+	 * stops and reports a session error */
+	r = fpi_usb_stream_start(sdev->img_stream);
+	if (r < 0) {
+		fpi_ssm_mark_failed(ssm, r);
+		return;
 	}
 	sdev->capturing = TRUE;
 	fpi_ssm_next_state(ssm);
@@ -1207,7 +1044,8 @@ static void deactivate_done(struct fp_img_dev *dev)
 	struct sonly_dev *sdev = FP_INSTANCE_DATA(FP_DEV(dev));
 
 	G_DEBUG_HERE();
-	free_img_transfers(sdev);
+	fpi_usb_stream_free(sdev->img_stream);
+	sdev->img_stream = NULL;
 	g_free(sdev->rowbuf);
 	sdev->rowbuf = NULL;
 
@@ -1272,26 +1110,13 @@ static int dev_activate(struct fp_img_dev *dev, enum fp_imgdev_state state)
 {
 	struct sonly_dev *sdev = FP_INSTANCE_DATA(FP_DEV(dev));
 	fpi_ssm *ssm = NULL;
-	int i;
 
 	sdev->deactivating = FALSE;
 	sdev->capturing = FALSE;
 
-	memset(sdev->img_transfer, 0,
-		NUM_BULK_TRANSFERS * sizeof(struct libusb_transfer *));
-	sdev->img_transfer_data =
-		g_malloc0(sizeof(struct img_transfer_data) * NUM_BULK_TRANSFERS);
-	sdev->num_flying = 0;
-	for (i = 0; i < NUM_BULK_TRANSFERS; i++) {
-		unsigned char *data;
-		sdev->img_transfer[i] = fpi_usb_alloc();
-		sdev->img_transfer_data[i].idx = i;
-		sdev->img_transfer_data[i].dev = dev;
-		data = g_malloc(4096);
-		libusb_fill_bulk_transfer(sdev->img_transfer[i], fpi_dev_get_usb_dev(FP_DEV(dev)),
-			0x81, data,
-			4096, img_data_cb, &sdev->img_transfer_data[i], 0);
-	}
+	sdev->img_stream = fpi_usb_stream_new(FP_DEV(dev), 0x81,
+		NUM_BULK_TRANSFERS, 4096, 0, img_data_cb, img_stream_stopped,
+		dev);
 
 	switch (sdev->dev_model) {
 	case UPEKSONLY_2016:
@@ -27,19 +27,14 @@
 #define IMG_WIDTH_1000	288
 #define IMG_WIDTH_1001	216
 
-struct sonly_regwrite {
-	uint8_t reg;
-	uint8_t value;
-};
-
 /***** AWAIT FINGER *****/
 
-static const struct sonly_regwrite awfsm_2016_writev_1[] = {
+static const struct fpi_usb_reg awfsm_2016_writev_1[] = {
 	{ 0x0a, 0x00 }, { 0x0a, 0x00 }, { 0x09, 0x20 }, { 0x03, 0x3b },
 	{ 0x00, 0x67 }, { 0x00, 0x67 },
 };
 
-static const struct sonly_regwrite awfsm_1000_writev_1[] = {
+static const struct fpi_usb_reg awfsm_1000_writev_1[] = {
 	/* Initialize sensor settings */
 	{ 0x0a, 0x00 }, { 0x09, 0x20 }, { 0x03, 0x37 }, { 0x00, 0x5f },
 	{ 0x01, 0x6e }, { 0x01, 0xee }, { 0x0c, 0x13 }, { 0x0d, 0x0d },
@@ -54,22 +49,22 @@ static const struct sonly_regwrite awfsm_1000_writev_1[] = {
 	{ 0x10, 0x00 }, { 0x11, 0xbf },
 };
 
-static const struct sonly_regwrite awfsm_2016_writev_2[] = {
+static const struct fpi_usb_reg awfsm_2016_writev_2[] = {
 	{ 0x01, 0xc6 }, { 0x0c, 0x13 }, { 0x0d, 0x0d }, { 0x0e, 0x0e },
 	{ 0x0f, 0x0d }, { 0x0b, 0x00 },
 };
 
-static const struct sonly_regwrite awfsm_1000_writev_2[] = {
+static const struct fpi_usb_reg awfsm_1000_writev_2[] = {
 	/* Enable finger detection */
 	{ 0x30, 0xe1 }, { 0x15, 0x06 }, { 0x15, 0x86 },
 };
 
-static const struct sonly_regwrite awfsm_2016_writev_3[] = {
+static const struct fpi_usb_reg awfsm_2016_writev_3[] = {
 	{ 0x13, 0x45 }, { 0x30, 0xe0 }, { 0x12, 0x01 }, { 0x20, 0x01 },
 	{ 0x09, 0x20 }, { 0x0a, 0x00 }, { 0x30, 0xe0 }, { 0x20, 0x01 },
 };
 
-static const struct sonly_regwrite awfsm_2016_writev_4[] = {
+static const struct fpi_usb_reg awfsm_2016_writev_4[] = {
 	{ 0x08, 0x00 }, { 0x10, 0x00 }, { 0x12, 0x01 }, { 0x11, 0xbf },
 	{ 0x12, 0x01 }, { 0x07, 0x10 }, { 0x07, 0x10 }, { 0x04, 0x00 },\
 	{ 0x05, 0x00 }, { 0x0b, 0x00 },
@@ -81,28 +76,28 @@ static const struct sonly_regwrite awfsm_2016_writev_4[] = {
 
 /***** CAPTURE MODE *****/
 
-static const struct sonly_regwrite capsm_2016_writev[] = {
+static const struct fpi_usb_reg capsm_2016_writev[] = {
 	/* enter capture mode */
 	{ 0x09, 0x28 }, { 0x13, 0x55 }, { 0x0b, 0x80 }, { 0x04, 0x00 },
 	{ 0x05, 0x00 },
 };
 
-static const struct sonly_regwrite capsm_1000_writev[] = {
+static const struct fpi_usb_reg capsm_1000_writev[] = {
 	{ 0x08, 0x80 }, { 0x13, 0x55 }, { 0x0b, 0x80 }, /* Enter capture mode */
 };
 
-static const struct sonly_regwrite capsm_1001_writev_1[] = {
+static const struct fpi_usb_reg capsm_1001_writev_1[] = {
 	{ 0x1a, 0x02 },
 	{ 0x4a, 0x9d },
 	{ 0x4e, 0x05 },
 };
 
 
-static const struct sonly_regwrite capsm_1001_writev_2[] = {
+static const struct fpi_usb_reg capsm_1001_writev_2[] = {
 	{ 0x4d, 0xc0 }, { 0x4e, 0x09 },
 };
 
-static const struct sonly_regwrite capsm_1001_writev_3[] = {
+static const struct fpi_usb_reg capsm_1001_writev_3[] = {
 	{ 0x4a, 0x9c },
 	{ 0x1a, 0x00 },
 	{ 0x0b, 0x00 },
@@ -113,7 +108,7 @@ static const struct sonly_regwrite capsm_1001_writev_3[] = {
 	{ 0x4d, 0x40 }, { 0x4e, 0x09 },
 };
 
-static const struct sonly_regwrite capsm_1001_writev_4[] = {
+static const struct fpi_usb_reg capsm_1001_writev_4[] = {
 	{ 0x4a, 0x9c },
 	{ 0x1a, 0x00 },
 	{ 0x1a, 0x02 },
@@ -122,7 +117,7 @@ static const struct sonly_regwrite capsm_1001_writev_4[] = {
 };
 
 
-static const struct sonly_regwrite capsm_1001_writev_5[] = {
+static const struct fpi_usb_reg capsm_1001_writev_5[] = {
 	{ 0x4a, 0x9c },
 	{ 0x1a, 0x00 },
 	{ 0x1a, 0x02 },
@@ -144,18 +139,18 @@ static const struct sonly_regwrite capsm_1001_writev_5[] = {
 
 /***** DEINITIALIZATION *****/
 
-static const struct sonly_regwrite deinitsm_2016_writev[] = {
+static const struct fpi_usb_reg deinitsm_2016_writev[] = {
 	/* reset + enter low power mode */
 	{ 0x0b, 0x00 }, { 0x09, 0x20 }, { 0x13, 0x45 }, { 0x13, 0x45 },
 };
 
-static const struct sonly_regwrite deinitsm_1000_writev[] = {
+static const struct fpi_usb_reg deinitsm_1000_writev[] = {
 	{ 0x15, 0x26 }, { 0x30, 0xe0 }, /* Disable finger detection */
 
 	{ 0x0b, 0x00 }, { 0x13, 0x45 }, { 0x08, 0x00 }, /* Disable capture mode */
 };
 
-static const struct sonly_regwrite deinitsm_1001_writev[] = {
+static const struct fpi_usb_reg deinitsm_1001_writev[] = {
 	{ 0x0b, 0x00 }, 
 	{ 0x13, 0x45 }, 
 	{ 0x09, 0x29 }, 
@@ -164,7 +159,7 @@ static const struct sonly_regwrite deinitsm_1001_writev[] = {
 
 /***** INITIALIZATION *****/
 
-static const struct sonly_regwrite initsm_2016_writev_1[] = {
+static const struct fpi_usb_reg initsm_2016_writev_1[] = {
 	{ 0x49, 0x00 },
 	
 	/* BSAPI writes different values to register 0x3e each time. I initially
@@ -177,7 +172,7 @@ static const struct sonly_regwrite initsm_2016_writev_1[] = {
 	{ 0x44, 0x00 }, { 0x0b, 0x00 },
 };
 
-static const struct sonly_regwrite initsm_1000_writev_1[] = {
+static const struct fpi_usb_reg initsm_1000_writev_1[] = {
 	{ 0x49, 0x00 }, /* Encryption disabled */
 
 	/* Setting encryption key. Doesn't need to be random since we don't use any
@@ -190,7 +185,7 @@ static const struct sonly_regwrite initsm_1000_writev_1[] = {
 	{ 0x0b, 0x00 }, { 0x08, 0x00 }, /* Initialize capture control registers */
 };
 
-static const struct sonly_regwrite initsm_1001_writev_1[] = {
+static const struct fpi_usb_reg initsm_1001_writev_1[] = {
 	{ 0x4a, 0x9d }, 
 	{ 0x4f, 0x06 }, 
 	{ 0x4f, 0x05 }, 
@@ -210,11 +205,11 @@ static const struct sonly_regwrite initsm_1001_writev_1[] = {
 };
 
 
-static const struct sonly_regwrite initsm_1001_writev_2[] = {
+static const struct fpi_usb_reg initsm_1001_writev_2[] = {
 	{ 0x4c, 0x03 }, { 0x4d, 0xb8 }, { 0x4e, 0x00 },
 };
 
-static const struct sonly_regwrite initsm_1001_writev_3[] = {
+static const struct fpi_usb_reg initsm_1001_writev_3[] = {
 	{ 0x4a, 0x9c }, 
 	{ 0x1a, 0x00 }, 
 	{ 0x1a, 0x02 }, 
@@ -223,7 +218,7 @@ static const struct sonly_regwrite initsm_1001_writev_3[] = {
 };
 
 
-static const struct sonly_regwrite initsm_1001_writev_4[] = {
+static const struct fpi_usb_reg initsm_1001_writev_4[] = {
 	{ 0x4a, 0x9c }, 
 	{ 0x1a, 0x00 }, 
 	{ 0x09, 0x27 }, 
@@ -313,7 +308,7 @@ static const struct sonly_regwrite initsm_1001_writev_4[] = {
 	{ 0x4d, 0x40 }, { 0x4e, 0x03 },
 };
 
-static const struct sonly_regwrite initsm_1001_writev_5[] = {
+static const struct fpi_usb_reg initsm_1001_writev_5[] = {
 	{ 0x4a, 0x9c }, 
 	{ 0x1a, 0x00 },
 };
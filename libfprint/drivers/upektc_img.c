@@ -43,7 +43,8 @@ static void start_deactivation(struct fp_img_dev *dev);
 struct upektc_img_dev {
 	unsigned char cmd[MAX_CMD_SIZE];
 	unsigned char response[MAX_RESPONSE_SIZE];
-	unsigned char image_bits[IMAGE_SIZE * 2];
+	/* Handed over to the reported image once complete */
+	unsigned char *image_bits;
 	unsigned char seq;
 	size_t image_size;
 	size_t response_rest;
@@ -279,9 +280,12 @@ static void capture_read_data_cb(struct libusb_transfer *transfer)
 						data);
 				BUG_ON(upekdev->image_size != IMAGE_SIZE);
 				fp_dbg("Image size is %lu\n", upekdev->image_size);
-				img = fpi_img_new(IMAGE_SIZE);
+				img = fpi_img_new_from_buffer(upekdev->image_bits,
+							      IMAGE_SIZE,
+							      upekdev->image_bits,
+							      g_free);
+				upekdev->image_bits = NULL;
 				img->flags = FP_IMG_PARTIAL;
-				memcpy(img->data, upekdev->image_bits, IMAGE_SIZE);
 				fpi_imgdev_image_captured(dev, img);
 				fpi_imgdev_report_finger_status(dev, FALSE);
 				fpi_ssm_mark_completed(ssm);
@@ -361,6 +365,8 @@ static void start_capture(struct fp_img_dev *dev)
 	fpi_ssm *ssm;
 
 	upekdev->image_size = 0;
+	if (!upekdev->image_bits)
+		upekdev->image_bits = g_malloc(IMAGE_SIZE * 2);
 
 	ssm = fpi_ssm_new(FP_DEV(dev), capture_run_state, CAPTURE_NUM_STATES, dev);
 	fpi_ssm_start(ssm, capture_sm_complete);
@@ -605,6 +611,7 @@ static int dev_init(struct fp_img_dev *dev, unsigned long driver_data)
 static void dev_deinit(struct fp_img_dev *dev)
 {
 	struct upektc_img_dev *upekdev = FP_INSTANCE_DATA(FP_DEV(dev));
+	g_free(upekdev->image_bits);
 	g_free(upekdev);
 	libusb_release_interface(fpi_dev_get_usb_dev(FP_DEV(dev)), 0);
 	fpi_imgdev_close_complete(dev);
@@ -164,31 +164,33 @@ struct write_regs_data {
 	void *user_data;
 };
 
-static void write_regs_cb(struct libusb_transfer *transfer)
+static void write_regs_cb(struct libusb_transfer *transfer,
+			  struct fp_dev          *_dev,
+			  fpi_ssm                *ssm,
+			  void                   *user_data)
 {
-	struct write_regs_data *wrdata = transfer->user_data;
+	struct write_regs_data *wrdata = user_data;
 	struct libusb_control_setup *setup =
 		libusb_control_transfer_get_setup(transfer);
 	int r = 0;
-	
+
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
 		r = -EIO;
 	else if (transfer->actual_length != setup->wLength)
 		r = -EPROTO;
 
-	g_free(transfer->buffer);
-	libusb_free_transfer(transfer);
 	wrdata->callback(wrdata->dev, r, wrdata->user_data);
 	g_free(wrdata);
 }
 
+/* Consecutive registers are written by a single control transfer,
+ * starting at the one in wValue */
 static int write_regs(struct fp_img_dev *dev, uint16_t first_reg,
 	uint16_t num_regs, unsigned char *values, write_regs_cb_fn callback,
 	void *user_data)
 {
 	struct write_regs_data *wrdata;
-	struct libusb_transfer *transfer = fpi_usb_alloc();
-	unsigned char *data;
+	fpi_usb_transfer *transfer;
 	int r;
 
 	wrdata = g_malloc(sizeof(*wrdata));
@@ -196,18 +198,12 @@ static int write_regs(struct fp_img_dev *dev, uint16_t first_reg,
 	wrdata->callback = callback;
 	wrdata->user_data = user_data;
 
-	data = g_malloc(LIBUSB_CONTROL_SETUP_SIZE + num_regs);
-	memcpy(data + LIBUSB_CONTROL_SETUP_SIZE, values, num_regs);
-	libusb_fill_control_setup(data, CTRL_OUT, USB_RQ, first_reg, 0, num_regs);
-	libusb_fill_control_transfer(transfer, fpi_dev_get_usb_dev(FP_DEV(dev)), data, write_regs_cb,
-		wrdata, CTRL_TIMEOUT);
-
-	r = libusb_submit_transfer(transfer);
-	if (r < 0) {
+	transfer = fpi_usb_fill_control_transfer(FP_DEV(dev), NULL, CTRL_OUT,
+		USB_RQ, first_reg, 0, values, num_regs, write_regs_cb, wrdata,
+		CTRL_TIMEOUT);
+	r = fpi_usb_submit_transfer(transfer);
+	if (r < 0)
 		g_free(wrdata);
-		g_free(data);
-		libusb_free_transfer(transfer);
-	}
 	return r;
 }
 
@@ -421,14 +417,12 @@ static int start_irq_handler(struct fp_img_dev *dev)
 {
 	struct uru4k_dev *urudev = FP_INSTANCE_DATA(FP_DEV(dev));
 	fpi_usb_transfer *transfer;
-	unsigned char *data;
 	int r;
 
-	data = g_malloc(IRQ_LENGTH);
 	transfer = fpi_usb_fill_bulk_transfer(FP_DEV(dev),
 					      NULL,
 					      EP_INTR,
-					      data,
+					      NULL,
 					      IRQ_LENGTH,
 					      irq_handler,
 					      NULL,
@@ -621,7 +615,8 @@ static void image_transfer_cb(struct libusb_transfer *transfer,
 	} else {
 		struct uru4k_dev *urudev = FP_INSTANCE_DATA(dev);
 
-		urudev->img_data = g_memdup(transfer->buffer, sizeof(struct uru4k_image));
+		/* Keep the buffer, it becomes the storage of the reported image */
+		urudev->img_data = fpi_usb_transfer_steal_buffer(transfer);
 		urudev->img_data_actual_length = transfer->actual_length;
 		fpi_ssm_next_state(ssm);
 	}
@@ -676,7 +671,8 @@ static uint32_t do_decode(uint8_t *data, int num_bytes, uint32_t key)
 static int calc_dev2(struct uru4k_image *img)
 {
 	uint8_t *b[2] = { NULL, NULL };
-	int res = 0, mean = 0, i, r, j, idx;
+	struct fpi_img_stats stats[2], sum_stats;
+	int i, r, j, idx;
 
 	for (i = r = idx = 0; i < G_N_ELEMENTS(img->block_info) && idx < 2; i++) {
 		if (img->block_info[i].flags & BLOCKF_NOT_PRESENT)
@@ -688,17 +684,17 @@ static int calc_dev2(struct uru4k_image *img)
 		fp_dbg("NULL! %p %p", b[0], b[1]);
 		return 0;
 	}
-	for (i = 0; i < IMAGE_WIDTH; i++)
-		mean += (int)b[0][i] + (int)b[1][i];
-
-	mean /= IMAGE_WIDTH;
 
-	for (i = 0; i < IMAGE_WIDTH; i++) {
-		int dev = (int)b[0][i] + (int)b[1][i] - mean;
-		res += dev * dev;
-	}
+	/* Deviation of the sum of both lines, using
+	 * (b0 + b1) ^ 2 = 2 * b0 ^ 2 + 2 * b1 ^ 2 - (b0 - b1) ^ 2 */
+	fpi_img_stats_compute(b[0], IMAGE_WIDTH, &stats[0]);
+	fpi_img_stats_compute(b[1], IMAGE_WIDTH, &stats[1]);
+	sum_stats.count = IMAGE_WIDTH;
+	sum_stats.sum = stats[0].sum + stats[1].sum;
+	sum_stats.sum_sq = 2 * (stats[0].sum_sq + stats[1].sum_sq) -
+		fpi_img_sq_diff_sum(b[0], b[1], IMAGE_WIDTH);
 
-	return res / IMAGE_WIDTH;
+	return fpi_img_stats_sq_dev(&sum_stats);
 }
 
 static void imaging_run_state(fpi_ssm *ssm, struct fp_dev *_dev, void *user_data)
@@ -710,12 +706,28 @@ static void imaging_run_state(fpi_ssm *ssm, struct fp_dev *_dev, void *user_data
 	uint32_t key;
 	uint8_t flags, num_lines;
 	int i, r, to, dev2;
+	int num_blocks, block_from[15], block_to[15], block_lines[15];
 	char buf[5];
 
 	switch (fpi_ssm_get_cur_state(ssm)) {
 	case IMAGING_CAPTURE:
 		urudev->img_lines_done = 0;
 		urudev->img_block = 0;
+
+		/* Left over from a capture which is being retried */
+		g_free(urudev->img_data);
+		urudev->img_data = NULL;
+
+		/* Every capture needs a new buffer, as the previous one was
+		 * handed over to the reported image */
+		urudev->img_transfer = fpi_usb_fill_bulk_transfer(_dev,
+								  ssm,
+								  EP_DATA,
+								  fpi_usb_alloc_buffer(sizeof(struct uru4k_image)),
+								  sizeof(struct uru4k_image),
+								  image_transfer_cb,
+								  NULL,
+								  0);
 		r = fpi_usb_submit_transfer(urudev->img_transfer);
 		if (r < 0) {
 			urudev->img_transfer = NULL;
@@ -796,21 +808,40 @@ static void imaging_run_state(fpi_ssm *ssm, struct fp_dev *_dev, void *user_data
 		fpi_ssm_next_state(ssm);
 		break;
 	case IMAGING_REPORT_IMAGE:
-		fpimg = fpi_img_new_for_imgdev(dev);
-
-		to = r = 0;
+		/* Lay out the blocks of lines in place, missing blocks being
+		 * filled with the lines of the next present one */
+		num_blocks = to = r = 0;
 		for (i = 0; i < G_N_ELEMENTS(img->block_info) && r < img->num_lines; i++) {
 			flags = img->block_info[i].flags;
 			num_lines = img->block_info[i].num_lines;
-			if (num_lines == 0)
+			if (num_lines == 0 || to >= IMAGE_HEIGHT)
 				break;
-			memcpy(&fpimg->data[to], &img->data[r][0],
-				num_lines * IMAGE_WIDTH);
+			block_from[num_blocks] = r;
+			block_to[num_blocks] = to;
+			block_lines[num_blocks] = MIN(num_lines,
+				IMAGE_HEIGHT - to);
+			num_blocks++;
 			if (!(flags & BLOCKF_NOT_PRESENT))
 				r += num_lines;
-			to += num_lines * IMAGE_WIDTH;
+			to += num_lines;
 		}
 
+		/* Blocks only ever move down, so moving the last one first
+		 * never overwrites lines which are still to be moved */
+		for (i = num_blocks - 1; i >= 0; i--)
+			memmove(&img->data[block_to[i]][0],
+				&img->data[block_from[i]][0],
+				block_lines[i] * IMAGE_WIDTH);
+		if (to < IMAGE_HEIGHT)
+			memset(&img->data[to][0], 0,
+			       (IMAGE_HEIGHT - to) * IMAGE_WIDTH);
+
+		fpimg = fpi_img_new_from_buffer(&img->data[0][0],
+						IMAGE_WIDTH * IMAGE_HEIGHT,
+						img, g_free);
+		urudev->img_data = NULL;
+		fpimg->width = IMAGE_WIDTH;
+		fpimg->height = IMAGE_HEIGHT;
 		fpimg->flags = FP_IMG_COLORS_INVERTED;
 		if (!urudev->profile->encryption)
 			fpimg->flags |= FP_IMG_V_FLIPPED | FP_IMG_H_FLIPPED;
@@ -1213,7 +1244,6 @@ static int execute_state_change(struct fp_img_dev *dev)
 {
 	struct uru4k_dev *urudev = FP_INSTANCE_DATA(FP_DEV(dev));
 	fpi_ssm *ssm;
-	void *img_data;
 
 	switch (urudev->activate_state) {
 	case IMGDEV_STATE_INACTIVE:
@@ -1237,17 +1267,7 @@ static int execute_state_change(struct fp_img_dev *dev)
 		urudev->irq_cb = NULL;
 
 		ssm = fpi_ssm_new(FP_DEV(dev), imaging_run_state, IMAGING_NUM_STATES, dev);
-		img_data = g_malloc(sizeof(struct uru4k_image));
 		urudev->img_enc_seed = rand();
-		urudev->img_transfer = fpi_usb_fill_bulk_transfer(FP_DEV(dev),
-								  ssm,
-								  EP_DATA,
-								  img_data,
-								  sizeof(struct uru4k_image),
-								  image_transfer_cb,
-								  NULL,
-								  0);
-
 		fpi_ssm_start(ssm, imaging_complete);
 
 		return write_reg(dev, REG_MODE, MODE_CAPTURE,
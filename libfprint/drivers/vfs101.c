@@ -1465,7 +1465,7 @@ static void dev_deactivate(struct fp_img_dev *dev)
 
 	/* Handle eventualy existing events */
 	while (vdev->transfer)
-		fp_handle_events();
+		fpi_dev_handle_events(FP_DEV(dev));
 
 	/* Notify deactivate complete */
 	fpi_imgdev_deactivate_complete(dev);
@@ -35,10 +35,13 @@
 #include "fpi-dev-img.h"
 #include "fpi-data.h"
 #include "fpi-img.h"
+#include "fpi-poll.h"
 #include "drivers/driver_ids.h"
 
 /* Global variables */
 extern libusb_context *fpi_usb_ctx;
+/* opened devices can be closed from any thread, hold the lock */
+G_LOCK_EXTERN(opened_devices);
 extern GSList *opened_devices;
 
 /* fp_print_data structure definition */
@@ -52,6 +55,10 @@ struct fp_print_data {
 	uint32_t devtype;
 	enum fp_print_data_type type;
 	GSList *prints;
+	/* Allocated as part of a gallery, along with its items */
+	gboolean in_gallery;
+	/* Items and their list are allocated along with the structure */
+	gboolean packed;
 };
 
 /* fp_dev structure definition */
@@ -101,6 +108,16 @@ struct fp_dev {
 	int __enroll_stage;
 	int unconditional_capture;
 
+	/* recycled USB transfers and buffers, see fpi-usb.c */
+	struct fpi_usb_pool *usb_pool;
+	/* state machine timings, see fpi-ssm.c */
+	struct fpi_ssm_trace *ssm_trace;
+
+	/* event context the device was opened in, %NULL for the default one */
+	struct fp_event_ctx *ctx;
+	/* pending timeouts, see fpi-poll.c */
+	GList *timeouts;
+
 	/* async I/O callbacks and data */
 	/* FIXME: convert this to generic state operational data mechanism? */
 	fp_dev_open_cb open_cb;
@@ -143,6 +160,13 @@ struct fp_img_dev {
 
 	/* FIXME: better place to put this? */
 	size_t identify_match_offset;
+
+	struct fpi_img_pool *img_pool;
+
+	/* image being processed on a worker thread, see fpi-dev-img.c */
+	struct fpi_img_job *img_job;
+	/* the finger was removed before the image was processed */
+	gboolean report_pending;
 };
 
 /* fp_driver structure definition */
@@ -195,6 +219,7 @@ struct fp_minutiae {
 
 /* Defined in fpi-dev-img.c */
 void fpi_img_driver_setup(struct fp_img_driver *idriver);
+void fpi_imgdev_exit(void);
 int fpi_imgdev_get_img_width(struct fp_img_dev *imgdev);
 int fpi_imgdev_get_img_height(struct fp_img_dev *imgdev);
 
@@ -207,21 +232,110 @@ enum fp_print_data_type fpi_driver_get_data_type(struct fp_driver *drv);
 
 /* Defined in fpi-data.c */
 void fpi_data_exit(void);
+const char *fpi_data_get_store_dir(void);
 gboolean fpi_print_data_compatible(uint16_t driver_id1, uint32_t devtype1,
 	enum fp_print_data_type type1, uint16_t driver_id2, uint32_t devtype2,
 	enum fp_print_data_type type2);
+int fpi_print_data_gallery_from_data(unsigned char **bufs, size_t *buflens,
+	size_t count, gboolean borrow, struct fp_print_data ***gallery);
+
+/* Defined in fpi-data-codec.c */
+size_t fpi_minutiae_get_length(void);
+size_t fpi_minutiae_encode(const unsigned char *item, size_t length,
+	unsigned char *out, size_t size);
+int fpi_minutiae_decode(const unsigned char *buf, size_t buflen,
+	unsigned char *item);
 
 /* Defined in fpi-img.c */
 gboolean fpi_img_is_sane(struct fp_img *img);
 int fpi_img_to_print_data(struct fp_img_dev *imgdev, struct fp_img *img,
 	struct fp_print_data **ret);
 int fpi_img_compare_print_data(struct fp_print_data *enrolled_print,
-	struct fp_print_data *new_print);
+	struct fp_print_data *new_print, gboolean *cancelled);
 int fpi_img_compare_print_data_to_gallery(struct fp_print_data *print,
-	struct fp_print_data **gallery, int match_threshold, size_t *match_offset);
+	struct fp_print_data **gallery, int match_threshold, size_t *match_offset,
+	gboolean *cancelled);
+
+/* Defined in fpi-img-pool.c */
+struct fpi_img_pool_stats {
+	guint64 allocated;
+	guint64 reused;
+	guint64 returned;
+	guint64 dropped;
+};
+
+struct fpi_img_pool *fpi_img_pool_new(void);
+void fpi_img_pool_close(struct fpi_img_pool *pool);
+struct fp_img *fpi_img_pool_get(struct fpi_img_pool *pool, size_t length);
+void fpi_img_pool_put(struct fp_img *img);
+void fpi_img_pool_get_stats(struct fpi_img_pool *pool,
+	struct fpi_img_pool_stats *stats);
+
+/* Defined in fpi-usb.c */
+struct fpi_usb_pool_stats {
+	guint64 transfer_hits;
+	guint64 transfer_misses;
+	guint64 buffer_hits;
+	guint64 buffer_misses;
+};
+
+struct fpi_usb_pool *fpi_usb_pool_new(void);
+void fpi_usb_pool_close(struct fpi_usb_pool *pool);
+void fpi_usb_pool_get_stats(struct fpi_usb_pool *pool,
+	struct fpi_usb_pool_stats *stats);
+
+/* Defined in fpi-ssm.c */
+struct fpi_ssm_trace *fpi_ssm_trace_new(void);
+void fpi_ssm_trace_close(struct fpi_ssm_trace *trace);
+void fpi_ssm_trace_dump(struct fpi_ssm_trace *trace);
+void fpi_ssm_exit(void);
+
+/* Defined in fpi-assembling.c */
+struct fpi_frame_asmbl_ctx;
+struct fpi_line_asmbl_ctx;
+void fpi_assembling_exit(void);
+void fpi_do_movement_estimation_full(struct fpi_frame_asmbl_ctx *ctx,
+	GSList *stripes, size_t num_stripes, int *error, int *rev_error);
+
+/* Defined in fpi-assembling-dump.c */
+void fpi_assembling_dump_mark_estimated(GSList *stripes, size_t num_stripes);
+void fpi_assembling_dump_frames(struct fpi_frame_asmbl_ctx *ctx,
+	GSList *stripes, size_t num_stripes);
+void fpi_assembling_dump_lines(struct fpi_line_asmbl_ctx *ctx,
+	GSList *lines, size_t num_lines);
+
+/* Exported for use in command-line tools
+ * Defined in fpi-assembling-dump.c */
+struct fprint_assembling_replay_result {
+	gboolean lines;
+	size_t num_items;
+	unsigned int iterations;
+	/* in seconds, per iteration */
+	double min_time;
+	double mean_time;
+	int width;
+	int height;
+	char checksum[65];
+
+	/* frame assembling only */
+	gboolean estimated;
+	gboolean reverse;
+	int error;
+	int rev_error;
+	size_t delta_mismatches;
+
+	/* line assembling only */
+	unsigned long deviation_calls;
+};
+
+int fprint_assembling_replay(const char *path, unsigned int iterations,
+	struct fprint_assembling_replay_result *result);
 
 /* Defined in fpi-poll.c */
 void fpi_timeout_cancel_all_for_dev(struct fp_dev *dev);
+void fpi_dev_post(struct fp_dev *dev, fpi_timeout_fn callback, void *data);
+int fpi_event_ctx_handle_events(struct fp_event_ctx *ctx);
+libusb_context *fpi_event_ctx_get_usb_ctx(struct fp_event_ctx *ctx);
 void fpi_poll_init(void);
 void fpi_poll_exit(void);
 
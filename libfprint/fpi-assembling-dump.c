@@ -0,0 +1,545 @@
+/*
+ * Recording and replay of image assembling input
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "assembling"
+
+#include "fp_internal.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "fpi-assembling.h"
+
+/*
+ * When the FP_ASSEMBLING_DUMP_DIR environment variable is set, the input
+ * of every fpi_assemble_frames() and fpi_assemble_lines() call is written
+ * to a file in that directory, so that assembling can be replayed and
+ * benchmarked without the hardware, using fprint-assembling-benchmark.
+ *
+ * The driver callbacks can't be saved, so the dumps contain what the
+ * assembling routines get out of them: the pixels as returned by
+ * get_pixel() and, for lines, the result of get_deviation() for every pair
+ * of lines that the assembling routines may compare.
+ *
+ * All values are 32-bit little-endian integers:
+ *   magic, version, type
+ *   frames: frame_width, frame_height, image_width, num_stripes, estimated
+ *           then for each stripe: delta_x, delta_y, pixels (bytes)
+ *   lines:  line_width, max_height, resolution, median_filter_size,
+ *           max_search_offset, num_lines
+ *           then for each line: pixels (bytes)
+ *           then for each even line i: deviation against lines i + 1 to
+ *           i + max_search_offset
+ */
+
+#define DUMP_MAGIC		0x4d534146	/* "FASM" */
+#define DUMP_VERSION		1
+#define DUMP_TYPE_FRAMES	1
+#define DUMP_TYPE_LINES		2
+
+G_LOCK_DEFINE_STATIC(dump_counter);
+static guint dump_counter = 0;
+
+/* Devices can be driven from separate threads, while a driver estimates
+ * the movement between its frames and assembles them from the same one,
+ * and replays don't leave the calling thread. This is therefore kept per
+ * thread, so that devices don't see each other's stripes. */
+struct dump_thread_state {
+	gboolean replaying;
+	GSList *estimated_stripes;
+	size_t estimated_num_stripes;
+};
+
+static GPrivate thread_state = G_PRIVATE_INIT(g_free);
+
+static struct dump_thread_state *get_thread_state(void)
+{
+	struct dump_thread_state *state = g_private_get(&thread_state);
+
+	if (!state) {
+		state = g_new0(struct dump_thread_state, 1);
+		g_private_set(&thread_state, state);
+	}
+	return state;
+}
+
+static const char *dump_dir(void)
+{
+	if (get_thread_state()->replaying)
+		return NULL;
+	return g_getenv("FP_ASSEMBLING_DUMP_DIR");
+}
+
+static void append_u32(GByteArray *buf, guint32 val)
+{
+	val = GUINT32_TO_LE(val);
+	g_byte_array_append(buf, (guint8 *) &val, sizeof(val));
+}
+
+static void write_dump(const char *type, GByteArray *buf)
+{
+	GError *err = NULL;
+	char *filename, *path;
+	guint counter;
+
+	G_LOCK(dump_counter);
+	counter = dump_counter++;
+	G_UNLOCK(dump_counter);
+
+	filename = g_strdup_printf("%s-%" G_GINT64_FORMAT "-%u.fpasm", type,
+				   g_get_real_time(), counter);
+	path = g_build_filename(dump_dir(), filename, NULL);
+
+	g_file_set_contents(path, (char *) buf->data, buf->len, &err);
+	if (err) {
+		fp_err("could not write assembling dump %s: %s", path, err->message);
+		g_error_free(err);
+	} else {
+		fp_dbg("assembling input written to %s", path);
+	}
+
+	g_byte_array_free(buf, TRUE);
+	g_free(filename);
+	g_free(path);
+}
+
+void fpi_assembling_dump_mark_estimated(GSList *stripes, size_t num_stripes)
+{
+	struct dump_thread_state *state = get_thread_state();
+
+	state->estimated_stripes = stripes;
+	state->estimated_num_stripes = num_stripes;
+}
+
+void fpi_assembling_dump_frames(struct fpi_frame_asmbl_ctx *ctx,
+				GSList *stripes, size_t num_stripes)
+{
+	struct dump_thread_state *state = get_thread_state();
+	GByteArray *buf;
+	GSList *l;
+	gboolean estimated;
+	size_t i;
+
+	estimated = (stripes == state->estimated_stripes &&
+		     num_stripes == state->estimated_num_stripes);
+	state->estimated_stripes = NULL;
+
+	if (!dump_dir())
+		return;
+
+	buf = g_byte_array_new();
+	append_u32(buf, DUMP_MAGIC);
+	append_u32(buf, DUMP_VERSION);
+	append_u32(buf, DUMP_TYPE_FRAMES);
+	append_u32(buf, ctx->frame_width);
+	append_u32(buf, ctx->frame_height);
+	append_u32(buf, ctx->image_width);
+	append_u32(buf, num_stripes);
+	append_u32(buf, estimated);
+
+	for (i = 0, l = stripes; i < num_stripes && l; i++, l = g_slist_next(l)) {
+		struct fpi_frame *frame = l->data;
+		unsigned int x, y;
+
+		append_u32(buf, frame->delta_x);
+		append_u32(buf, frame->delta_y);
+		for (y = 0; y < ctx->frame_height; y++) {
+			for (x = 0; x < ctx->frame_width; x++) {
+				guint8 pixel = ctx->get_pixel(ctx, frame, x, y);
+				g_byte_array_append(buf, &pixel, 1);
+			}
+		}
+	}
+
+	write_dump("frames", buf);
+}
+
+void fpi_assembling_dump_lines(struct fpi_line_asmbl_ctx *ctx,
+			       GSList *lines, size_t num_lines)
+{
+	GByteArray *buf;
+	GSList *row1, *row2;
+	size_t i, j;
+
+	if (!dump_dir())
+		return;
+
+	buf = g_byte_array_new();
+	append_u32(buf, DUMP_MAGIC);
+	append_u32(buf, DUMP_VERSION);
+	append_u32(buf, DUMP_TYPE_LINES);
+	append_u32(buf, ctx->line_width);
+	append_u32(buf, ctx->max_height);
+	append_u32(buf, ctx->resolution);
+	append_u32(buf, ctx->median_filter_size);
+	append_u32(buf, ctx->max_search_offset);
+	append_u32(buf, num_lines);
+
+	for (i = 0, row1 = lines; i < num_lines; i++, row1 = g_slist_next(row1)) {
+		unsigned int x;
+
+		for (x = 0; x < ctx->line_width; x++) {
+			guint8 pixel = row1 ? ctx->get_pixel(ctx, row1, x) : 0;
+			g_byte_array_append(buf, &pixel, 1);
+		}
+	}
+
+	for (i = 0, row1 = lines; i < num_lines - 1; i += 2) {
+		size_t lastrow = MIN(i + ctx->max_search_offset, num_lines - 1);
+
+		row2 = g_slist_next(row1);
+		for (j = i + 1; j <= lastrow; j++, row2 = g_slist_next(row2))
+			append_u32(buf, (row1 && row2) ?
+				   ctx->get_deviation(ctx, row1, row2) : G_MAXINT);
+		row1 = g_slist_next(g_slist_next(row1));
+	}
+
+	write_dump("lines", buf);
+}
+
+/* Replay */
+
+struct dump_reader {
+	const guint8 *data;
+	gsize len;
+	gsize pos;
+	gboolean error;
+};
+
+static guint32 read_u32(struct dump_reader *r)
+{
+	guint32 val;
+
+	if (r->error || r->len - r->pos < sizeof(val)) {
+		r->error = TRUE;
+		return 0;
+	}
+	memcpy(&val, r->data + r->pos, sizeof(val));
+	r->pos += sizeof(val);
+	return GUINT32_FROM_LE(val);
+}
+
+static const guint8 *read_bytes(struct dump_reader *r, gsize len)
+{
+	const guint8 *ret;
+
+	if (r->error || r->len - r->pos < len) {
+		r->error = TRUE;
+		return NULL;
+	}
+	ret = r->data + r->pos;
+	r->pos += len;
+	return ret;
+}
+
+static void checksum_img(struct fp_img *img,
+			 struct fprint_assembling_replay_result *result)
+{
+	char *checksum;
+
+	result->width = img->width;
+	result->height = img->height;
+	checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA256, img->data,
+					       img->width * img->height);
+	g_strlcpy(result->checksum, checksum, sizeof(result->checksum));
+	g_free(checksum);
+}
+
+static void record_time(struct fprint_assembling_replay_result *result,
+			GTimer *timer, unsigned int iteration)
+{
+	double elapsed = g_timer_elapsed(timer, NULL);
+
+	if (iteration == 0 || elapsed < result->min_time)
+		result->min_time = elapsed;
+	result->mean_time += elapsed / result->iterations;
+}
+
+static unsigned char replay_frame_get_pixel(struct fpi_frame_asmbl_ctx *ctx,
+					    struct fpi_frame *frame,
+					    unsigned int x,
+					    unsigned int y)
+{
+	return frame->data[y * ctx->frame_width + x];
+}
+
+static int replay_frames(struct dump_reader *r,
+			 struct fprint_assembling_replay_result *result)
+{
+	struct fpi_frame_asmbl_ctx ctx = { 0, };
+	struct fpi_frame **frames;
+	int *deltas;
+	GSList *stripes = NULL;
+	GTimer *timer;
+	size_t frame_size, i;
+	unsigned int it;
+
+	ctx.frame_width = read_u32(r);
+	ctx.frame_height = read_u32(r);
+	ctx.image_width = read_u32(r);
+	ctx.get_pixel = replay_frame_get_pixel;
+	result->num_items = read_u32(r);
+	result->estimated = read_u32(r);
+	frame_size = (gsize) ctx.frame_width * ctx.frame_height;
+
+	if (r->error || result->num_items == 0 || frame_size == 0 ||
+	    ctx.image_width < ctx.frame_width ||
+	    result->num_items > (r->len - r->pos) / frame_size)
+		return -EINVAL;
+
+	frames = g_new0(struct fpi_frame *, result->num_items);
+	deltas = g_new(int, result->num_items * 2);
+	for (i = 0; i < result->num_items; i++) {
+		const guint8 *pixels;
+
+		deltas[2 * i] = (gint32) read_u32(r);
+		deltas[2 * i + 1] = (gint32) read_u32(r);
+		pixels = read_bytes(r, frame_size);
+		if (!pixels)
+			break;
+		frames[i] = g_malloc(sizeof(struct fpi_frame) + frame_size);
+		memcpy(frames[i]->data, pixels, frame_size);
+		stripes = g_slist_prepend(stripes, frames[i]);
+	}
+	stripes = g_slist_reverse(stripes);
+
+	if (r->error) {
+		g_slist_free_full(stripes, g_free);
+		g_free(frames);
+		g_free(deltas);
+		return -EINVAL;
+	}
+
+	timer = g_timer_new();
+	for (it = 0; it < result->iterations; it++) {
+		struct fp_img *img;
+
+		for (i = 0; i < result->num_items; i++) {
+			frames[i]->delta_x = deltas[2 * i];
+			frames[i]->delta_y = deltas[2 * i + 1];
+		}
+
+		g_timer_start(timer);
+		if (result->estimated)
+			fpi_do_movement_estimation_full(&ctx, stripes,
+							result->num_items,
+							&result->error,
+							&result->rev_error);
+		img = fpi_assemble_frames(&ctx, stripes, result->num_items);
+		g_timer_stop(timer);
+		record_time(result, timer, it);
+
+		if (it == result->iterations - 1) {
+			/* Assembled upwards when no flip is needed */
+			result->reverse = !(img->flags & FP_IMG_V_FLIPPED);
+			result->delta_mismatches = 0;
+			/* The first frame's delta is always reset */
+			for (i = 1; i < result->num_items; i++) {
+				if (frames[i]->delta_x != deltas[2 * i] ||
+				    frames[i]->delta_y != deltas[2 * i + 1])
+					result->delta_mismatches++;
+			}
+			checksum_img(img, result);
+		}
+		fp_img_free(img);
+	}
+	g_timer_destroy(timer);
+
+	g_slist_free_full(stripes, g_free);
+	g_free(frames);
+	g_free(deltas);
+	return 0;
+}
+
+struct replay_line {
+	size_t index;
+	unsigned char data[0];
+};
+
+struct replay_line_ctx {
+	struct fpi_line_asmbl_ctx ctx;
+	size_t num_lines;
+	/* recorded deviations, and the index of each even line's first one */
+	const guint8 *deviations;
+	size_t *deviation_start;
+	unsigned long deviation_calls;
+};
+
+static unsigned char replay_line_get_pixel(struct fpi_line_asmbl_ctx *ctx,
+					   GSList *line,
+					   unsigned int x)
+{
+	struct replay_line *l = line->data;
+
+	return l->data[x];
+}
+
+static int replay_line_get_deviation(struct fpi_line_asmbl_ctx *ctx,
+				     GSList *line1, GSList *line2)
+{
+	struct replay_line_ctx *rctx = container_of(ctx, struct replay_line_ctx, ctx);
+	struct replay_line *l1 = line1->data;
+	struct replay_line *l2 = line2->data;
+	guint32 val;
+
+	rctx->deviation_calls++;
+
+	/* Only deviations from even lines to the following lines are
+	 * recorded, which is all the assembling code looks up */
+	if ((l1->index & 1) || l2->index <= l1->index ||
+	    l2->index - l1->index > ctx->max_search_offset) {
+		fp_warn("deviation between lines %zu and %zu wasn't recorded",
+			l1->index, l2->index);
+		return G_MAXINT;
+	}
+
+	memcpy(&val, rctx->deviations +
+	       (rctx->deviation_start[l1->index / 2] + l2->index - l1->index - 1) * sizeof(val),
+	       sizeof(val));
+	return (gint32) GUINT32_FROM_LE(val);
+}
+
+static int replay_lines(struct dump_reader *r,
+			struct fprint_assembling_replay_result *result)
+{
+	struct replay_line_ctx rctx = { { 0, }, };
+	GSList *lines = NULL;
+	GTimer *timer;
+	size_t i, num_deviations = 0;
+	unsigned int it;
+
+	rctx.ctx.line_width = read_u32(r);
+	rctx.ctx.max_height = read_u32(r);
+	rctx.ctx.resolution = read_u32(r);
+	rctx.ctx.median_filter_size = read_u32(r);
+	rctx.ctx.max_search_offset = read_u32(r);
+	rctx.ctx.get_pixel = replay_line_get_pixel;
+	rctx.ctx.get_deviation = replay_line_get_deviation;
+	rctx.num_lines = result->num_items = read_u32(r);
+
+	if (r->error || rctx.num_lines < 2 || rctx.ctx.line_width == 0 ||
+	    rctx.num_lines > (r->len - r->pos) / rctx.ctx.line_width)
+		return -EINVAL;
+
+	for (i = 0; i < rctx.num_lines; i++) {
+		struct replay_line *line;
+		const guint8 *pixels = read_bytes(r, rctx.ctx.line_width);
+
+		if (!pixels)
+			break;
+		line = g_malloc(sizeof(*line) + rctx.ctx.line_width);
+		line->index = i;
+		memcpy(line->data, pixels, rctx.ctx.line_width);
+		lines = g_slist_prepend(lines, line);
+	}
+	lines = g_slist_reverse(lines);
+
+	rctx.deviation_start = g_new0(size_t, rctx.num_lines / 2 + 1);
+	for (i = 0; i < rctx.num_lines - 1; i += 2) {
+		rctx.deviation_start[i / 2] = num_deviations;
+		num_deviations += MIN(i + rctx.ctx.max_search_offset,
+				      rctx.num_lines - 1) - i;
+	}
+	rctx.deviations = read_bytes(r, num_deviations * sizeof(guint32));
+
+	if (r->error) {
+		g_slist_free_full(lines, g_free);
+		g_free(rctx.deviation_start);
+		return -EINVAL;
+	}
+
+	timer = g_timer_new();
+	for (it = 0; it < result->iterations; it++) {
+		struct fp_img *img;
+
+		rctx.deviation_calls = 0;
+		g_timer_start(timer);
+		img = fpi_assemble_lines(&rctx.ctx, lines, rctx.num_lines);
+		g_timer_stop(timer);
+		record_time(result, timer, it);
+
+		if (it == result->iterations - 1) {
+			result->deviation_calls = rctx.deviation_calls;
+			checksum_img(img, result);
+		}
+		fp_img_free(img);
+	}
+	g_timer_destroy(timer);
+
+	g_slist_free_full(lines, g_free);
+	g_free(rctx.deviation_start);
+	return 0;
+}
+
+/* Exported for use in command-line tools */
+API_EXPORTED int fprint_assembling_replay(const char *path,
+					  unsigned int iterations,
+					  struct fprint_assembling_replay_result *result)
+{
+	struct dump_reader r = { 0, };
+	GError *err = NULL;
+	gchar *contents;
+	struct dump_thread_state *state;
+	gsize length;
+	int ret;
+
+	g_return_val_if_fail (path != NULL, -EINVAL);
+	g_return_val_if_fail (iterations > 0, -EINVAL);
+	g_return_val_if_fail (result != NULL, -EINVAL);
+
+	g_file_get_contents(path, &contents, &length, &err);
+	if (err) {
+		fp_err("%s load failed: %s", path, err->message);
+		g_error_free(err);
+		return -EIO;
+	}
+
+	memset(result, 0, sizeof(*result));
+	result->iterations = iterations;
+
+	r.data = (guint8 *) contents;
+	r.len = length;
+	if (read_u32(&r) != DUMP_MAGIC || read_u32(&r) != DUMP_VERSION) {
+		fp_err("%s is not an assembling dump", path);
+		g_free(contents);
+		return -EINVAL;
+	}
+
+	state = get_thread_state();
+	state->replaying = TRUE;
+	switch (read_u32(&r)) {
+	case DUMP_TYPE_FRAMES:
+		ret = replay_frames(&r, result);
+		break;
+	case DUMP_TYPE_LINES:
+		result->lines = TRUE;
+		ret = replay_lines(&r, result);
+		break;
+	default:
+		ret = -EINVAL;
+	}
+	state->replaying = FALSE;
+
+	if (ret < 0)
+		fp_err("%s is truncated or corrupted", path);
+
+	g_free(contents);
+	return ret;
+}
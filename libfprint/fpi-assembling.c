@@ -96,6 +96,8 @@ static unsigned int calc_error(struct fpi_frame_asmbl_ctx *ctx,
 static void find_overlap(struct fpi_frame_asmbl_ctx *ctx,
 			 struct fpi_frame *first_frame,
 			 struct fpi_frame *second_frame,
+			 int *delta_x,
+			 int *delta_y,
 			 unsigned int *min_error)
 {
 	int dx, dy;
@@ -113,54 +115,228 @@ static void find_overlap(struct fpi_frame_asmbl_ctx *ctx,
 				dx, dy);
 			if (err < *min_error) {
 				*min_error = err;
-				second_frame->delta_x = -dx;
-				second_frame->delta_y = dy;
+				*delta_x = -dx;
+				*delta_y = dy;
 			}
 		}
 	}
 }
 
-static unsigned int do_movement_estimation(struct fpi_frame_asmbl_ctx *ctx,
-			    GSList *stripes, size_t num_stripes,
-			    gboolean reverse)
+/* Below this number of stripes, the overlap searches are run in the calling
+ * thread, as waking up the workers would cost more than it saves */
+#define PARALLEL_MIN_STRIPES	8
+/* Default upper bound for the number of worker threads */
+#define PARALLEL_MAX_THREADS	8
+
+struct overlap_batch {
+	GMutex mutex;
+	GCond cond;
+	int pending;
+};
+
+struct overlap_job {
+	struct fpi_frame_asmbl_ctx *ctx;
+	struct fpi_frame *first_frame;
+	struct fpi_frame *second_frame;
+	int delta_x;
+	int delta_y;
+	unsigned int min_error;
+	struct overlap_batch *batch;
+};
+
+G_LOCK_DEFINE_STATIC(overlap_pool);
+static GThreadPool *overlap_pool = NULL;
+static gboolean overlap_pool_disabled = FALSE;
+
+static void overlap_job_run(struct overlap_job *job)
+{
+	find_overlap(job->ctx, job->first_frame, job->second_frame,
+		     &job->delta_x, &job->delta_y, &job->min_error);
+}
+
+static void overlap_pool_func(gpointer data, gpointer user_data)
+{
+	struct overlap_job *job = data;
+	struct overlap_batch *batch = job->batch;
+
+	overlap_job_run(job);
+
+	g_mutex_lock(&batch->mutex);
+	if (--batch->pending == 0)
+		g_cond_signal(&batch->cond);
+	g_mutex_unlock(&batch->mutex);
+}
+
+/* Returns the worker pool, or NULL if the overlap searches should be done
+ * serially. The number of threads defaults to the number of CPUs, and can
+ * be overridden through the FP_ASSEMBLING_THREADS environment variable,
+ * with 0 or 1 disabling the pool. Both are capped to PARALLEL_MAX_THREADS. */
+static GThreadPool *get_overlap_pool(void)
+{
+	GThreadPool *pool;
+
+	G_LOCK(overlap_pool);
+	if (overlap_pool == NULL && !overlap_pool_disabled) {
+		const char *env = g_getenv("FP_ASSEMBLING_THREADS");
+		guint num_threads = MIN(g_get_num_processors(),
+					PARALLEL_MAX_THREADS);
+
+		if (env) {
+			char *end;
+			guint64 val = g_ascii_strtoull(env, &end, 10);
+
+			/* g_ascii_strtoull() wraps negative values around */
+			if (*env == '\0' || *end != '\0' || strchr(env, '-'))
+				fp_warn("invalid FP_ASSEMBLING_THREADS value %s",
+					env);
+			else
+				num_threads = MIN(val, PARALLEL_MAX_THREADS);
+		}
+
+		if (num_threads > 1) {
+			fp_dbg("using %u threads for movement estimation", num_threads);
+			overlap_pool = g_thread_pool_new(overlap_pool_func, NULL,
+							 num_threads, FALSE, NULL);
+		}
+		if (overlap_pool == NULL)
+			overlap_pool_disabled = TRUE;
+	}
+	pool = overlap_pool;
+	G_UNLOCK(overlap_pool);
+
+	return pool;
+}
+
+void fpi_assembling_exit(void)
+{
+	G_LOCK(overlap_pool);
+	if (overlap_pool)
+		g_thread_pool_free(overlap_pool, FALSE, TRUE);
+	overlap_pool = NULL;
+	overlap_pool_disabled = FALSE;
+	G_UNLOCK(overlap_pool);
+}
+
+static void run_overlap_jobs(struct overlap_job *jobs, size_t num_jobs,
+			     size_t num_stripes)
+{
+	struct overlap_batch batch;
+	GThreadPool *pool = NULL;
+	size_t i;
+
+	if (num_stripes >= PARALLEL_MIN_STRIPES)
+		pool = get_overlap_pool();
+
+	if (pool == NULL) {
+		for (i = 0; i < num_jobs; i++)
+			overlap_job_run(&jobs[i]);
+		return;
+	}
+
+	g_mutex_init(&batch.mutex);
+	g_cond_init(&batch.cond);
+	batch.pending = num_jobs;
+
+	for (i = 0; i < num_jobs; i++) {
+		jobs[i].batch = &batch;
+		if (!g_thread_pool_push(pool, &jobs[i], NULL))
+			overlap_pool_func(&jobs[i], NULL);
+	}
+
+	g_mutex_lock(&batch.mutex);
+	while (batch.pending > 0)
+		g_cond_wait(&batch.cond, &batch.mutex);
+	g_mutex_unlock(&batch.mutex);
+
+	g_mutex_clear(&batch.mutex);
+	g_cond_clear(&batch.cond);
+}
+
+/* Same as fpi_do_movement_estimation(), also returning the mean error
+ * of the forward and reverse estimations */
+void fpi_do_movement_estimation_full(struct fpi_frame_asmbl_ctx *ctx,
+				     GSList *stripes, size_t num_stripes,
+				     int *error, int *rev_error)
 {
-	GSList *list_entry = stripes;
+	struct overlap_job *jobs;
+	struct fpi_frame **frames;
+	GSList *list_entry;
 	GTimer *timer;
-	int frame = 1;
-	struct fpi_frame *prev_stripe = list_entry->data;
-	unsigned int min_error;
+	size_t i, num_pairs;
 	/* Max error is width * height * 255, for AES2501 which has the largest
 	 * sensor its 192*16*255 = 783360. So for 32bit value it's ~5482 frame before
 	 * we might get int overflow. Use 64bit value here to prevent integer overflow
 	 */
-	unsigned long long total_error = 0;
-
-	list_entry = g_slist_next(list_entry);
+	unsigned long long total_error = 0, total_rev_error = 0;
+	int err, rev_err;
 
-	timer = g_timer_new();
-	do {
-		struct fpi_frame *cur_stripe = list_entry->data;
+	g_return_if_fail (stripes != NULL);
 
-		if (reverse) {
-			find_overlap(ctx, prev_stripe, cur_stripe, &min_error);
-			cur_stripe->delta_y = -cur_stripe->delta_y;
-			cur_stripe->delta_x = -cur_stripe->delta_x;
-		}
-		else
-			find_overlap(ctx, cur_stripe, prev_stripe, &min_error);
-		total_error += min_error;
+	if (error)
+		*error = 0;
+	if (rev_error)
+		*rev_error = 0;
 
-		frame++;
-		prev_stripe = cur_stripe;
-		list_entry = g_slist_next(list_entry);
+	if (num_stripes < 2)
+		return;
 
-	} while (frame < num_stripes);
+	num_pairs = num_stripes - 1;
+	frames = g_new(struct fpi_frame *, num_stripes);
+	for (i = 0, list_entry = stripes; i < num_stripes && list_entry;
+	     i++, list_entry = g_slist_next(list_entry))
+		frames[i] = list_entry->data;
+	BUG_ON(i != num_stripes);
+
+	/* Even jobs hold the forward search, odd ones the reverse search */
+	jobs = g_new0(struct overlap_job, num_pairs * 2);
+	for (i = 0; i < num_pairs; i++) {
+		jobs[2 * i].ctx = ctx;
+		jobs[2 * i].first_frame = frames[i + 1];
+		jobs[2 * i].second_frame = frames[i];
+		jobs[2 * i + 1].ctx = ctx;
+		jobs[2 * i + 1].first_frame = frames[i];
+		jobs[2 * i + 1].second_frame = frames[i + 1];
+	}
 
+	timer = g_timer_new();
+	run_overlap_jobs(jobs, num_pairs * 2, num_stripes);
 	g_timer_stop(timer);
 	fp_dbg("calc delta completed in %f secs", g_timer_elapsed(timer, NULL));
 	g_timer_destroy(timer);
 
-	return total_error / num_stripes;
+	for (i = 0; i < num_pairs; i++) {
+		total_error += jobs[2 * i].min_error;
+		total_rev_error += jobs[2 * i + 1].min_error;
+	}
+	err = total_error / num_stripes;
+	rev_err = total_rev_error / num_stripes;
+	fp_dbg("errors: %d rev: %d", err, rev_err);
+	if (error)
+		*error = err;
+	if (rev_error)
+		*rev_error = rev_err;
+
+	/* The forward search gives the offset of each frame relative to the
+	 * next one, the reverse search the offset relative to the previous one.
+	 * Frames not covered by the chosen direction keep the other direction's
+	 * result, as they always did. */
+	for (i = 0; i < num_pairs; i++) {
+		frames[i]->delta_x = jobs[2 * i].delta_x;
+		frames[i]->delta_y = jobs[2 * i].delta_y;
+	}
+	for (i = 0; i < num_pairs; i++) {
+		frames[i + 1]->delta_x = -jobs[2 * i + 1].delta_x;
+		frames[i + 1]->delta_y = -jobs[2 * i + 1].delta_y;
+	}
+	if (err < rev_err) {
+		for (i = 0; i < num_pairs; i++) {
+			frames[i]->delta_x = jobs[2 * i].delta_x;
+			frames[i]->delta_y = jobs[2 * i].delta_y;
+		}
+	}
+
+	g_free(jobs);
+	g_free(frames);
 }
 
 /**
@@ -176,19 +352,19 @@ static unsigned int do_movement_estimation(struct fpi_frame_asmbl_ctx *ctx,
  * in hardware. If hardware movement estimation is supported, the driver
  * should populate @delta_x and @delta_y instead.
  *
+ * The overlap between each pair of adjacent frames is searched for in both
+ * swipe directions, and for long swipes, those searches are spread over
+ * a pool of worker threads. The @get_pixel accessor of @ctx must therefore
+ * be safe to call from multiple threads at once.
+ *
  * Note that @num_stripes might be shorter than the length of the list,
  * if some stripes should be skipped.
  */
 void fpi_do_movement_estimation(struct fpi_frame_asmbl_ctx *ctx,
 			    GSList *stripes, size_t num_stripes)
 {
-	int err, rev_err;
-	err = do_movement_estimation(ctx, stripes, num_stripes, FALSE);
-	rev_err = do_movement_estimation(ctx, stripes, num_stripes, TRUE);
-	fp_dbg("errors: %d rev: %d", err, rev_err);
-	if (err < rev_err) {
-		do_movement_estimation(ctx, stripes, num_stripes, FALSE);
-	}
+	fpi_do_movement_estimation_full(ctx, stripes, num_stripes, NULL, NULL);
+	fpi_assembling_dump_mark_estimated(stripes, num_stripes);
 }
 
 static inline void aes_blit_stripe(struct fpi_frame_asmbl_ctx *ctx,
@@ -280,6 +456,8 @@ struct fp_img *fpi_assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
 	BUG_ON(num_stripes == 0);
 	BUG_ON(ctx->image_width < ctx->frame_width);
 
+	fpi_assembling_dump_frames(ctx, stripes, num_stripes);
+
 	/* Calculate height */
 	i = 0;
 	stripe = stripes;
@@ -341,55 +519,236 @@ struct fp_img *fpi_assemble_frames(struct fpi_frame_asmbl_ctx *ctx,
 	return img;
 }
 
-static int cmpint(const void *p1, const void *p2, gpointer data)
+/* Sliding window median filter
+ *
+ * The window is kept split in two heaps: a max-heap holding the lower half
+ * of the values and a min-heap holding the upper half, so the median is the
+ * top of the upper heap. Window slots are indexed modulo the window length,
+ * and each slot remembers its position in the heaps, so that the value
+ * leaving the window can be removed in O(log k) without searching for it.
+ *
+ * For an even number of values (which happens at the edges of the data),
+ * the upper median is used.
+ */
+struct median_heaps {
+	int *vals;	/* value of each window slot */
+	int *pos;	/* heap position of each window slot, ~pos for the upper heap */
+	int *lower;	/* max-heap of slots */
+	int *upper;	/* min-heap of slots */
+	int nlower;
+	int nupper;
+};
+
+#define MEDIAN_HEAP_SCRATCH_SIZE(filtersize) (4 * MAX((filtersize), 1))
+
+static inline gboolean median_heap_before(struct median_heaps *h,
+					  gboolean is_upper, int a, int b)
 {
-	int a = *((int *)p1);
-	int b = *((int *)p2);
-	if (a < b)
-		return -1;
-	else if (a == b)
-		return 0;
+	if (is_upper)
+		return h->vals[a] < h->vals[b];
+	return h->vals[a] > h->vals[b];
+}
+
+static inline void median_heap_set(struct median_heaps *h, gboolean is_upper,
+				   int idx, int slot)
+{
+	if (is_upper) {
+		h->upper[idx] = slot;
+		h->pos[slot] = ~idx;
+	} else {
+		h->lower[idx] = slot;
+		h->pos[slot] = idx;
+	}
+}
+
+static void median_heap_sift(struct median_heaps *h, gboolean is_upper, int idx)
+{
+	int *heap = is_upper ? h->upper : h->lower;
+	int n = is_upper ? h->nupper : h->nlower;
+	int slot = heap[idx];
+
+	/* Sift up */
+	while (idx > 0) {
+		int parent = (idx - 1) / 2;
+		if (!median_heap_before(h, is_upper, slot, heap[parent]))
+			break;
+		median_heap_set(h, is_upper, idx, heap[parent]);
+		idx = parent;
+	}
+
+	/* Sift down */
+	for (;;) {
+		int child = 2 * idx + 1;
+		if (child >= n)
+			break;
+		if (child + 1 < n &&
+		    median_heap_before(h, is_upper, heap[child + 1], heap[child]))
+			child++;
+		if (!median_heap_before(h, is_upper, heap[child], slot))
+			break;
+		median_heap_set(h, is_upper, idx, heap[child]);
+		idx = child;
+	}
+
+	median_heap_set(h, is_upper, idx, slot);
+}
+
+static void median_heap_push(struct median_heaps *h, gboolean is_upper, int slot)
+{
+	int idx = is_upper ? h->nupper++ : h->nlower++;
+
+	median_heap_set(h, is_upper, idx, slot);
+	median_heap_sift(h, is_upper, idx);
+}
+
+static int median_heap_pop(struct median_heaps *h, gboolean is_upper, int idx)
+{
+	int *heap = is_upper ? h->upper : h->lower;
+	int last = is_upper ? --h->nupper : --h->nlower;
+	int slot = heap[idx];
+
+	if (idx != last) {
+		median_heap_set(h, is_upper, idx, heap[last]);
+		median_heap_sift(h, is_upper, idx);
+	}
+
+	return slot;
+}
+
+/* Keep exactly n / 2 values in the lower heap */
+static void median_heap_balance(struct median_heaps *h)
+{
+	int target = (h->nlower + h->nupper) / 2;
+
+	while (h->nlower > target)
+		median_heap_push(h, TRUE, median_heap_pop(h, FALSE, 0));
+	while (h->nlower < target)
+		median_heap_push(h, FALSE, median_heap_pop(h, TRUE, 0));
+}
+
+static void median_heap_insert(struct median_heaps *h, int slot, int value)
+{
+	h->vals[slot] = value;
+	if (h->nlower > 0 && value <= h->vals[h->lower[0]])
+		median_heap_push(h, FALSE, slot);
 	else
-		return 1;
+		median_heap_push(h, TRUE, slot);
+	median_heap_balance(h);
 }
 
-static void median_filter(int *data, int size, int filtersize)
+static void median_heap_remove(struct median_heaps *h, int slot)
 {
+	int pos = h->pos[slot];
+
+	if (pos < 0)
+		median_heap_pop(h, TRUE, ~pos);
+	else
+		median_heap_pop(h, FALSE, pos);
+	median_heap_balance(h);
+}
+
+/* @scratch must hold at least MEDIAN_HEAP_SCRATCH_SIZE(filtersize) ints */
+static void median_filter(int *data, int size, int filtersize, int *scratch)
+{
+	struct median_heaps h;
+	int half = (filtersize - 1) / 2;
+	int window = 2 * half + 1;
+	int lo = 0, hi = -1;
 	int i;
-	int *result = (int *)g_malloc0(size*sizeof(int));
-	int *sortbuf = (int *)g_malloc0(filtersize*sizeof(int));
+
+	h.vals = scratch;
+	h.pos = scratch + window;
+	h.lower = scratch + 2 * window;
+	h.upper = scratch + 3 * window;
+	h.nlower = 0;
+	h.nupper = 0;
+
 	for (i = 0; i < size; i++) {
-		int i1 = i - (filtersize-1)/2;
-		int i2 = i + (filtersize-1)/2;
-		if (i1 < 0)
-			i1 = 0;
-		if (i2 >= size)
-			i2 = size-1;
-		g_memmove(sortbuf, data+i1, (i2-i1+1)*sizeof(int));
-		g_qsort_with_data(sortbuf, i2-i1+1, sizeof(int), cmpint, NULL);
-		result[i] = sortbuf[(i2-i1+1)/2];
+		int i1 = MAX(i - half, 0);
+		int i2 = MIN(i + half, size - 1);
+
+		/* Drop the oldest value first so that its slot can be reused.
+		 * Values are copied into the heaps when entering the window,
+		 * so the result can be stored in place. */
+		while (lo < i1) {
+			median_heap_remove(&h, lo % window);
+			lo++;
+		}
+		while (hi < i2) {
+			hi++;
+			median_heap_insert(&h, hi % window, data[hi]);
+		}
+		data[i] = h.vals[h.upper[0]];
 	}
-	memmove(data, result, size*sizeof(int));
-	g_free(result);
-	g_free(sortbuf);
 }
 
-static void interpolate_lines(struct fpi_line_asmbl_ctx *ctx,
-			      GSList *line1, float y1, GSList *line2,
-			      float y2, unsigned char *output, float yi, int size)
+static void fetch_line(struct fpi_line_asmbl_ctx *ctx, GSList *line,
+		       unsigned char *buf)
 {
-	int i;
-	unsigned char p1, p2;
+	unsigned int i;
 
-	if (!line1 || !line2)
-		return;
+	for (i = 0; i < ctx->line_width; i++)
+		buf[i] = ctx->get_pixel(ctx, line, i);
+}
 
-	for (i = 0; i < size; i++) {
-		p1 = ctx->get_pixel(ctx, line1, i);
-		p2 = ctx->get_pixel(ctx, line2, i);
-		output[i] = (float)p1
-			    + (yi - y1)/(y2 - y1)*(p2 - p1);
+/* Blend two lines using a 8.8 fixed-point @weight (0 to 256) for @line2.
+ * This is a plain loop over byte arrays so that the compiler can vectorise
+ * it for whatever SIMD extension the target has. */
+static void interpolate_lines(const unsigned char * restrict line1,
+			      const unsigned char * restrict line2,
+			      unsigned char * restrict output,
+			      unsigned int weight, unsigned int size)
+{
+	unsigned int i;
+	unsigned int weight1 = 256 - weight;
+
+	for (i = 0; i < size; i++)
+		output[i] = (line1[i] * weight1 + line2[i] * weight) >> 8;
+}
+
+/* Line offsets are kept in fixed-point, in 1/OFFSET_SCALE of a line */
+#define OFFSET_SCALE		16
+/* Number of lines searched around the previous offset while tracking */
+#define TRACK_WINDOW		2
+/* Maximum number of tracked offsets between two full searches */
+#define TRACK_REFRESH		16
+
+/* Computes the deviation between @row1 (line @i) and lines @lo to @hi into
+ * @diffs, indexed from @firstrow. Returns the first line with the smallest
+ * deviation. */
+static int scan_deviation(struct fpi_line_asmbl_ctx *ctx, GSList *row1,
+			  int i, int lo, int hi, int firstrow, int *diffs)
+{
+	GSList *row2 = g_slist_nth(row1, lo - i);
+	int bestmatch = lo;
+	int j;
+
+	for (j = lo; j <= hi && row2; j++, row2 = g_slist_next(row2)) {
+		diffs[j - firstrow] = ctx->get_deviation(ctx, row1, row2);
+		if (diffs[j - firstrow] < diffs[bestmatch - firstrow])
+			bestmatch = j;
 	}
+
+	return bestmatch;
+}
+
+/* Returns the position of the vertex of the parabola going through the
+ * deviations around the minimum @d1, in 1/OFFSET_SCALE of a line */
+static int refine_offset(int d0, int d1, int d2)
+{
+	gint64 denom = (gint64) d0 - 2 * (gint64) d1 + d2;
+	gint64 fine;
+
+	if (denom <= 0)
+		return 0;
+
+	fine = ((gint64) d0 - d2) * OFFSET_SCALE / (2 * denom);
+	return CLAMP(fine, -OFFSET_SCALE / 2, OFFSET_SCALE / 2);
+}
+
+static inline float line_step(struct fpi_line_asmbl_ctx *ctx, int offset)
+{
+	return (float)ctx->resolution * OFFSET_SCALE / offset;
 }
 
 /**
@@ -401,6 +760,13 @@ static void interpolate_lines(struct fpi_line_asmbl_ctx *ctx,
  * #fpi_assemble_lines assembles individual lines into a single image.
  * It also rescales image to account variable swiping speed.
  *
+ * The offset between each pair of lines is estimated with sub-line
+ * precision, by fitting a parabola through the deviations around the best
+ * match. While the swipe speed is stable, the search is narrowed down
+ * to a few lines around the previous offset, with a full search over
+ * max_search_offset lines done regularly, and whenever the narrow search
+ * doesn't find a clear minimum.
+ *
  * Note that @num_lines might be shorter than the length of the list,
  * if some lines should be skipped.
  *
@@ -413,75 +779,131 @@ struct fp_img *fpi_assemble_lines(struct fpi_line_asmbl_ctx *ctx,
 	int i;
 	GSList *row1, *row2;
 	float y = 0.0;
-	int line_ind = 0;
-	int *offsets = (int *)g_malloc0((num_lines / 2) * sizeof(int));
-	unsigned char *output = g_malloc0(ctx->line_width * ctx->max_height);
+	unsigned int line_ind = 0, height = 0;
+	int cached[2] = { -1, -1 };
+	int *offsets = (int *)g_malloc0(((num_lines / 2) +
+		MEDIAN_HEAP_SCRATCH_SIZE(ctx->median_filter_size)) * sizeof(int));
+	int *diffs = g_new(int, MAX(ctx->max_search_offset, 1));
+	int prev_offset = 0, tracked = 0;
+	gboolean tracking = FALSE;
+	unsigned char *linebuf[2], *linemem;
 	struct fp_img *img;
 
 	g_return_val_if_fail (lines != NULL, NULL);
 	g_return_val_if_fail (num_lines >= 2, NULL);
 
+	fpi_assembling_dump_lines(ctx, lines, num_lines);
+
 	fp_dbg("%"G_GINT64_FORMAT, g_get_real_time());
 
 	row1 = lines;
 	for (i = 0; (i < num_lines - 1) && row1; i += 2) {
-		int bestmatch = i;
-		int bestdiff = 0;
-		int j, firstrow, lastrow;
+		int bestmatch = -1;
+		int firstrow, lastrow, offset;
 
 		firstrow = i + 1;
 		lastrow = MIN(i + ctx->max_search_offset, num_lines - 1);
 
-		row2 = g_slist_next(row1);
-		for (j = firstrow; j <= lastrow; j++) {
-			int diff = ctx->get_deviation(ctx,
-					row1,
-					row2);
-			if ((j == firstrow) || (diff < bestdiff)) {
-				bestdiff = diff;
+		/* While the swipe speed is stable, only look around the previous
+		 * offset, and trust the result if it's a local minimum */
+		if (tracking && tracked < TRACK_REFRESH) {
+			int lo = MAX(i + prev_offset - TRACK_WINDOW, firstrow);
+			int hi = MIN(i + prev_offset + TRACK_WINDOW, lastrow);
+			int j = scan_deviation(ctx, row1, i, lo, hi, firstrow, diffs);
+
+			if (j > lo && j < hi) {
 				bestmatch = j;
+				tracked++;
 			}
-			row2 = g_slist_next(row2);
 		}
-		offsets[i / 2] = bestmatch - i;
+		if (bestmatch < 0) {
+			bestmatch = scan_deviation(ctx, row1, i, firstrow, lastrow,
+						   firstrow, diffs);
+			tracked = 0;
+		}
+
+		offset = bestmatch - i;
+		tracking = (offset == prev_offset);
+		prev_offset = offset;
+
+		offsets[i / 2] = offset * OFFSET_SCALE;
+		if (bestmatch > firstrow && bestmatch < lastrow)
+			offsets[i / 2] += refine_offset(diffs[bestmatch - firstrow - 1],
+							diffs[bestmatch - firstrow],
+							diffs[bestmatch - firstrow + 1]);
 		fp_dbg("%d", offsets[i / 2]);
 		row1 = g_slist_next(row1);
 		if (row1)
 			row1 = g_slist_next(row1);
 	}
 
-	median_filter(offsets, (num_lines / 2) - 1, ctx->median_filter_size);
+	median_filter(offsets, (num_lines / 2) - 1, ctx->median_filter_size,
+		      offsets + (num_lines / 2));
 
 	fp_dbg("offsets_filtered: %"G_GINT64_FORMAT, g_get_real_time());
 	for (i = 0; i <= (num_lines / 2) - 1; i++)
 		fp_dbg("%d", offsets[i]);
-	row1 = lines;
-	for (i = 0; i < num_lines - 1; i++, row1 = g_slist_next(row1)) {
+
+	/* Work out the image height first, so that lines can be interpolated
+	 * straight into the final image */
+	for (i = 0; i < num_lines - 1; i++) {
 		int offset = offsets[i/2];
 		if (offset > 0) {
-			float ynext = y + (float)ctx->resolution / offset;
-			while (line_ind < ynext) {
-				if (line_ind > ctx->max_height - 1)
-					goto out;
-				interpolate_lines(ctx,
-					row1, y,
-					g_slist_next(row1),
-					ynext,
-					output + line_ind * ctx->line_width,
-					line_ind,
-					ctx->line_width);
-				line_ind++;
-			}
-			y = ynext;
+			y += line_step(ctx, offset);
+			while (height < y && height < ctx->max_height)
+				height++;
 		}
 	}
-out:
-	img = fpi_img_new(ctx->line_width * line_ind);
-	img->height = line_ind;
+
+	img = fpi_img_new(ctx->line_width * height);
+	img->height = height;
 	img->width = ctx->line_width;
 	img->flags = FP_IMG_V_FLIPPED;
-	g_memmove(img->data, output, ctx->line_width * line_ind);
+
+	/* Each input line is fetched at most once, the second line of a pair
+	 * becomes the first line of the next pair */
+	linemem = g_malloc(ctx->line_width * 2);
+	linebuf[0] = linemem;
+	linebuf[1] = linemem + ctx->line_width;
+
+	y = 0.0;
+	row1 = lines;
+	for (i = 0; i < num_lines - 1 && line_ind < height;
+	     i++, row1 = g_slist_next(row1)) {
+		int offset = offsets[i/2];
+		float ynext;
+
+		if (offset <= 0)
+			continue;
+
+		ynext = y + line_step(ctx, offset);
+		row2 = g_slist_next(row1);
+		if (line_ind < ynext && row1 && row2) {
+			if (cached[1] == i) {
+				unsigned char *tmp = linebuf[0];
+				linebuf[0] = linebuf[1];
+				linebuf[1] = tmp;
+				cached[0] = i;
+			} else if (cached[0] != i) {
+				fetch_line(ctx, row1, linebuf[0]);
+				cached[0] = i;
+			}
+			fetch_line(ctx, row2, linebuf[1]);
+			cached[1] = i + 1;
+		}
+		while (line_ind < ynext && line_ind < height) {
+			if (row1 && row2)
+				interpolate_lines(linebuf[0], linebuf[1],
+					img->data + line_ind * ctx->line_width,
+					(line_ind - y) / (ynext - y) * 256,
+					ctx->line_width);
+			line_ind++;
+		}
+		y = ynext;
+	}
+
+	g_free(linemem);
+	g_free(diffs);
 	g_free(offsets);
-	g_free(output);
 	return img;
 }
@@ -41,7 +41,9 @@ void fpi_drvcb_open_complete(struct fp_dev *dev, int status)
 	fp_dbg("status %d", status);
 	BUG_ON(dev->state != DEV_STATE_INITIALIZING);
 	dev->state = (status) ? DEV_STATE_ERROR : DEV_STATE_INITIALIZED;
+	G_LOCK(opened_devices);
 	opened_devices = g_slist_prepend(opened_devices, dev);
+	G_UNLOCK(opened_devices);
 	if (dev->open_cb)
 		dev->open_cb(dev, status, dev->open_cb_data);
 }
@@ -63,6 +65,58 @@ void fpi_drvcb_open_complete(struct fp_dev *dev, int status)
  */
 API_EXPORTED int fp_async_dev_open(struct fp_dscv_dev *ddev, fp_dev_open_cb callback,
 	void *user_data)
+{
+	return fp_async_dev_open_in_ctx(ddev, NULL, callback, user_data);
+}
+
+/* Devices are discovered in the default USB context, so the same device
+ * needs to be looked up again in the USB context of other event contexts */
+static int usb_open_in_ctx(libusb_device *udev, struct fp_event_ctx *ctx,
+	libusb_device_handle **udevh)
+{
+	libusb_context *usb_ctx = fpi_event_ctx_get_usb_ctx(ctx);
+	uint8_t bus = libusb_get_bus_number(udev);
+	uint8_t address = libusb_get_device_address(udev);
+	libusb_device **devs;
+	ssize_t i, count;
+	int r = LIBUSB_ERROR_NO_DEVICE;
+
+	if (usb_ctx == fpi_usb_ctx)
+		return libusb_open(udev, udevh);
+
+	count = libusb_get_device_list(usb_ctx, &devs);
+	if (count < 0)
+		return count;
+
+	for (i = 0; i < count; i++) {
+		if (libusb_get_bus_number(devs[i]) != bus ||
+		    libusb_get_device_address(devs[i]) != address)
+			continue;
+
+		r = libusb_open(devs[i], udevh);
+		break;
+	}
+
+	libusb_free_device_list(devs, 1);
+	return r;
+}
+
+/**
+ * fp_async_dev_open_in_ctx:
+ * @ddev: the struct #fp_dscv_dev discovered device to open
+ * @ctx: the #fp_event_ctx to open the device in, or %NULL for the default
+ * event context
+ * @callback: the callback to call when the device has been opened
+ * @user_data: user data to pass to the callback
+ *
+ * Like fp_async_dev_open(), but the events of the device are handled by
+ * fp_event_ctx_handle_events_timeout() on @ctx, including the ones needed
+ * to complete the opening.
+ *
+ * Returns: 0 on success, non-zero on error
+ */
+API_EXPORTED int fp_async_dev_open_in_ctx(struct fp_dscv_dev *ddev,
+	struct fp_event_ctx *ctx, fp_dev_open_cb callback, void *user_data)
 {
 	struct fp_driver *drv;
 	struct fp_dev *dev;
@@ -75,7 +129,7 @@ API_EXPORTED int fp_async_dev_open(struct fp_dscv_dev *ddev, fp_dev_open_cb call
 	drv = ddev->drv;
 
 	G_DEBUG_HERE();
-	r = libusb_open(ddev->udev, &udevh);
+	r = usb_open_in_ctx(ddev->udev, ctx, &udevh);
 	if (r < 0) {
 		fp_err("usb_open failed, error %d", r);
 		return r;
@@ -83,7 +137,10 @@ API_EXPORTED int fp_async_dev_open(struct fp_dscv_dev *ddev, fp_dev_open_cb call
 
 	dev = g_malloc0(sizeof(*dev));
 	dev->drv = drv;
+	dev->ctx = ctx;
 	dev->udev = udevh;
+	dev->usb_pool = fpi_usb_pool_new();
+	dev->ssm_trace = fpi_ssm_trace_new();
 	dev->__enroll_stage = -1;
 	dev->state = DEV_STATE_INITIALIZING;
 	dev->open_cb = callback;
@@ -99,6 +156,8 @@ API_EXPORTED int fp_async_dev_open(struct fp_dscv_dev *ddev, fp_dev_open_cb call
 	if (r) {
 		fp_err("device initialisation failed, driver=%s", drv->name);
 		libusb_close(udevh);
+		fpi_usb_pool_close(dev->usb_pool);
+		fpi_ssm_trace_close(dev->ssm_trace);
 		g_free(dev);
 	}
 
@@ -113,6 +172,8 @@ void fpi_drvcb_close_complete(struct fp_dev *dev)
 	dev->state = DEV_STATE_DEINITIALIZED;
 	fpi_timeout_cancel_all_for_dev(dev);
 	libusb_close(dev->udev);
+	fpi_usb_pool_close(dev->usb_pool);
+	fpi_ssm_trace_close(dev->ssm_trace);
 	if (dev->close_cb)
 		dev->close_cb(dev, dev->close_cb_data);
 	g_free(dev);
@@ -138,9 +199,11 @@ API_EXPORTED void fp_async_dev_close(struct fp_dev *dev,
 
 	g_return_if_fail (drv->close != NULL);
 
+	G_LOCK(opened_devices);
 	if (g_slist_index(opened_devices, (gconstpointer) dev) == -1)
 		fp_err("device %p not in opened list!", dev);
 	opened_devices = g_slist_remove(opened_devices, (gconstpointer) dev);
+	G_UNLOCK(opened_devices);
 
 	dev->close_cb = callback;
 	dev->close_cb_data = user_data;
@@ -28,6 +28,7 @@
 #include "fp_internal.h"
 
 libusb_context *fpi_usb_ctx = NULL;
+G_LOCK_DEFINE(opened_devices);
 GSList *opened_devices = NULL;
 
 /**
@@ -735,6 +736,43 @@ API_EXPORTED void fp_set_debug(int level)
  * LIBUSB_DEBUG=4 G_MESSAGES_DEBUG=all my-libfprint-application
  * ```
  *
+ * Image assembling for swipe sensors without hardware movement estimation
+ * uses a pool of up to 8 worker threads, and imaging devices extract
+ * minutiae from their images, and match them, on a pool of up to 4 worker
+ * threads, so that the USB transfers of other devices aren't held up
+ * meanwhile. Both pools are sized after the number of CPUs. Set
+ * `FP_ASSEMBLING_THREADS` and `FP_IMG_PROCESS_THREADS` respectively to
+ * change the number of threads, within the same caps, or to 0 to do the
+ * work in the calling thread and the thread handling events.
+ *
+ * When debugging image assembling problems, set `FP_ASSEMBLING_DUMP_DIR` to
+ * an existing directory to save the input of every image assembling run
+ * there. These dumps can be replayed without the device using the
+ * `fprint-assembling-benchmark` tool.
+ *
+ * Imaging devices recycle the buffers of the images they capture once those
+ * are freed. Set `FP_IMG_POOL` to 0 to allocate a fresh buffer for every
+ * image instead.
+ *
+ * Some drivers enlarge their images before minutiae are extracted. Setting
+ * the experimental `FP_IMG_NATIVE_RESOLUTION` variable to 1 extracts them
+ * from the original image instead, which is faster, but might not match
+ * as reliably.
+ *
+ * USB transfers and their buffers are recycled once they complete. Set
+ * `FP_USB_POOL` to 0 to allocate them for every transfer instead.
+ *
+ * Drivers' state machines are likewise recycled once freed, unless
+ * `FP_SSM_POOL` is set to 0. Set `FP_SSM_TRACE` to 1 to record the time
+ * spent in each state of every state machine, which is written to the
+ * debug log when the device is closed.
+ *
+ * Set `FP_PRINT_DATA_COMPRESS` to 1 to compress the minutiae of the stored
+ * prints returned by fp_print_data_get_data(), and saved by
+ * fp_print_data_save() and fp_print_db_save(). All stored prints can be
+ * loaded whatever this is set to, but older versions of libfprint can't
+ * load compressed prints.
+ *
  * Returns: 0 on success, non-zero on error.
  */
 API_EXPORTED int fp_init(void)
@@ -760,10 +798,15 @@ API_EXPORTED int fp_init(void)
  */
 API_EXPORTED void fp_exit(void)
 {
+	GSList *copy;
+
 	G_DEBUG_HERE();
 
-	if (opened_devices) {
-		GSList *copy = g_slist_copy(opened_devices);
+	G_LOCK(opened_devices);
+	copy = g_slist_copy(opened_devices);
+	G_UNLOCK(opened_devices);
+
+	if (copy) {
 		GSList *elem = copy;
 		fp_dbg("naughty app left devices open on exit!");
 
@@ -772,12 +815,17 @@ API_EXPORTED void fp_exit(void)
 		while ((elem = g_slist_next(elem)));
 
 		g_slist_free(copy);
+		G_LOCK(opened_devices);
 		g_slist_free(opened_devices);
 		opened_devices = NULL;
+		G_UNLOCK(opened_devices);
 	}
 
+	fpi_imgdev_exit();
 	fpi_data_exit();
 	fpi_poll_exit();
+	fpi_assembling_exit();
+	fpi_ssm_exit();
 	g_slist_free(registered_drivers);
 	registered_drivers = NULL;
 	libusb_exit(fpi_usb_ctx);
@@ -0,0 +1,372 @@
+/*
+ * Compact encoding of minutiae for stored prints
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "data-codec"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+#include "nbis/include/bozorth.h"
+
+/*
+ * Minutiae are stored by fpi_img_to_print_data() as a struct xyt_struct,
+ * which always takes room for MAX_BOZORTH_MINUTIAE minutiae, in host byte
+ * order. The encoded form is a little-endian bit stream:
+ *
+ *   nrows      8 bits
+ *   x column
+ *   y column
+ *   t column
+ *
+ * Each column is coded with whichever of these two modes is smaller:
+ *
+ *   0: bit width w (6 bits), minimum value m (long), then every value
+ *      minus m, in w bits
+ *   1: Rice parameter k (6 bits), then the difference of every value with
+ *      the previous one (0 for the first), zigzag encoded, as a unary
+ *      quotient and k bits of remainder
+ *
+ * fpi_img_to_print_data() sorts minutiae by x, then y, so the x column has
+ * small positive differences that Rice coding packs tightly, while y and
+ * angles are spread evenly over their range and are best left at a fixed
+ * width. Long values are a 6 bit length followed by that many bits.
+ */
+
+#define CODEC_MODE_FIXED	0
+#define CODEC_MODE_RICE		1
+
+/* Longest unary quotient accepted, which bounds the work done on corrupted
+ * data. The encoder doesn't use a Rice parameter that would exceed it. */
+#define CODEC_MAX_QUOTIENT	31
+
+#define ZIGZAG(v)	(((guint64) (v) << 1) ^ (guint64) ((v) >> 63))
+#define UNZIGZAG(v)	((gint64) ((v) >> 1) ^ -(gint64) ((v) & 1))
+
+struct bit_writer {
+	unsigned char *buf;
+	size_t size;
+	size_t pos;
+	guint64 acc;
+	unsigned int nbits;
+	gboolean overflow;
+};
+
+struct bit_reader {
+	const unsigned char *buf;
+	size_t size;
+	size_t pos;
+	guint64 acc;
+	unsigned int nbits;
+	gboolean overflow;
+};
+
+static void write_bits(struct bit_writer *w, guint32 value, unsigned int n)
+{
+	if (n == 0 || w->overflow)
+		return;
+
+	w->acc |= (guint64) (value & (G_MAXUINT32 >> (32 - n))) << w->nbits;
+	w->nbits += n;
+	while (w->nbits >= 8) {
+		if (w->pos == w->size) {
+			w->overflow = TRUE;
+			return;
+		}
+		w->buf[w->pos++] = w->acc & 0xff;
+		w->acc >>= 8;
+		w->nbits -= 8;
+	}
+}
+
+static void write_flush(struct bit_writer *w)
+{
+	if (w->nbits)
+		write_bits(w, 0, 8 - w->nbits);
+}
+
+static unsigned int bit_length(guint64 v)
+{
+	unsigned int n = 0;
+
+	while (v) {
+		n++;
+		v >>= 1;
+	}
+	return n;
+}
+
+static void write_long(struct bit_writer *w, guint64 value)
+{
+	unsigned int n = bit_length(value);
+
+	write_bits(w, n, 6);
+	if (n > 32) {
+		write_bits(w, value, 32);
+		write_bits(w, value >> 32, n - 32);
+	} else {
+		write_bits(w, value, n);
+	}
+}
+
+static void refill(struct bit_reader *r)
+{
+	while (r->nbits <= 56 && r->pos < r->size) {
+		r->acc |= (guint64) r->buf[r->pos++] << r->nbits;
+		r->nbits += 8;
+	}
+}
+
+static guint32 read_bits(struct bit_reader *r, unsigned int n)
+{
+	guint32 value;
+
+	if (n == 0)
+		return 0;
+
+	if (r->nbits < n) {
+		refill(r);
+		if (r->nbits < n) {
+			r->overflow = TRUE;
+			return 0;
+		}
+	}
+	value = r->acc & (G_MAXUINT32 >> (32 - n));
+	r->acc >>= n;
+	r->nbits -= n;
+	return value;
+}
+
+static guint64 read_long(struct bit_reader *r)
+{
+	unsigned int n = read_bits(r, 6);
+	guint64 value;
+
+	if (n > 32) {
+		value = read_bits(r, 32);
+		return value | (guint64) read_bits(r, n - 32) << 32;
+	}
+	return read_bits(r, n);
+}
+
+/* Bits needed for a column of @n values in each mode, with the parameter
+ * that gives the smallest size */
+static size_t fixed_cost(const int *col, int n, unsigned int *width,
+	gint64 *min)
+{
+	gint64 lo = 0, hi = 0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (i == 0 || col[i] < lo)
+			lo = col[i];
+		if (i == 0 || col[i] > hi)
+			hi = col[i];
+	}
+
+	*width = bit_length(hi - lo);
+	*min = lo;
+	return 1 + 6 + 6 + bit_length(ZIGZAG(lo)) + (size_t) n * *width;
+}
+
+static size_t rice_cost(const int *col, int n, unsigned int *param)
+{
+	size_t best = G_MAXSIZE;
+	unsigned int k;
+
+	for (k = 0; k < 32; k++) {
+		size_t cost = 1 + 6;
+		gint64 prev = 0;
+		int i;
+
+		for (i = 0; i < n; i++) {
+			guint64 q = ZIGZAG((gint64) col[i] - prev) >> k;
+
+			if (q > CODEC_MAX_QUOTIENT)
+				break;
+			cost += q + 1 + k;
+			prev = col[i];
+		}
+		if (i == n && cost < best) {
+			best = cost;
+			*param = k;
+		}
+	}
+	return best;
+}
+
+static void encode_column(struct bit_writer *w, const int *col, int n)
+{
+	unsigned int width, k = 0;
+	size_t fixed, rice;
+	gint64 min, prev = 0;
+	int i;
+
+	fixed = fixed_cost(col, n, &width, &min);
+	rice = rice_cost(col, n, &k);
+
+	if (fixed <= rice) {
+		write_bits(w, CODEC_MODE_FIXED, 1);
+		write_bits(w, width, 6);
+		write_long(w, ZIGZAG(min));
+		for (i = 0; i < n; i++)
+			write_bits(w, (gint64) col[i] - min, width);
+		return;
+	}
+
+	write_bits(w, CODEC_MODE_RICE, 1);
+	write_bits(w, k, 6);
+	for (i = 0; i < n; i++) {
+		guint64 v = ZIGZAG((gint64) col[i] - prev);
+		unsigned int q = v >> k;
+
+		/* q ones, then a zero */
+		write_bits(w, ((guint64) 1 << q) - 1, q + 1);
+		write_bits(w, v, k);
+		prev = col[i];
+	}
+}
+
+static gboolean decode_column(struct bit_reader *r, int *col, int n)
+{
+	unsigned int mode, param;
+	gint64 min, prev = 0;
+	int i;
+
+	mode = read_bits(r, 1);
+	param = read_bits(r, 6);
+	if (param > 32)
+		return FALSE;
+
+	if (mode == CODEC_MODE_FIXED) {
+		guint64 v = read_long(r);
+
+		min = UNZIGZAG(v);
+		for (i = 0; i < n; i++)
+			col[i] = min + read_bits(r, param);
+		return !r->overflow;
+	}
+
+	if (param > 31)
+		return FALSE;
+	for (i = 0; i < n; i++) {
+		guint64 v;
+		unsigned int q = 0;
+
+		while (read_bits(r, 1)) {
+			if (++q > CODEC_MAX_QUOTIENT)
+				return FALSE;
+		}
+		v = (guint64) q << param | read_bits(r, param);
+		prev += UNZIGZAG(v);
+		col[i] = prev;
+	}
+	return !r->overflow;
+}
+
+/**
+ * fpi_minutiae_get_length:
+ *
+ * Returns: the length of the print data items that fpi_minutiae_encode()
+ * can encode, and that fpi_minutiae_decode() produces
+ */
+size_t fpi_minutiae_get_length(void)
+{
+	return sizeof(struct xyt_struct);
+}
+
+/**
+ * fpi_minutiae_encode:
+ * @item: the data of a print data item of minutiae
+ * @length: the length of @item
+ * @out: the buffer to write the encoded minutiae to
+ * @size: the size of @out
+ *
+ * Encodes the minutiae of a print data item created by
+ * fpi_img_to_print_data(). The encoding is lossless, and doesn't depend on
+ * the byte order of the host.
+ *
+ * Returns: the length of the encoded minutiae, or 0 if @item can't be
+ * encoded exactly, or doesn't fit in @size bytes
+ */
+size_t fpi_minutiae_encode(const unsigned char *item, size_t length,
+	unsigned char *out, size_t size)
+{
+	struct xyt_struct xyt;
+	struct bit_writer w = { 0, };
+	int i;
+
+	if (length != sizeof(xyt))
+		return 0;
+	/* The item might not be aligned */
+	memcpy(&xyt, item, sizeof(xyt));
+
+	if (xyt.nrows < 0 || xyt.nrows > MAX_BOZORTH_MINUTIAE)
+		return 0;
+	/* Unused rows are dropped, and decoded as zeroes */
+	for (i = xyt.nrows; i < MAX_BOZORTH_MINUTIAE; i++) {
+		if (xyt.xcol[i] || xyt.ycol[i] || xyt.thetacol[i])
+			return 0;
+	}
+
+	w.buf = out;
+	w.size = size;
+	write_bits(&w, xyt.nrows, 8);
+	encode_column(&w, xyt.xcol, xyt.nrows);
+	encode_column(&w, xyt.ycol, xyt.nrows);
+	encode_column(&w, xyt.thetacol, xyt.nrows);
+	write_flush(&w);
+
+	return w.overflow ? 0 : w.pos;
+}
+
+/**
+ * fpi_minutiae_decode:
+ * @buf: minutiae encoded with fpi_minutiae_encode()
+ * @buflen: the length of @buf
+ * @item: (nullable): the buffer of fpi_minutiae_get_length() bytes to
+ * decode the print data item to, or %NULL to only check @buf
+ *
+ * Decodes minutiae encoded with fpi_minutiae_encode().
+ *
+ * Returns: 0 on success, -EINVAL if @buf is corrupted
+ */
+int fpi_minutiae_decode(const unsigned char *buf, size_t buflen,
+	unsigned char *item)
+{
+	struct xyt_struct xyt;
+	struct bit_reader r = { 0, };
+
+	r.buf = buf;
+	r.size = buflen;
+
+	memset(&xyt, 0, sizeof(xyt));
+	xyt.nrows = read_bits(&r, 8);
+	if (xyt.nrows > MAX_BOZORTH_MINUTIAE ||
+	    !decode_column(&r, xyt.xcol, xyt.nrows) ||
+	    !decode_column(&r, xyt.ycol, xyt.nrows) ||
+	    !decode_column(&r, xyt.thetacol, xyt.nrows)) {
+		fp_dbg("corrupted minutiae");
+		return -EINVAL;
+	}
+
+	if (item)
+		memcpy(item, &xyt, sizeof(xyt));
+	return 0;
+}
@@ -45,6 +45,25 @@ struct fpi_print_data_item_fp2 {
 	unsigned char data[0];
 } __attribute__((__packed__));
 
+/* FP3 prints have the same header as FP2 ones, and items which are either
+ * copied as is, or encoded with fpi_minutiae_encode(). The header and the
+ * data of every item are padded to FP3_ALIGN bytes, so that the data of
+ * raw items can be used in place by views of aligned buffers. */
+#define FP3_ITEM_RAW		0
+#define FP3_ITEM_MINUTIAE	1
+
+#define FP3_ALIGN		FP_PRINT_DATA_VIEW_ALIGN
+#define FP3_PAD(len) \
+	(((len) + FP3_ALIGN - 1) & ~((size_t) FP3_ALIGN - 1))
+#define FP3_ITEMS_OFFSET	FP3_PAD(sizeof(struct fpi_print_data_fp2))
+
+struct fpi_print_data_item_fp3 {
+	unsigned char format;
+	unsigned char reserved[3];
+	uint32_t length;
+	unsigned char data[0];
+} __attribute__((__packed__));
+
 /**
  * SECTION: print_data
  * @title: Stored prints
@@ -91,9 +110,21 @@ static void storage_setup(void)
 	/* FIXME handle failure */
 }
 
+static void gallery_pool_exit(void);
+
 void fpi_data_exit(void)
 {
 	g_free(base_store);
+	base_store = NULL;
+	gallery_pool_exit();
+}
+
+/* Directory holding the stored prints, or NULL if there is no home directory */
+const char *fpi_data_get_store_dir(void)
+{
+	if (!base_store)
+		storage_setup();
+	return base_store;
 }
 
 #define FP_FINGER_IS_VALID(finger) \
@@ -139,6 +170,7 @@ struct fp_print_data_item *fpi_print_data_item_new(size_t length)
 {
 	struct fp_print_data_item *item = g_malloc0(sizeof(*item) + length);
 	item->length = length;
+	item->data = FPI_PRINT_DATA_ITEM_INLINE_DATA(item);
 
 	return item;
 }
@@ -162,6 +194,68 @@ fpi_print_data_add_item(struct fp_print_data      *data,
 	data->prints = g_slist_prepend(data->prints, item);
 }
 
+static gboolean compression_enabled(void)
+{
+	const char *env = g_getenv("FP_PRINT_DATA_COMPRESS");
+
+	return env && g_str_equal(env, "1");
+}
+
+/* Writes a FP3 print, compressing the minutiae where it is worth it */
+static size_t print_data_get_fp3_data(struct fp_print_data *data,
+	unsigned char **ret)
+{
+	struct fpi_print_data_fp2 *out_data;
+	struct fpi_print_data_item_fp3 *out_item;
+	struct fp_print_data_item *item;
+	size_t buflen = FP3_ITEMS_OFFSET;
+	GSList *list_item;
+	unsigned char *buf;
+
+	for (list_item = data->prints; list_item;
+	     list_item = g_slist_next(list_item)) {
+		item = list_item->data;
+		buflen += sizeof(*out_item) + FP3_PAD(item->length);
+	}
+
+	/* Zeroed, for the padding */
+	out_data = g_malloc0(buflen);
+	buf = (unsigned char *) out_data + FP3_ITEMS_OFFSET;
+	out_data->prefix[0] = 'F';
+	out_data->prefix[1] = 'P';
+	out_data->prefix[2] = '3';
+	out_data->driver_id = GUINT16_TO_LE(data->driver_id);
+	out_data->devtype = GUINT32_TO_LE(data->devtype);
+	out_data->data_type = data->type;
+
+	for (list_item = data->prints; list_item;
+	     list_item = g_slist_next(list_item)) {
+		size_t len = 0;
+
+		item = list_item->data;
+		out_item = (struct fpi_print_data_item_fp3 *) buf;
+		/* Only worth it if it's smaller */
+		if (data->type == PRINT_DATA_NBIS_MINUTIAE && item->length > 0)
+			len = fpi_minutiae_encode(item->data, item->length,
+						  out_item->data,
+						  item->length - 1);
+		if (len) {
+			out_item->format = FP3_ITEM_MINUTIAE;
+		} else {
+			out_item->format = FP3_ITEM_RAW;
+			/* FIXME: fp_print_data_item->data content is not endianess agnostic */
+			memcpy(out_item->data, item->data, item->length);
+			len = item->length;
+		}
+		out_item->length = GUINT32_TO_LE(len);
+		buf += sizeof(*out_item) + FP3_PAD(len);
+	}
+
+	buflen = buf - (unsigned char *) out_data;
+	*ret = g_realloc(out_data, buflen);
+	return buflen;
+}
+
 /**
  * fp_print_data_get_data:
  * @data: the stored print
@@ -172,6 +266,13 @@ fpi_print_data_add_item(struct fp_print_data      *data,
  * You can then store this data buffer in any way that suits you, and load
  * it back at some later time using fp_print_data_from_data().
  *
+ * If the `FP_PRINT_DATA_COMPRESS` environment variable is set to 1, the
+ * minutiae of prints from imaging devices are compressed, which makes
+ * enrolled prints about 15 times smaller. Compressed prints can't be
+ * loaded by older versions of libfprint. Their uncompressed items are
+ * aligned to %FP_PRINT_DATA_VIEW_ALIGN within the buffer, so that views
+ * created with fp_print_data_view_new() can use them in place.
+ *
  * Returns: the size of the freshly allocated buffer, or 0 on error.
  */
 API_EXPORTED size_t fp_print_data_get_data(struct fp_print_data *data,
@@ -186,6 +287,9 @@ API_EXPORTED size_t fp_print_data_get_data(struct fp_print_data *data,
 
 	G_DEBUG_HERE();
 
+	if (compression_enabled())
+		return print_data_get_fp3_data(data, ret);
+
 	list_item = data->prints;
 	while (list_item) {
 		item = list_item->data;
@@ -286,6 +390,79 @@ static struct fp_print_data *fpi_print_data_from_fp2_data(unsigned char *buf,
 
 }
 
+/* Steps to the next item of a FP3 print, checking that it fits in the
+ * buffer. Returns 1 if there is one, 0 at the end, or -EINVAL. */
+static int fp3_next_item(const unsigned char **raw_buf,
+	const unsigned char *end, const struct fpi_print_data_item_fp3 **item)
+{
+	const struct fpi_print_data_item_fp3 *raw_item;
+	size_t item_len;
+
+	if (*raw_buf == end)
+		return 0;
+	if ((size_t) (end - *raw_buf) < sizeof(*raw_item))
+		return -EINVAL;
+
+	raw_item = (const struct fpi_print_data_item_fp3 *) *raw_buf;
+	item_len = FP3_PAD((size_t) GUINT32_FROM_LE(raw_item->length));
+	if ((size_t) (end - *raw_buf) - sizeof(*raw_item) < item_len)
+		return -EINVAL;
+	if (raw_item->format != FP3_ITEM_RAW &&
+	    raw_item->format != FP3_ITEM_MINUTIAE)
+		return -EINVAL;
+
+	*item = raw_item;
+	*raw_buf += sizeof(*raw_item) + item_len;
+	return 1;
+}
+
+static size_t fp3_item_get_length(const struct fpi_print_data_item_fp3 *item)
+{
+	if (item->format == FP3_ITEM_MINUTIAE)
+		return fpi_minutiae_get_length();
+	return GUINT32_FROM_LE(item->length);
+}
+
+static struct fp_print_data *fpi_print_data_from_fp3_data(unsigned char *buf,
+	size_t buflen)
+{
+	struct fp_print_data *data;
+	struct fp_print_data_item *item;
+	struct fpi_print_data_fp2 *raw = (struct fpi_print_data_fp2 *) buf;
+	const struct fpi_print_data_item_fp3 *raw_item;
+	const unsigned char *raw_buf = buf + FP3_ITEMS_OFFSET;
+	int r;
+
+	if (buflen < FP3_ITEMS_OFFSET) {
+		fp_err("corrupted fingerprint data");
+		return NULL;
+	}
+
+	data = print_data_new(GUINT16_FROM_LE(raw->driver_id),
+		GUINT32_FROM_LE(raw->devtype), raw->data_type);
+	while ((r = fp3_next_item(&raw_buf, buf + buflen, &raw_item)) > 0) {
+		item = fpi_print_data_item_new(fp3_item_get_length(raw_item));
+		data->prints = g_slist_prepend(data->prints, item);
+
+		if (raw_item->format == FP3_ITEM_RAW)
+			memcpy(item->data, raw_item->data, item->length);
+		else
+			r = fpi_minutiae_decode(raw_item->data,
+				GUINT32_FROM_LE(raw_item->length), item->data);
+		if (r < 0)
+			break;
+	}
+
+	if (r < 0)
+		fp_err("corrupted fingerprint data");
+	if (r < 0 || g_slist_length(data->prints) == 0) {
+		fp_print_data_free(data);
+		data = NULL;
+	}
+
+	return data;
+}
+
 /**
  * fp_print_data_from_data:
  * @buf: the data buffer
@@ -311,6 +488,8 @@ API_EXPORTED struct fp_print_data *fp_print_data_from_data(unsigned char *buf,
 		return fpi_print_data_from_fp1_data(buf, buflen);
 	} else if (strncmp(raw->prefix, "FP2", 3) == 0) {
 		return fpi_print_data_from_fp2_data(buf, buflen);
+	} else if (strncmp(raw->prefix, "FP3", 3) == 0) {
+		return fpi_print_data_from_fp3_data(buf, buflen);
 	} else {
 		fp_dbg("bad header prefix");
 	}
@@ -318,6 +497,573 @@ API_EXPORTED struct fp_print_data *fp_print_data_from_data(unsigned char *buf,
 	return NULL;
 }
 
+/* Galleries are decoded in chunks of this many prints, each chunk being
+ * handled by one worker thread */
+#define GALLERY_CHUNK_SIZE	256
+/* Upper bound for the number of worker threads */
+#define GALLERY_MAX_THREADS	8
+
+/* Items of a gallery are laid out back to back in a single allocation */
+#define GALLERY_ITEM_SIZE(len) \
+	((sizeof(struct fp_print_data_item) + (len) + G_MEM_ALIGN - 1) & \
+	 ~((size_t) G_MEM_ALIGN - 1))
+
+#define GALLERY_BORROWS(src, ptr) \
+	((src)->borrow && \
+	 ((uintptr_t) (ptr)) % FP_PRINT_DATA_VIEW_ALIGN == 0)
+
+struct gallery_source {
+	char *path;
+	unsigned char *contents;
+	const unsigned char *buf;
+	size_t buflen;
+	/* Use the item data in place where it is aligned */
+	gboolean borrow;
+	gboolean valid;
+	guint num_items;
+	size_t items_size;
+	/* Where the print goes within the gallery */
+	struct fp_print_data *data;
+	GSList *links;
+	unsigned char *items;
+};
+
+typedef void (*gallery_func)(struct gallery_source *src);
+
+struct gallery_batch {
+	GMutex mutex;
+	GCond cond;
+	int pending;
+};
+
+struct gallery_job {
+	gallery_func func;
+	struct gallery_source *sources;
+	size_t num_sources;
+	struct gallery_batch *batch;
+};
+
+G_LOCK_DEFINE_STATIC(gallery_pool);
+static GThreadPool *gallery_pool = NULL;
+static gboolean gallery_pool_disabled = FALSE;
+
+static void gallery_job_run(struct gallery_job *job)
+{
+	size_t i;
+
+	for (i = 0; i < job->num_sources; i++)
+		job->func(&job->sources[i]);
+}
+
+static void gallery_pool_func(gpointer data, gpointer user_data)
+{
+	struct gallery_job *job = data;
+	struct gallery_batch *batch = job->batch;
+
+	gallery_job_run(job);
+
+	g_mutex_lock(&batch->mutex);
+	if (--batch->pending == 0)
+		g_cond_signal(&batch->cond);
+	g_mutex_unlock(&batch->mutex);
+}
+
+/* Returns the worker pool, or NULL if there is a single CPU */
+static GThreadPool *get_gallery_pool(void)
+{
+	GThreadPool *pool;
+
+	G_LOCK(gallery_pool);
+	if (gallery_pool == NULL && !gallery_pool_disabled) {
+		guint num_threads = MIN(g_get_num_processors(),
+					GALLERY_MAX_THREADS);
+
+		if (num_threads > 1)
+			gallery_pool = g_thread_pool_new(gallery_pool_func, NULL,
+							 num_threads, FALSE, NULL);
+		if (gallery_pool == NULL)
+			gallery_pool_disabled = TRUE;
+	}
+	pool = gallery_pool;
+	G_UNLOCK(gallery_pool);
+
+	return pool;
+}
+
+static void gallery_pool_exit(void)
+{
+	G_LOCK(gallery_pool);
+	if (gallery_pool)
+		g_thread_pool_free(gallery_pool, FALSE, TRUE);
+	gallery_pool = NULL;
+	gallery_pool_disabled = FALSE;
+	G_UNLOCK(gallery_pool);
+}
+
+/* Calls @func on every source, spreading the work over the worker threads
+ * for large galleries */
+static void run_gallery_jobs(struct gallery_source *sources, size_t count,
+	gallery_func func)
+{
+	struct gallery_batch batch;
+	struct gallery_job *jobs;
+	GThreadPool *pool = NULL;
+	size_t i, num_jobs;
+
+	num_jobs = (count + GALLERY_CHUNK_SIZE - 1) / GALLERY_CHUNK_SIZE;
+	if (num_jobs > 1)
+		pool = get_gallery_pool();
+
+	if (pool == NULL) {
+		for (i = 0; i < count; i++)
+			func(&sources[i]);
+		return;
+	}
+
+	g_mutex_init(&batch.mutex);
+	g_cond_init(&batch.cond);
+	batch.pending = num_jobs;
+
+	jobs = g_new(struct gallery_job, num_jobs);
+	for (i = 0; i < num_jobs; i++) {
+		jobs[i].func = func;
+		jobs[i].sources = sources + i * GALLERY_CHUNK_SIZE;
+		jobs[i].num_sources = MIN(GALLERY_CHUNK_SIZE,
+					  count - i * GALLERY_CHUNK_SIZE);
+		jobs[i].batch = &batch;
+		if (!g_thread_pool_push(pool, &jobs[i], NULL))
+			gallery_pool_func(&jobs[i], NULL);
+	}
+
+	g_mutex_lock(&batch.mutex);
+	while (batch.pending > 0)
+		g_cond_wait(&batch.cond, &batch.mutex);
+	g_mutex_unlock(&batch.mutex);
+
+	g_mutex_clear(&batch.mutex);
+	g_cond_clear(&batch.cond);
+	g_free(jobs);
+}
+
+/* Checks the header of a serialized print, and works out how much space its
+ * items need, following the same rules as fp_print_data_from_data() */
+static void gallery_measure(struct gallery_source *src)
+{
+	const struct fpi_print_data_fp2 *raw =
+		(const struct fpi_print_data_fp2 *) src->buf;
+	const struct fpi_print_data_item_fp2 *raw_item;
+	const unsigned char *raw_buf;
+	size_t total_data_len, item_len;
+
+	src->num_items = 0;
+	src->items_size = 0;
+	if (!src->buf || src->buflen < sizeof(*raw))
+		goto out;
+
+	total_data_len = src->buflen - sizeof(*raw);
+	if (strncmp(raw->prefix, "FP1", 3) == 0) {
+		src->num_items = 1;
+		src->items_size = GALLERY_ITEM_SIZE(
+			GALLERY_BORROWS(src, raw->data) ? 0 : total_data_len);
+	} else if (strncmp(raw->prefix, "FP2", 3) == 0) {
+		raw_buf = raw->data;
+		while (total_data_len >= sizeof(*raw_item)) {
+			total_data_len -= sizeof(*raw_item);
+			raw_item = (const struct fpi_print_data_item_fp2 *) raw_buf;
+			item_len = GUINT32_FROM_LE(raw_item->length);
+			if (total_data_len < item_len)
+				break;
+			total_data_len -= item_len;
+
+			src->num_items++;
+			src->items_size += GALLERY_ITEM_SIZE(
+				GALLERY_BORROWS(src, raw_item->data) ? 0 : item_len);
+			raw_buf += sizeof(*raw_item) + item_len;
+		}
+	} else if (strncmp(raw->prefix, "FP3", 3) == 0) {
+		const struct fpi_print_data_item_fp3 *raw_item3;
+		const unsigned char *end = src->buf + src->buflen;
+		int r;
+
+		if (src->buflen < FP3_ITEMS_OFFSET)
+			goto out;
+		raw_buf = src->buf + FP3_ITEMS_OFFSET;
+		while ((r = fp3_next_item(&raw_buf, end, &raw_item3)) > 0) {
+			item_len = fp3_item_get_length(raw_item3);
+			if (raw_item3->format == FP3_ITEM_MINUTIAE) {
+				r = fpi_minutiae_decode(raw_item3->data,
+					GUINT32_FROM_LE(raw_item3->length), NULL);
+				if (r < 0)
+					break;
+			} else if (GALLERY_BORROWS(src, raw_item3->data)) {
+				item_len = 0;
+			}
+
+			src->num_items++;
+			src->items_size += GALLERY_ITEM_SIZE(item_len);
+		}
+		if (r < 0)
+			src->num_items = 0;
+	}
+
+out:
+	src->valid = src->num_items > 0;
+}
+
+static void gallery_read(struct gallery_source *src)
+{
+	gsize length;
+
+	if (g_file_get_contents(src->path, (gchar **) &src->contents,
+				&length, NULL)) {
+		src->buf = src->contents;
+		src->buflen = length;
+	}
+	gallery_measure(src);
+}
+
+/* Copies the items of a validated print into their place in the gallery,
+ * or points them at the source buffer */
+static void gallery_fill(struct gallery_source *src)
+{
+	const struct fpi_print_data_fp2 *raw =
+		(const struct fpi_print_data_fp2 *) src->buf;
+	struct fp_print_data *data = src->data;
+	unsigned char *items = src->items;
+	const unsigned char *raw_buf, *item_data;
+	guint i;
+
+	if (!src->valid)
+		return;
+
+	raw_buf = raw->prefix[2] == '3' ? src->buf + FP3_ITEMS_OFFSET : raw->data;
+	data->driver_id = GUINT16_FROM_LE(raw->driver_id);
+	data->devtype = GUINT32_FROM_LE(raw->devtype);
+	data->type = raw->data_type;
+	data->prints = NULL;
+
+	for (i = 0; i < src->num_items; i++) {
+		struct fp_print_data_item *item =
+			(struct fp_print_data_item *) items;
+		gboolean minutiae = FALSE;
+		size_t item_len;
+
+		if (raw->prefix[2] == '1') {
+			item_len = src->buflen - sizeof(*raw);
+			item_data = raw_buf;
+		} else if (raw->prefix[2] == '2') {
+			const struct fpi_print_data_item_fp2 *raw_item =
+				(const struct fpi_print_data_item_fp2 *) raw_buf;
+
+			item_len = GUINT32_FROM_LE(raw_item->length);
+			item_data = raw_item->data;
+			raw_buf += sizeof(*raw_item) + item_len;
+		} else {
+			const struct fpi_print_data_item_fp3 *raw_item;
+
+			/* Already checked by gallery_measure() */
+			fp3_next_item(&raw_buf, src->buf + src->buflen,
+				      &raw_item);
+			item_len = GUINT32_FROM_LE(raw_item->length);
+			item_data = raw_item->data;
+			minutiae = raw_item->format == FP3_ITEM_MINUTIAE;
+		}
+
+		if (minutiae) {
+			item->length = fpi_minutiae_get_length();
+			item->data = FPI_PRINT_DATA_ITEM_INLINE_DATA(item);
+			fpi_minutiae_decode(item_data, item_len, item->data);
+			items += GALLERY_ITEM_SIZE(item->length);
+		} else if (GALLERY_BORROWS(src, item_data)) {
+			item->length = item_len;
+			item->data = (unsigned char *) item_data;
+			items += GALLERY_ITEM_SIZE(0);
+		} else {
+			item->length = item_len;
+			item->data = FPI_PRINT_DATA_ITEM_INLINE_DATA(item);
+			/* FIXME: fp_print_data->data content is not endianess agnostic */
+			memcpy(item->data, item_data, item_len);
+			items += GALLERY_ITEM_SIZE(item_len);
+		}
+
+		/* Same order as fp_print_data_from_data() */
+		src->links[i].data = item;
+		src->links[i].next = data->prints;
+		data->prints = &src->links[i];
+	}
+}
+
+/* Lays the valid prints out in a single allocation, and decodes them */
+static struct fp_print_data **gallery_build(struct gallery_source *sources,
+	size_t count, size_t num_valid)
+{
+	struct fp_print_data **gallery;
+	struct fp_print_data *datas;
+	GSList *links;
+	unsigned char *items;
+	size_t total_items = 0, items_size = 0;
+	size_t headers_size, i, j;
+
+	for (i = 0; i < count; i++) {
+		if (!sources[i].valid)
+			continue;
+		total_items += sources[i].num_items;
+		items_size += sources[i].items_size;
+	}
+
+	headers_size = (num_valid + 1) * sizeof(*gallery) +
+		num_valid * sizeof(*datas) + total_items * sizeof(*links);
+	headers_size = (headers_size + G_MEM_ALIGN - 1) &
+		~((size_t) G_MEM_ALIGN - 1);
+
+	gallery = g_malloc(headers_size + items_size);
+	datas = (struct fp_print_data *) (gallery + num_valid + 1);
+	links = (GSList *) (datas + num_valid);
+	items = (unsigned char *) gallery + headers_size;
+
+	for (i = 0, j = 0; i < count; i++) {
+		if (!sources[i].valid)
+			continue;
+		gallery[j] = &datas[j];
+		datas[j].in_gallery = TRUE;
+		datas[j].packed = TRUE;
+		sources[i].data = &datas[j];
+		sources[i].links = links;
+		sources[i].items = items;
+		links += sources[i].num_items;
+		items += sources[i].items_size;
+		j++;
+	}
+	gallery[num_valid] = NULL;
+
+	run_gallery_jobs(sources, count, gallery_fill);
+	return gallery;
+}
+
+/* Builds a gallery of copies, or of views of @bufs if @borrow is set */
+int fpi_print_data_gallery_from_data(unsigned char **bufs, size_t *buflens,
+	size_t count, gboolean borrow, struct fp_print_data ***gallery)
+{
+	struct gallery_source *sources;
+	size_t i;
+
+	g_return_val_if_fail (count <= G_MAXINT, -EINVAL);
+
+	sources = g_new0(struct gallery_source, count);
+	for (i = 0; i < count; i++) {
+		sources[i].buf = bufs[i];
+		sources[i].buflen = buflens[i];
+		sources[i].borrow = borrow;
+	}
+
+	run_gallery_jobs(sources, count, gallery_measure);
+	for (i = 0; i < count; i++) {
+		if (!sources[i].valid) {
+			fp_err("buffer %zu is not a valid stored print", i);
+			g_free(sources);
+			return -EINVAL;
+		}
+	}
+
+	*gallery = gallery_build(sources, count, count);
+	g_free(sources);
+	return count;
+}
+
+/**
+ * fp_print_data_gallery_from_data:
+ * @bufs: the data buffers
+ * @buflens: the lengths of the buffers
+ * @count: the number of buffers
+ * @gallery: output location for the %NULL-terminated gallery. Must be
+ * freed with fp_print_data_gallery_free() after use.
+ *
+ * Loads a gallery of stored prints from data buffers previously supplied
+ * to you by the fp_print_data_get_data() function, in the same order. This
+ * is equivalent to calling fp_print_data_from_data() on each buffer, but
+ * faster for large galleries: the buffers are decoded in parallel, and the
+ * gallery is allocated at once.
+ *
+ * The resulting gallery can be passed to fp_identify_finger() or
+ * fp_async_identify_start(). Its prints must not be freed individually.
+ *
+ * Returns: the number of prints in the gallery, or -EINVAL if any of the
+ * buffers isn't a valid stored print
+ */
+API_EXPORTED int fp_print_data_gallery_from_data(unsigned char **bufs,
+	size_t *buflens, size_t count, struct fp_print_data ***gallery)
+{
+	return fpi_print_data_gallery_from_data(bufs, buflens, count, FALSE,
+		gallery);
+}
+
+/**
+ * fp_print_data_view_new:
+ * @buf: the data buffer
+ * @buflen: the length of the buffer
+ *
+ * Creates a view of a stored print from a data buffer previously supplied
+ * to you by the fp_print_data_get_data() function. Unlike
+ * fp_print_data_from_data(), the print data is not copied out of @buf
+ * where it is aligned to %FP_PRINT_DATA_VIEW_ALIGN, and the view only
+ * takes a single small allocation. The uncompressed items written by
+ * fp_print_data_get_data() when `FP_PRINT_DATA_COMPRESS` is set to 1 are
+ * aligned, so they are used in place as long as @buf itself is aligned, as
+ * memory from malloc(), mmap() or a print database is. The items of
+ * default FP2 buffers lie at unaligned offsets and are copied, as are
+ * compressed minutiae, which are decoded.
+ *
+ * The view can be used like any other stored print, but it refers to
+ * @buf, which must stay valid and unmodified until the view is freed.
+ *
+ * Returns: a view of the stored print represented by the data, or %NULL on
+ * error. Must be freed with fp_print_data_free() after use.
+ */
+API_EXPORTED struct fp_print_data *fp_print_data_view_new(
+	const unsigned char *buf, size_t buflen)
+{
+	struct gallery_source src = { 0, };
+	struct fp_print_data *data;
+	size_t headers_size;
+
+	src.buf = buf;
+	src.buflen = buflen;
+	src.borrow = TRUE;
+	gallery_measure(&src);
+	if (!src.valid)
+		return NULL;
+
+	headers_size = sizeof(*data) + src.num_items * sizeof(GSList);
+	headers_size = (headers_size + G_MEM_ALIGN - 1) &
+		~((size_t) G_MEM_ALIGN - 1);
+
+	data = g_malloc(headers_size + src.items_size);
+	data->in_gallery = FALSE;
+	data->packed = TRUE;
+	src.data = data;
+	src.links = (GSList *) (data + 1);
+	src.items = (unsigned char *) data + headers_size;
+	gallery_fill(&src);
+
+	return data;
+}
+
+/**
+ * fp_print_data_gallery_view_from_data:
+ * @bufs: the data buffers
+ * @buflens: the lengths of the buffers
+ * @count: the number of buffers
+ * @gallery: output location for the %NULL-terminated gallery. Must be
+ * freed with fp_print_data_gallery_free() after use.
+ *
+ * Same as fp_print_data_gallery_from_data(), but the prints of the gallery
+ * are views as created by fp_print_data_view_new(), so @bufs must stay
+ * valid and unmodified until the gallery is freed.
+ *
+ * Returns: the number of prints in the gallery, or -EINVAL if any of the
+ * buffers isn't a valid stored print
+ */
+API_EXPORTED int fp_print_data_gallery_view_from_data(unsigned char **bufs,
+	size_t *buflens, size_t count, struct fp_print_data ***gallery)
+{
+	return fpi_print_data_gallery_from_data(bufs, buflens, count, TRUE,
+		gallery);
+}
+
+static gint compare_paths(gconstpointer a, gconstpointer b)
+{
+	return strcmp(*(const char **) a, *(const char **) b);
+}
+
+/**
+ * fp_print_data_gallery_load_dir:
+ * @path: the directory to load prints from
+ * @gallery: output location for the %NULL-terminated gallery. Must be
+ * freed with fp_print_data_gallery_free() after use.
+ * @names: (nullable): output location for the %NULL-terminated list of the
+ * file names the prints were loaded from, in the same order as @gallery.
+ * Must be freed with g_strfreev() after use.
+ *
+ * Loads a gallery of stored prints from the files of a directory, each of
+ * which must contain a buffer supplied by fp_print_data_get_data(). Files
+ * are read and decoded in parallel, in the order of their names. Files
+ * which aren't stored prints are skipped.
+ *
+ * The resulting gallery can be passed to fp_identify_finger() or
+ * fp_async_identify_start(). Its prints must not be freed individually.
+ *
+ * Returns: the number of prints in the gallery, or negative on error
+ */
+API_EXPORTED int fp_print_data_gallery_load_dir(const char *path,
+	struct fp_print_data ***gallery, char ***names)
+{
+	struct gallery_source *sources;
+	GError *err = NULL;
+	GPtrArray *paths;
+	const gchar *ent;
+	size_t i, j, num_valid = 0;
+	GDir *dir;
+
+	dir = g_dir_open(path, 0, &err);
+	if (!dir) {
+		int r = err->code == G_FILE_ERROR_NOENT ? -ENOENT : -EIO;
+
+		fp_err("opendir %s failed: %s", path, err->message);
+		g_error_free(err);
+		return r;
+	}
+
+	paths = g_ptr_array_new();
+	while ((ent = g_dir_read_name(dir)))
+		g_ptr_array_add(paths, g_build_filename(path, ent, NULL));
+	g_dir_close(dir);
+	g_ptr_array_sort(paths, compare_paths);
+
+	sources = g_new0(struct gallery_source, paths->len);
+	for (i = 0; i < paths->len; i++)
+		sources[i].path = g_ptr_array_index(paths, i);
+
+	run_gallery_jobs(sources, paths->len, gallery_read);
+	for (i = 0; i < paths->len; i++) {
+		if (sources[i].valid)
+			num_valid++;
+		else
+			fp_dbg("skipping %s", sources[i].path);
+	}
+
+	*gallery = gallery_build(sources, paths->len, num_valid);
+
+	if (names) {
+		*names = g_new(char *, num_valid + 1);
+		for (i = 0, j = 0; i < paths->len; i++) {
+			if (sources[i].valid)
+				(*names)[j++] = g_path_get_basename(sources[i].path);
+		}
+		(*names)[num_valid] = NULL;
+	}
+
+	for (i = 0; i < paths->len; i++) {
+		g_free(sources[i].contents);
+		g_free(sources[i].path);
+	}
+	g_ptr_array_free(paths, TRUE);
+	g_free(sources);
+
+	return num_valid;
+}
+
+/**
+ * fp_print_data_gallery_free:
+ * @gallery: the gallery to destroy. If NULL, function simply returns.
+ *
+ * Frees a gallery loaded with fp_print_data_gallery_from_data() or
+ * fp_print_data_gallery_load_dir(), along with all its prints.
+ */
+API_EXPORTED void fp_print_data_gallery_free(struct fp_print_data **gallery)
+{
+	g_free(gallery);
+}
+
 static char *get_path_to_storedir(uint16_t driver_id, uint32_t devtype)
 {
 	char idstr[5];
@@ -561,7 +1307,11 @@ API_EXPORTED int fp_print_data_from_dscv_print(struct fp_dscv_print *print,
  */
 API_EXPORTED void fp_print_data_free(struct fp_print_data *data)
 {
-	if (data)
+	if (data && data->in_gallery) {
+		fp_err("print belongs to a gallery, use fp_print_data_gallery_free()");
+		return;
+	}
+	if (data && !data->packed)
 		g_slist_free_full(data->prints, (GDestroyNotify)fpi_print_data_item_free);
 	g_free(data);
 }
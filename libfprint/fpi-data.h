@@ -23,9 +23,15 @@
 struct fp_print_data;
 struct fp_print_data_item {
 	size_t length;
-	unsigned char data[0];
+	/* Usually follows the structure in memory, but points into the
+	 * caller's buffer for views created with fp_print_data_view_new() */
+	unsigned char *data;
 };
 
+/* Location of the data of an item allocated along with its structure */
+#define FPI_PRINT_DATA_ITEM_INLINE_DATA(item) \
+	((unsigned char *) ((item) + 1))
+
 struct fp_print_data *fpi_print_data_new(struct fp_dev *dev);
 struct fp_print_data_item *fpi_print_data_item_new(size_t length);
 struct fp_print_data_item *fpi_print_data_get_item(struct fp_print_data *data);
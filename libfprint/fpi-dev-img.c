@@ -18,6 +18,7 @@
  */
 
 #include <errno.h>
+#include <string.h>
 
 #include <glib.h>
 #include <bozorth.h>
@@ -39,6 +40,36 @@
 #define MIN_ACCEPTABLE_MINUTIAE 10
 #define BOZORTH3_DEFAULT_THRESHOLD 40
 #define IMG_ENROLL_STAGES 5
+#define IMG_PROCESS_MAX_THREADS 4
+
+/* Extracting minutiae from a captured image, and matching them, takes long
+ * enough to hold up the USB transfers and timeouts of every device handled
+ * by the same thread. This is done on a worker thread instead, and the
+ * result is posted back to the device with fpi_dev_post(). */
+struct fpi_img_job {
+	/* one reference for the device, one for the worker */
+	gint refcount;
+	/* held while the worker uses the device or the prints it matches
+	 * against, so that cancelling waits for it to be done with them */
+	GMutex lock;
+	/* set atomically before taking the lock, and checked by the worker
+	 * between the prints it matches against, so that cancelling only
+	 * waits for the comparison in progress */
+	gboolean cancelled;
+
+	struct fp_img_dev *imgdev;
+	struct fp_img *img;
+	/* results, print is %NULL if the image couldn't be used */
+	struct fp_print_data *print;
+	int result;
+	size_t match_offset;
+};
+
+G_LOCK_DEFINE_STATIC(img_job_pool);
+static GThreadPool *img_job_pool = NULL;
+static gboolean img_job_pool_disabled = FALSE;
+
+static void img_job_cancel(struct fp_img_dev *imgdev);
 
 /**
  * fpi_imgdev_get_action_state:
@@ -109,6 +140,7 @@ static int img_dev_open(struct fp_dev *dev, unsigned long driver_data)
 
 	imgdev->enroll_stage = 0;
 	dev->nr_enroll_stages = IMG_ENROLL_STAGES;
+	imgdev->img_pool = fpi_img_pool_new();
 
 	if (imgdrv->open) {
 		r = imgdrv->open(imgdev, driver_data);
@@ -120,6 +152,7 @@ static int img_dev_open(struct fp_dev *dev, unsigned long driver_data)
 
 	return 0;
 err:
+	fpi_img_pool_close(imgdev->img_pool);
 	g_free(imgdev);
 	return r;
 }
@@ -155,7 +188,9 @@ static void img_dev_close(struct fp_dev *dev)
  */
 void fpi_imgdev_close_complete(struct fp_img_dev *imgdev)
 {
+	img_job_cancel(imgdev);
 	fpi_drvcb_close_complete(FP_DEV(imgdev));
+	fpi_img_pool_close(imgdev->img_pool);
 	g_free(imgdev);
 }
 
@@ -216,6 +251,14 @@ void fpi_imgdev_report_finger_status(struct fp_img_dev *imgdev,
 	struct fp_img *img = imgdev->acquire_img;
 	struct fp_print_data *print;
 	struct fp_print_data_item *item;
+
+	if (imgdev->img_job) {
+		fp_dbg(present ? "finger on sensor, image still being processed" :
+			"finger removed, image still being processed");
+		imgdev->report_pending = TRUE;
+		return;
+	}
+
 	print = fpi_print_data_new(FP_DEV(imgdev));
 	item = fpi_print_data_item_new(sizeof(struct xyt_struct));
 	print->type = PRINT_DATA_NBIS_MINUTIAE;
@@ -279,7 +322,8 @@ void fpi_imgdev_report_finger_status(struct fp_img_dev *imgdev,
 	}
 }
 
-static void verify_process_img(struct fp_img_dev *imgdev)
+static int verify_print(struct fp_img_dev *imgdev,
+	struct fp_print_data *print, gboolean *cancelled)
 {
 	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(FP_DEV(imgdev)->drv);
 	int match_score = imgdrv->bz3_threshold;
@@ -288,32 +332,283 @@ static void verify_process_img(struct fp_img_dev *imgdev)
 	if (match_score == 0)
 		match_score = BOZORTH3_DEFAULT_THRESHOLD;
 
-	r = fpi_img_compare_print_data(FP_DEV(imgdev)->verify_data,
-		imgdev->acquire_data);
+	r = fpi_img_compare_print_data(FP_DEV(imgdev)->verify_data, print,
+		cancelled);
 
 	if (r >= match_score)
 		r = FP_VERIFY_MATCH;
 	else if (r >= 0)
 		r = FP_VERIFY_NO_MATCH;
 
-	imgdev->action_result = r;
+	return r;
 }
 
-static void identify_process_img(struct fp_img_dev *imgdev)
+static int identify_print(struct fp_img_dev *imgdev,
+	struct fp_print_data *print, size_t *match_offset, gboolean *cancelled)
 {
 	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(FP_DEV(imgdev)->drv);
 	int match_score = imgdrv->bz3_threshold;
-	size_t match_offset;
-	int r;
 
 	if (match_score == 0)
 		match_score = BOZORTH3_DEFAULT_THRESHOLD;
 
-	r = fpi_img_compare_print_data_to_gallery(imgdev->acquire_data,
-		FP_DEV(imgdev)->identify_gallery, match_score, &match_offset);
+	return fpi_img_compare_print_data_to_gallery(print,
+		FP_DEV(imgdev)->identify_gallery, match_score, match_offset,
+		cancelled);
+}
+
+static void img_job_unref(struct fpi_img_job *job)
+{
+	if (!g_atomic_int_dec_and_test(&job->refcount))
+		return;
+
+	fp_img_free(job->img);
+	fp_print_data_free(job->print);
+	g_mutex_clear(&job->lock);
+	g_free(job);
+}
+
+/* The slow part of handling a captured image, which reads the state of the
+ * device without changing it */
+static void img_job_process(struct fpi_img_job *job)
+{
+	struct fp_img_dev *imgdev = job->imgdev;
+	struct fp_img *img = job->img;
+	int r;
 
-	imgdev->action_result = r;
-	imgdev->identify_match_offset = match_offset;
+	r = fpi_img_to_print_data(imgdev, img, &job->print);
+	if (r < 0) {
+		fp_dbg("image to print data conversion error: %d", r);
+		job->print = NULL;
+		return;
+	} else if (img->minutiae->num < MIN_ACCEPTABLE_MINUTIAE) {
+		fp_dbg("not enough minutiae, %d/%d", img->minutiae->num,
+			MIN_ACCEPTABLE_MINUTIAE);
+		fp_print_data_free(job->print);
+		job->print = NULL;
+		return;
+	}
+
+	switch (imgdev->action) {
+	case IMG_ACTION_VERIFY:
+		job->result = verify_print(imgdev, job->print, &job->cancelled);
+		break;
+	case IMG_ACTION_IDENTIFY:
+		job->result = identify_print(imgdev, job->print,
+			&job->match_offset, &job->cancelled);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Stores the results of a processed image in the device */
+static void img_job_apply(struct fpi_img_job *job)
+{
+	struct fp_img_dev *imgdev = job->imgdev;
+	struct fp_print_data *print = job->print;
+
+	imgdev->acquire_img = job->img;
+	job->img = NULL;
+	job->print = NULL;
+
+	if (imgdev->action_result) {
+		fp_dbg("not overwriting existing action result");
+		fp_print_data_free(print);
+		return;
+	}
+
+	if (!print) {
+		/* depends on FP_ENROLL_RETRY == FP_VERIFY_RETRY */
+		imgdev->action_result = FP_ENROLL_RETRY;
+		return;
+	}
+
+	imgdev->acquire_data = print;
+	switch (imgdev->action) {
+	case IMG_ACTION_ENROLL:
+		if (!imgdev->enroll_data) {
+			imgdev->enroll_data = fpi_print_data_new(FP_DEV(imgdev));
+		}
+		BUG_ON(g_slist_length(print->prints) != 1);
+		/* Move print data from acquire data into enroll_data */
+		imgdev->enroll_data->prints =
+			g_slist_prepend(imgdev->enroll_data->prints, print->prints->data);
+		print->prints = g_slist_remove(print->prints, print->prints->data);
+
+		fp_print_data_free(imgdev->acquire_data);
+		imgdev->acquire_data = NULL;
+		imgdev->enroll_stage++;
+		if (imgdev->enroll_stage == FP_DEV(imgdev)->nr_enroll_stages)
+			imgdev->action_result = FP_ENROLL_COMPLETE;
+		else
+			imgdev->action_result = FP_ENROLL_PASS;
+		break;
+	case IMG_ACTION_VERIFY:
+		imgdev->action_result = job->result;
+		break;
+	case IMG_ACTION_IDENTIFY:
+		imgdev->action_result = job->result;
+		imgdev->identify_match_offset = job->match_offset;
+		break;
+	default:
+		BUG();
+		break;
+	}
+}
+
+static void img_job_done(struct fp_dev *dev, void *data)
+{
+	struct fpi_img_job *job = data;
+	struct fp_img_dev *imgdev = job->imgdev;
+
+	/* the device might be gone */
+	if (job->cancelled) {
+		img_job_unref(job);
+		return;
+	}
+
+	G_DEBUG_HERE();
+	imgdev->img_job = NULL;
+	img_job_apply(job);
+	/* the posted call's reference, and the device's */
+	img_job_unref(job);
+	img_job_unref(job);
+
+	if (imgdev->report_pending) {
+		imgdev->report_pending = FALSE;
+		fpi_imgdev_report_finger_status(imgdev, FALSE);
+	}
+}
+
+static void img_job_pool_func(gpointer data, gpointer user_data)
+{
+	struct fpi_img_job *job = data;
+	int nr_minutiae;
+
+	/* detecting minutiae only needs the image, which the job owns, so
+	 * this doesn't hold up cancelling */
+	if (!g_atomic_int_get(&job->cancelled))
+		fp_img_get_minutiae(job->img, &nr_minutiae);
+
+	g_mutex_lock(&job->lock);
+	if (!g_atomic_int_get(&job->cancelled))
+		img_job_process(job);
+	/* checked again, as cancelling stops matching half way */
+	if (g_atomic_int_get(&job->cancelled)) {
+		g_mutex_unlock(&job->lock);
+		img_job_unref(job);
+		return;
+	}
+	/* the posted call might run before the lock is released */
+	g_atomic_int_inc(&job->refcount);
+	fpi_dev_post(FP_DEV(job->imgdev), img_job_done, job);
+	g_mutex_unlock(&job->lock);
+	img_job_unref(job);
+}
+
+/* Returns the worker pool, or NULL if images are processed in the thread
+ * handling events */
+static GThreadPool *get_img_job_pool(void)
+{
+	GThreadPool *pool;
+
+	G_LOCK(img_job_pool);
+	if (img_job_pool == NULL && !img_job_pool_disabled) {
+		const char *env = g_getenv("FP_IMG_PROCESS_THREADS");
+		guint num_threads = MIN(g_get_num_processors(),
+					IMG_PROCESS_MAX_THREADS);
+
+		if (env) {
+			char *end;
+			guint64 val = g_ascii_strtoull(env, &end, 10);
+
+			/* g_ascii_strtoull() wraps negative values around */
+			if (*env == '\0' || *end != '\0' || strchr(env, '-'))
+				fp_warn("invalid FP_IMG_PROCESS_THREADS value %s",
+					env);
+			else
+				num_threads = MIN(val, IMG_PROCESS_MAX_THREADS);
+		}
+#ifndef HAVE_LIBUSB_INTERRUPT
+		/* posted results would wait for the next USB event */
+		num_threads = 0;
+#endif
+		if (num_threads > 0)
+			img_job_pool = g_thread_pool_new(img_job_pool_func, NULL,
+							 num_threads, FALSE, NULL);
+		if (img_job_pool == NULL)
+			img_job_pool_disabled = TRUE;
+	}
+	pool = img_job_pool;
+	G_UNLOCK(img_job_pool);
+
+	return pool;
+}
+
+/* Makes sure that the worker processing the image of @imgdev won't use the
+ * device or its prints anymore, and drops the result */
+static void img_job_cancel(struct fp_img_dev *imgdev)
+{
+	struct fpi_img_job *job = imgdev->img_job;
+
+	if (!job)
+		return;
+
+	fp_dbg("cancelling image processing");
+	g_atomic_int_set(&job->cancelled, TRUE);
+	/* waits for the worker to stop matching */
+	g_mutex_lock(&job->lock);
+	g_mutex_unlock(&job->lock);
+
+	imgdev->img_job = NULL;
+	imgdev->report_pending = FALSE;
+	img_job_unref(job);
+}
+
+/* Turns @img into print data and matches it, on a worker thread if there
+ * is one. Returns TRUE if the result will be posted back later. */
+static gboolean process_img(struct fp_img_dev *imgdev, struct fp_img *img)
+{
+	struct fpi_img_job *job;
+	GThreadPool *pool;
+
+	job = g_new0(struct fpi_img_job, 1);
+	job->refcount = 1;
+	g_mutex_init(&job->lock);
+	job->imgdev = imgdev;
+	job->img = img;
+
+	pool = get_img_job_pool();
+	if (pool) {
+		g_atomic_int_inc(&job->refcount);
+		imgdev->img_job = job;
+		if (g_thread_pool_push(pool, job, NULL))
+			return TRUE;
+		imgdev->img_job = NULL;
+		job->refcount = 1;
+	}
+
+	img_job_process(job);
+	img_job_apply(job);
+	img_job_unref(job);
+	return FALSE;
+}
+
+/**
+ * fpi_imgdev_exit:
+ *
+ * Waits for the images being processed to be done with, and stops the
+ * worker threads.
+ */
+void fpi_imgdev_exit(void)
+{
+	G_LOCK(img_job_pool);
+	if (img_job_pool)
+		g_thread_pool_free(img_job_pool, FALSE, TRUE);
+	img_job_pool = NULL;
+	img_job_pool_disabled = FALSE;
+	G_UNLOCK(img_job_pool);
 }
 
 /**
@@ -340,7 +635,6 @@ void fpi_imgdev_abort_scan(struct fp_img_dev *imgdev, int result)
  */
 void fpi_imgdev_image_captured(struct fp_img_dev *imgdev, struct fp_img *img)
 {
-	struct fp_print_data *print = NULL;
 	int r;
 	G_DEBUG_HERE();
 
@@ -362,57 +656,16 @@ void fpi_imgdev_image_captured(struct fp_img_dev *imgdev, struct fp_img *img)
 	}
 
 	fp_img_standardize(img);
-	imgdev->acquire_img = img;
-	if (imgdev->action != IMG_ACTION_CAPTURE) {
-		r = fpi_img_to_print_data(imgdev, img, &print);
-		if (r < 0) {
-			fp_dbg("image to print data conversion error: %d", r);
-			imgdev->action_result = FP_ENROLL_RETRY;
-			goto next_state;
-		} else if (img->minutiae->num < MIN_ACCEPTABLE_MINUTIAE) {
-			fp_dbg("not enough minutiae, %d/%d", img->minutiae->num,
-				MIN_ACCEPTABLE_MINUTIAE);
-			fp_print_data_free(print);
-			/* depends on FP_ENROLL_RETRY == FP_VERIFY_RETRY */
-			imgdev->action_result = FP_ENROLL_RETRY;
-			goto next_state;
-		}
-	}
-
-	imgdev->acquire_data = print;
-	switch (imgdev->action) {
-	case IMG_ACTION_ENROLL:
-		if (!imgdev->enroll_data) {
-			imgdev->enroll_data = fpi_print_data_new(FP_DEV(imgdev));
-		}
-		BUG_ON(g_slist_length(print->prints) != 1);
-		/* Move print data from acquire data into enroll_data */
-		imgdev->enroll_data->prints =
-			g_slist_prepend(imgdev->enroll_data->prints, print->prints->data);
-		print->prints = g_slist_remove(print->prints, print->prints->data);
-
-		fp_print_data_free(imgdev->acquire_data);
-		imgdev->acquire_data = NULL;
-		imgdev->enroll_stage++;
-		if (imgdev->enroll_stage == FP_DEV(imgdev)->nr_enroll_stages)
-			imgdev->action_result = FP_ENROLL_COMPLETE;
-		else
-			imgdev->action_result = FP_ENROLL_PASS;
-		break;
-	case IMG_ACTION_VERIFY:
-		verify_process_img(imgdev);
-		break;
-	case IMG_ACTION_IDENTIFY:
-		identify_process_img(imgdev);
-		break;
-	case IMG_ACTION_CAPTURE:
+	if (imgdev->action == IMG_ACTION_CAPTURE) {
+		imgdev->acquire_img = img;
 		imgdev->action_result = FP_CAPTURE_COMPLETE;
-		break;
-	default:
-		BUG();
-		break;
+		goto next_state;
 	}
 
+	/* the driver goes on waiting for the finger to be removed while the
+	 * image is being processed */
+	process_img(imgdev, img);
+
 next_state:
 	imgdev->action_state = IMG_ACQUIRE_STATE_AWAIT_FINGER_OFF;
 	dev_change_state(imgdev, IMGDEV_STATE_AWAIT_FINGER_OFF);
@@ -580,6 +833,7 @@ static int generic_acquire_start(struct fp_dev *dev, int action)
 static void generic_acquire_stop(struct fp_img_dev *imgdev)
 {
 	imgdev->action_state = IMG_ACQUIRE_STATE_DEACTIVATING;
+	img_job_cancel(imgdev);
 	dev_deactivate(imgdev);
 
 	fp_print_data_free(imgdev->acquire_data);
@@ -0,0 +1,227 @@
+/*
+ * Per-device recycling of image buffers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "img-pool"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+
+/* Continuous capture only ever has a handful of images in flight, in one
+ * or two sizes (the raw frame and its resized version). Anything above
+ * these limits is freed rather than kept around. */
+#define POOL_MAX_IMAGES	4
+#define POOL_MAX_BYTES	(4 * 1024 * 1024)
+
+/* Every image allocated from the pool holds a reference, so that images
+ * which outlive their device can still be freed after the device is
+ * closed. */
+struct fpi_img_pool {
+	gint refcount;
+	GMutex lock;
+	gboolean closed;
+	/* Idle images, most recently returned first */
+	GSList *cached;
+	size_t cached_bytes;
+	struct fpi_img_pool_stats stats;
+};
+
+static struct fpi_img_pool *pool_ref(struct fpi_img_pool *pool)
+{
+	g_atomic_int_inc(&pool->refcount);
+	return pool;
+}
+
+static void pool_unref(struct fpi_img_pool *pool)
+{
+	if (!g_atomic_int_dec_and_test(&pool->refcount))
+		return;
+
+	BUG_ON(pool->cached != NULL);
+	g_mutex_clear(&pool->lock);
+	g_free(pool);
+}
+
+/**
+ * fpi_img_pool_new:
+ *
+ * Creates the image pool for a newly opened imaging device. Pooling can
+ * be disabled by setting the `FP_IMG_POOL` environment variable to 0, in
+ * which case images are allocated and freed as usual.
+ *
+ * Returns: a new pool to close with fpi_img_pool_close(), or %NULL if
+ * pooling is disabled
+ */
+struct fpi_img_pool *fpi_img_pool_new(void)
+{
+	const char *env = g_getenv("FP_IMG_POOL");
+	struct fpi_img_pool *pool;
+
+	if (env && g_str_equal(env, "0"))
+		return NULL;
+
+	pool = g_malloc0(sizeof(*pool));
+	pool->refcount = 1;
+	g_mutex_init(&pool->lock);
+	return pool;
+}
+
+/**
+ * fpi_img_pool_close:
+ * @pool: the pool of a device being closed, or %NULL
+ *
+ * Frees the idle images of @pool and drops the device's reference on it.
+ * Images still in use are freed normally once they are released.
+ */
+void fpi_img_pool_close(struct fpi_img_pool *pool)
+{
+	GSList *cached;
+	GSList *elem;
+
+	if (!pool)
+		return;
+
+	g_mutex_lock(&pool->lock);
+	pool->closed = TRUE;
+	cached = pool->cached;
+	pool->cached = NULL;
+	pool->cached_bytes = 0;
+	fp_dbg("%" G_GUINT64_FORMAT " images allocated, %" G_GUINT64_FORMAT
+	       " reused, %" G_GUINT64_FORMAT " returned, %" G_GUINT64_FORMAT
+	       " dropped", pool->stats.allocated, pool->stats.reused,
+	       pool->stats.returned, pool->stats.dropped);
+	g_mutex_unlock(&pool->lock);
+
+	for (elem = cached; elem; elem = g_slist_next(elem)) {
+		g_free(elem->data);
+		pool_unref(pool);
+	}
+	g_slist_free(cached);
+	pool_unref(pool);
+}
+
+/**
+ * fpi_img_pool_get:
+ * @pool: a pool, or %NULL
+ * @length: the length of data to allocate
+ *
+ * Like fpi_img_new(), but reuses an idle image of the same @length from
+ * @pool if there is one. If @pool is %NULL or closed, this behaves
+ * exactly like fpi_img_new().
+ *
+ * Returns: a new #fp_img to free with fp_img_free()
+ */
+struct fp_img *fpi_img_pool_get(struct fpi_img_pool *pool, size_t length)
+{
+	struct fp_img *img = NULL;
+	GSList *elem;
+
+	if (!pool)
+		return fpi_img_new(length);
+
+	g_mutex_lock(&pool->lock);
+	if (pool->closed) {
+		g_mutex_unlock(&pool->lock);
+		return fpi_img_new(length);
+	}
+
+	for (elem = pool->cached; elem; elem = g_slist_next(elem)) {
+		struct fp_img *cached = elem->data;
+
+		if (cached->length == length) {
+			img = cached;
+			pool->cached = g_slist_delete_link(pool->cached, elem);
+			pool->cached_bytes -= length;
+			break;
+		}
+	}
+
+	if (img)
+		pool->stats.reused++;
+	else
+		pool->stats.allocated++;
+	g_mutex_unlock(&pool->lock);
+
+	/* Cached images already hold their pool reference */
+	if (img) {
+		memset(img, 0, sizeof(*img) + length);
+	} else {
+		img = g_malloc0(sizeof(*img) + length);
+		pool_ref(pool);
+	}
+
+	img->length = length;
+	img->data = FPI_IMG_INLINE_DATA(img);
+	img->pool = pool;
+	return img;
+}
+
+/**
+ * fpi_img_pool_put:
+ * @img: an image allocated with fpi_img_pool_get(), with its minutiae and
+ * binarized data already freed
+ *
+ * Returns @img to its pool, or frees it if the pool is closed or full.
+ */
+void fpi_img_pool_put(struct fp_img *img)
+{
+	struct fpi_img_pool *pool = img->pool;
+	gboolean keep;
+
+	g_mutex_lock(&pool->lock);
+	keep = !pool->closed &&
+		g_slist_length(pool->cached) < POOL_MAX_IMAGES &&
+		pool->cached_bytes + img->length <= POOL_MAX_BYTES;
+	if (keep) {
+		pool->cached = g_slist_prepend(pool->cached, img);
+		pool->cached_bytes += img->length;
+		pool->stats.returned++;
+	} else {
+		pool->stats.dropped++;
+	}
+	g_mutex_unlock(&pool->lock);
+
+	if (!keep) {
+		g_free(img);
+		pool_unref(pool);
+	}
+}
+
+/**
+ * fpi_img_pool_get_stats:
+ * @pool: a pool, or %NULL
+ * @stats: the counters to fill in
+ *
+ * Gets the allocation counters of @pool. Once continuous capture has
+ * reached a steady state, only the reused and returned counters should
+ * keep increasing. All the counters are zero if @pool is %NULL.
+ */
+void fpi_img_pool_get_stats(struct fpi_img_pool *pool,
+	struct fpi_img_pool_stats *stats)
+{
+	if (!pool) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	g_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	g_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,198 @@
+/*
+ * Imaging utility functions for libfprint
+ * Copyright (C) 2007-2008 Daniel Drake <dsd@gentoo.org>
+ * Copyright (C) 2013 Vasily Khoruzhick <anarsoul@gmail.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "img"
+
+#include <string.h>
+
+#include "fp_internal.h"
+
+/* Bilinear interpolation weights are in 1/256th of a pixel */
+#define WEIGHT_SHIFT	8
+#define WEIGHT_ONE	(1 << WEIGHT_SHIFT)
+
+/* Maps each destination column or row to the two source pixels it is
+ * interpolated from, sampling at pixel centers, and clamping at the edges
+ * of the source image. */
+struct resize_map {
+	int *src0;
+	int *src1;
+	int *weight;
+};
+
+static void resize_map_init(struct resize_map *map, int src_len,
+	unsigned int factor)
+{
+	int dst_len = src_len * factor;
+	int i;
+
+	map->src0 = g_new(int, dst_len * 3);
+	map->src1 = map->src0 + dst_len;
+	map->weight = map->src1 + dst_len;
+
+	for (i = 0; i < dst_len; i++) {
+		/* (i + 0.5) / factor - 0.5, in fixed point */
+		int pos = ((2 * i + 1) * (WEIGHT_ONE / 2)) / (int) factor
+			- WEIGHT_ONE / 2;
+		int src = pos >= 0 ? pos >> WEIGHT_SHIFT : -1;
+
+		map->weight[i] = pos - src * WEIGHT_ONE;
+		map->src0[i] = CLAMP(src, 0, src_len - 1);
+		map->src1[i] = CLAMP(src + 1, 0, src_len - 1);
+	}
+}
+
+static void resize_map_clear(struct resize_map *map)
+{
+	g_free(map->src0);
+}
+
+/* Scales up one source line horizontally, keeping the extra precision */
+static void scale_line(const unsigned char *src, guint16 *dst, int dst_len,
+	const struct resize_map *cols)
+{
+	int i;
+
+	for (i = 0; i < dst_len; i++) {
+		int w = cols->weight[i];
+
+		dst[i] = src[cols->src0[i]] * (WEIGHT_ONE - w) +
+			src[cols->src1[i]] * w;
+	}
+}
+
+/* Blends two scaled lines into a destination row. This is where most of
+ * the time goes, and it is a plain loop which the compiler vectorizes. */
+static void blend_lines(const guint16 *line0, const guint16 *line1,
+	unsigned char *dst, int len, int w)
+{
+	guint32 w0 = WEIGHT_ONE - w;
+	int i;
+
+	for (i = 0; i < len; i++)
+		dst[i] = (line0[i] * w0 + line1[i] * (guint32) w +
+			  (1 << (2 * WEIGHT_SHIFT - 1))) >> (2 * WEIGHT_SHIFT);
+}
+
+static void upscale(const unsigned char *src, int width, int height,
+	unsigned char *dst, unsigned int w_factor, unsigned int h_factor)
+{
+	int new_width = width * w_factor;
+	int new_height = height * h_factor;
+	struct resize_map cols, rows;
+	guint16 *lines[2];
+	int cached[2] = { -1, -1 };
+	int y;
+
+	resize_map_init(&cols, width, w_factor);
+	resize_map_init(&rows, height, h_factor);
+	lines[0] = g_new(guint16, new_width * 2);
+	lines[1] = lines[0] + new_width;
+
+	for (y = 0; y < new_height; y++) {
+		int src0 = rows.src0[y];
+		int src1 = rows.src1[y];
+
+		/* Source rows are only ever walked down, so at most one of
+		 * the two scaled lines needs computing for each row */
+		if (cached[0] != src0) {
+			if (cached[1] == src0) {
+				guint16 *tmp = lines[0];
+				lines[0] = lines[1];
+				lines[1] = tmp;
+				cached[1] = -1;
+			} else {
+				scale_line(src + src0 * width, lines[0],
+					   new_width, &cols);
+			}
+			cached[0] = src0;
+		}
+		if (cached[1] != src1) {
+			scale_line(src + src1 * width, lines[1], new_width,
+				   &cols);
+			cached[1] = src1;
+		}
+
+		blend_lines(lines[0], lines[1], dst + y * new_width,
+			    new_width, rows.weight[y]);
+	}
+
+	g_free(lines[0]);
+	resize_map_clear(&cols);
+	resize_map_clear(&rows);
+}
+
+static gboolean native_resolution_enabled(void)
+{
+	const char *env = g_getenv("FP_IMG_NATIVE_RESOLUTION");
+
+	return env && g_str_equal(env, "1");
+}
+
+/**
+ * fpi_img_resize:
+ * @img: an #fp_img image
+ * @w_factor: horizontal factor to resize the image by
+ * @h_factor: vertical factor to resize the image by
+ *
+ * Resizes the #fp_img image by scaling it by @w_factor times horizontally
+ * and @h_factor times vertically, using bilinear interpolation.
+ *
+ * If the `FP_IMG_NATIVE_RESOLUTION` environment variable is set to 1 and
+ * both factors are equal, the image is copied at its original size instead,
+ * and minutiae are later extracted with parameters scaled down to match,
+ * then mapped back to the coordinates of the enlarged image.
+ *
+ * Returns: a newly allocated #fp_img, the original @img will not be modified
+ * and will also need to be freed
+ */
+struct fp_img *fpi_img_resize(struct fp_img *img, unsigned int w_factor, unsigned int h_factor)
+{
+	int new_width = img->width * w_factor;
+	int new_height = img->height * h_factor;
+	struct fp_img *newimg;
+
+	g_return_val_if_fail (w_factor > 0 && h_factor > 0, NULL);
+
+	if (w_factor == h_factor && w_factor > 1 &&
+	    native_resolution_enabled()) {
+		newimg = fpi_img_pool_get(img->pool, img->width * img->height);
+		newimg->width = img->width;
+		newimg->height = img->height;
+		newimg->flags = img->flags;
+		newimg->native_scale = w_factor * MAX(img->native_scale, 1);
+		memcpy(newimg->data, img->data, newimg->length);
+		return newimg;
+	}
+
+	newimg = fpi_img_pool_get(img->pool, new_width * new_height);
+	newimg->width = new_width;
+	newimg->height = new_height;
+	newimg->flags = img->flags;
+	newimg->native_scale = img->native_scale;
+
+	if (w_factor == 1 && h_factor == 1)
+		memcpy(newimg->data, img->data, new_width * new_height);
+	else
+		upscale(img->data, img->width, img->height, newimg->data,
+			w_factor, h_factor);
+
+	return newimg;
+}
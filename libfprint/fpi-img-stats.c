@@ -0,0 +1,241 @@
+/*
+ * Image statistics helpers for drivers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "img-stats"
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "fp_internal.h"
+
+/* Pixels are accumulated in blocks with 32-bit partial sums, which keeps
+ * the inner loops simple enough for the compiler to vectorize. The partial
+ * sum of squares can't overflow: 255 * 255 * 65536 < 2^32. */
+#define STATS_BLOCK_SIZE	65536
+
+/**
+ * fpi_img_stats:
+ * @count: the number of pixels
+ * @sum: the sum of the pixel values
+ * @sum_sq: the sum of the squared pixel values
+ * @min: the lowest pixel value
+ * @max: the highest pixel value
+ *
+ * Statistics of a buffer of 8-bit pixels, computed by fpi_img_stats_compute().
+ */
+
+/**
+ * fpi_img_stats_compute:
+ * @buf: buffer (usually bitmap, one byte per pixel)
+ * @size: size of @buf
+ * @stats: the #fpi_img_stats to fill in
+ *
+ * Computes the sum, sum of squares, minimum and maximum of the pixels of
+ * @buf in a single pass. The sums use 64-bit accumulators, so there is no
+ * practical limit to @size.
+ */
+void fpi_img_stats_compute(const unsigned char *buf, size_t size,
+	struct fpi_img_stats *stats)
+{
+	unsigned char min = 255, max = 0;
+	guint64 sum = 0, sum_sq = 0;
+	size_t i = 0;
+
+	while (i < size) {
+		size_t end = i + MIN(size - i, STATS_BLOCK_SIZE);
+		guint32 block_sum = 0, block_sum_sq = 0;
+
+		for (; i < end; i++) {
+			unsigned char v = buf[i];
+
+			block_sum += v;
+			block_sum_sq += (guint32) v * v;
+			min = MIN(min, v);
+			max = MAX(max, v);
+		}
+		sum += block_sum;
+		sum_sq += block_sum_sq;
+	}
+
+	stats->count = size;
+	stats->sum = sum;
+	stats->sum_sq = sum_sq;
+	stats->min = size ? min : 0;
+	stats->max = max;
+}
+
+/**
+ * fpi_img_stats_sq_dev:
+ * @stats: statistics computed with fpi_img_stats_compute()
+ *
+ * Calculates the squared standard deviation of the pixels described by
+ * @stats, with the mean rounded down to an integer as fpi_std_sq_dev()
+ * does.
+ *
+ * Returns: the squared standard deviation, or 0 if there are no pixels
+ */
+guint64 fpi_img_stats_sq_dev(const struct fpi_img_stats *stats)
+{
+	guint64 mean;
+
+	if (stats->count == 0)
+		return 0;
+
+	/* sum ((v - mean) ^ 2), expanded so that it only needs the sums */
+	mean = stats->sum / stats->count;
+	return (stats->sum_sq - 2 * mean * stats->sum +
+		stats->count * mean * mean) / stats->count;
+}
+
+/**
+ * fpi_img_histogram:
+ * @buf: buffer (usually bitmap, one byte per pixel)
+ * @size: size of @buf
+ * @histogram: the 256 bins to fill in
+ *
+ * Counts the occurrences of each pixel value in @buf.
+ */
+void fpi_img_histogram(const unsigned char *buf, size_t size,
+	guint32 histogram[256])
+{
+	/* Spreading consecutive pixels over separate tables avoids stalling
+	 * on runs of identical values, which are common in empty frames. */
+	guint32 partial[4][256];
+	size_t i;
+	int v;
+
+	memset(partial, 0, sizeof(partial));
+	for (i = 0; i + 4 <= size; i += 4) {
+		partial[0][buf[i]]++;
+		partial[1][buf[i + 1]]++;
+		partial[2][buf[i + 2]]++;
+		partial[3][buf[i + 3]]++;
+	}
+	for (; i < size; i++)
+		partial[0][buf[i]]++;
+
+	for (v = 0; v < 256; v++)
+		histogram[v] = partial[0][v] + partial[1][v] +
+			partial[2][v] + partial[3][v];
+}
+
+/**
+ * fpi_img_histogram_4bpp:
+ * @buf: buffer of 4-bit pixels, two per byte
+ * @size: size of @buf in bytes
+ * @histogram: the 16 bins to fill in
+ *
+ * Counts the occurrences of each pixel value in @buf, which holds two
+ * 4-bit pixels per byte, as sent by some sensors.
+ */
+void fpi_img_histogram_4bpp(const unsigned char *buf, size_t size,
+	guint32 histogram[16])
+{
+	guint32 bytes[256];
+	int v;
+
+	fpi_img_histogram(buf, size, bytes);
+
+	memset(histogram, 0, 16 * sizeof(*histogram));
+	for (v = 0; v < 256; v++) {
+		histogram[v >> 4] += bytes[v];
+		histogram[v & 0x0f] += bytes[v];
+	}
+}
+
+/**
+ * fpi_img_sq_diff_sum:
+ * @buf1: buffer (usually bitmap, one byte per pixel)
+ * @buf2: buffer (usually bitmap, one byte per pixel)
+ * @size: buffer size of smallest buffer
+ *
+ * Calculates the sum of the squared differences between the pixels of
+ * @buf1 and @buf2, using a 64-bit accumulator.
+ *
+ * Returns: the sum of squared differences
+ */
+guint64 fpi_img_sq_diff_sum(const unsigned char *buf1,
+	const unsigned char *buf2, size_t size)
+{
+	guint64 sum = 0;
+	size_t i = 0;
+
+	while (i < size) {
+		size_t end = i + MIN(size - i, STATS_BLOCK_SIZE);
+		guint32 block_sum = 0;
+
+		for (; i < end; i++) {
+			int diff = (int) buf1[i] - (int) buf2[i];
+			block_sum += (guint32) (diff * diff);
+		}
+		sum += block_sum;
+	}
+
+	return sum;
+}
+
+/**
+ * fpi_std_sq_dev:
+ * @buf: buffer (usually bitmap, one byte per pixel)
+ * @size: size of @buffer
+ *
+ * Calculates the squared standard deviation of the individual
+ * pixels in the buffer, as per the following formula:
+ * |[<!-- -->
+ *    mean = sum (buf[0..size]) / size
+ *    sq_dev = sum ((buf[0.size] - mean) ^ 2)
+ * ]|
+ * This function is usually used to determine whether image
+ * is empty.
+ *
+ * Returns: the squared standard deviation for @buffer
+ */
+int fpi_std_sq_dev(const unsigned char *buf, int size)
+{
+	struct fpi_img_stats stats;
+
+	g_return_val_if_fail (size > 0, -EINVAL);
+
+	fpi_img_stats_compute(buf, size, &stats);
+	return fpi_img_stats_sq_dev(&stats);
+}
+
+/**
+ * fpi_mean_sq_diff_norm:
+ * @buf1: buffer (usually bitmap, one byte per pixel)
+ * @buf2: buffer (usually bitmap, one byte per pixel)
+ * @size: buffer size of smallest buffer
+ *
+ * This function calculates the normalized mean square difference of
+ * two buffers, usually two lines, as per the following formula:
+ * |[<!-- -->
+ *    sq_diff = sum ((buf1[0..size] - buf2[0..size]) ^ 2) / size
+ * ]|
+ *
+ * This functions is usually used to get numerical difference
+ * between two images.
+ *
+ * Returns: the normalized mean squared difference between @buf1 and @buf2
+ */
+int fpi_mean_sq_diff_norm(unsigned char *buf1, unsigned char *buf2, int size)
+{
+	g_return_val_if_fail (size > 0, -EINVAL);
+
+	return fpi_img_sq_diff_sum(buf1, buf2, size) / size;
+}
@@ -73,6 +73,39 @@ struct fp_img *fpi_img_new(size_t length)
 	struct fp_img *img = g_malloc0(sizeof(*img) + length);
 	fp_dbg("length=%zd", length);
 	img->length = length;
+	img->data = FPI_IMG_INLINE_DATA(img);
+	return img;
+}
+
+/**
+ * fpi_img_new_from_buffer:
+ * @data: the start of the image data, inside @buffer
+ * @length: the length of the image data
+ * @buffer: the buffer holding the image data, usually a transfer buffer
+ * allocated with fpi_usb_alloc_buffer()
+ * @buffer_free: the function to free @buffer with, usually g_free()
+ *
+ * Creates a new #fp_img structure using @data as its pixel storage instead
+ * of allocating and copying it. The image takes ownership of @buffer, which
+ * will be freed with @buffer_free along with the image. This allows drivers
+ * to hand over the buffer a frame was received in without copying it.
+ *
+ * Returns: a new #fp_img to free with fp_img_free()
+ */
+struct fp_img *fpi_img_new_from_buffer(unsigned char *data, size_t length,
+	gpointer buffer, GDestroyNotify buffer_free)
+{
+	struct fp_img *img;
+
+	g_return_val_if_fail (data != NULL, NULL);
+	g_return_val_if_fail (buffer_free != NULL, NULL);
+
+	img = g_malloc0(sizeof(*img));
+	fp_dbg("length=%zd", length);
+	img->length = length;
+	img->data = data;
+	img->buffer = buffer;
+	img->buffer_free = buffer_free;
 	return img;
 }
 
@@ -84,6 +117,9 @@ struct fp_img *fpi_img_new(size_t length)
  * driver's advertised height and width to calculate the size of the
  * length of data to allocate.
  *
+ * The image is taken from the device's pool, so that continuous capture
+ * recycles the buffers of the images it is done with.
+ *
  * Returns: a new #fp_img to free with fp_img_free()
  */
 struct fp_img *fpi_img_new_for_imgdev(struct fp_img_dev *imgdev)
@@ -91,7 +127,7 @@ struct fp_img *fpi_img_new_for_imgdev(struct fp_img_dev *imgdev)
 	struct fp_img_driver *imgdrv = fpi_driver_to_img_driver(FP_DEV(imgdev)->drv);
 	int width = imgdrv->img_width;
 	int height = imgdrv->img_height;
-	struct fp_img *img = fpi_img_new(width * height);
+	struct fp_img *img = fpi_img_pool_get(imgdev->img_pool, width * height);
 	img->width = width;
 	img->height = height;
 	return img;
@@ -138,7 +174,25 @@ gboolean fpi_img_is_sane(struct fp_img *img)
  */
 struct fp_img *fpi_img_realloc(struct fp_img *img, size_t newsize)
 {
-	return g_realloc(img, sizeof(*img) + newsize);
+	if (img->buffer_free) {
+		/* Move the data out of the handed over buffer */
+		struct fp_img *newimg = g_malloc(sizeof(*img) + newsize);
+
+		*newimg = *img;
+		memcpy(FPI_IMG_INLINE_DATA(newimg), img->data,
+		       MIN(img->length, newsize));
+		img->buffer_free(img->buffer);
+		g_free(img);
+		img = newimg;
+		img->buffer = NULL;
+		img->buffer_free = NULL;
+	} else {
+		img = g_realloc(img, sizeof(*img) + newsize);
+	}
+
+	img->length = newsize;
+	img->data = FPI_IMG_INLINE_DATA(img);
+	return img;
 }
 
 /**
@@ -156,7 +210,12 @@ API_EXPORTED void fp_img_free(struct fp_img *img)
 		free_minutiae(img->minutiae);
 	if (img->binarized)
 		free(img->binarized);
-	g_free(img);
+	if (img->buffer_free)
+		img->buffer_free(img->buffer);
+	if (img->pool)
+		fpi_img_pool_put(img);
+	else
+		g_free(img);
 }
 
 /**
@@ -239,49 +298,110 @@ API_EXPORTED int fp_img_save_to_file(struct fp_img *img, char *path)
 	return 0;
 }
 
-static void vflip(struct fp_img *img)
-{
-	int width = img->width;
-	int data_len = img->width * img->height;
-	unsigned char rowbuf[width];
-	int i;
-
-	for (i = 0; i < img->height / 2; i++) {
-		int offset = i * width;
-		int swap_offset = data_len - (width * (i + 1));
-
-		/* copy top row into buffer */
-		memcpy(rowbuf, img->data + offset, width);
+/* The helpers below move pixels 8 at a time through 64-bit words, with
+ * a byte-at-a-time tail. @mask is 0xff to invert the colors while moving
+ * the pixels, or 0 to copy them unchanged. */
 
-		/* copy lower row over upper row */
-		memcpy(img->data + offset, img->data + swap_offset, width);
+/* Swaps @a[0..len] with @b[0..len], the ranges must not overlap. */
+static void swap_pixels(unsigned char *a, unsigned char *b, size_t len,
+	unsigned char mask)
+{
+	guint64 mask64 = mask ? G_MAXUINT64 : 0;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		guint64 front, back;
+
+		memcpy(&front, a + i, 8);
+		memcpy(&back, b + i, 8);
+		front ^= mask64;
+		back ^= mask64;
+		memcpy(a + i, &back, 8);
+		memcpy(b + i, &front, 8);
+	}
+	for (; i < len; i++) {
+		unsigned char tmp = a[i];
+		a[i] = b[i] ^ mask;
+		b[i] = tmp ^ mask;
+	}
+}
 
-		/* copy buffer over lower row */
-		memcpy(img->data + swap_offset, rowbuf, width);
+/* Swaps @a[0..len] with the @len pixels ending at @b_end in reverse order,
+ * the ranges must not overlap. */
+static void swap_pixels_reversed(unsigned char *a, unsigned char *b_end,
+	size_t len, unsigned char mask)
+{
+	guint64 mask64 = mask ? G_MAXUINT64 : 0;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		unsigned char *b = b_end - i - 7;
+		guint64 front, back;
+
+		/* Reversing the bytes of a word works on either endianness */
+		memcpy(&front, a + i, 8);
+		memcpy(&back, b, 8);
+		front = GUINT64_SWAP_LE_BE(front) ^ mask64;
+		back = GUINT64_SWAP_LE_BE(back) ^ mask64;
+		memcpy(a + i, &back, 8);
+		memcpy(b, &front, 8);
+	}
+	for (; i < len; i++) {
+		unsigned char tmp = a[i];
+		a[i] = *(b_end - i) ^ mask;
+		*(b_end - i) = tmp ^ mask;
 	}
 }
 
-static void hflip(struct fp_img *img)
+static void invert_pixels(unsigned char *data, size_t len)
 {
-	int width = img->width;
-	unsigned char rowbuf[width];
-	int i, j;
+	size_t i;
 
-	for (i = 0; i < img->height; i++) {
-		int offset = i * width;
+	for (i = 0; i + 8 <= len; i += 8) {
+		guint64 x;
 
-		memcpy(rowbuf, img->data + offset, width);
-		for (j = 0; j < width; j++)
-			img->data[offset + j] = rowbuf[width - j - 1];
+		memcpy(&x, data + i, 8);
+		x = ~x;
+		memcpy(data + i, &x, 8);
 	}
+	for (; i < len; i++)
+		data[i] ^= 0xff;
 }
 
-static void invert_colors(struct fp_img *img)
+/* Applies any combination of the standardization flags in a single
+ * in-place pass over the image: every pixel is read and written once. */
+static void standardize(struct fp_img *img, gboolean vflip, gboolean hflip,
+	gboolean invert)
 {
-	int data_len = img->width * img->height;
-	int i;
-	for (i = 0; i < data_len; i++)
-		img->data[i] = 0xff - img->data[i];
+	size_t width = img->width;
+	size_t height = img->height;
+	size_t data_len = width * height;
+	unsigned char mask = invert ? 0xff : 0;
+	unsigned char *data = img->data;
+	size_t i;
+
+	if (vflip && hflip) {
+		/* A 180 degree rotation is the reversed buffer */
+		swap_pixels_reversed(data, data + data_len - 1, data_len / 2, mask);
+		if (invert && data_len % 2)
+			data[data_len / 2] ^= 0xff;
+	} else if (vflip) {
+		for (i = 0; i < height / 2; i++)
+			swap_pixels(data + i * width,
+				data + (height - i - 1) * width, width, mask);
+		if (invert && height % 2)
+			invert_pixels(data + (height / 2) * width, width);
+	} else if (hflip) {
+		for (i = 0; i < height; i++) {
+			unsigned char *row = data + i * width;
+
+			swap_pixels_reversed(row, row + width - 1, width / 2, mask);
+			if (invert && width % 2)
+				row[width / 2] ^= 0xff;
+		}
+	} else if (invert) {
+		invert_pixels(data, data_len);
+	}
 }
 
 /**
@@ -295,23 +415,16 @@ static void invert_colors(struct fp_img *img)
  */
 API_EXPORTED void fp_img_standardize(struct fp_img *img)
 {
-	if (img->flags & FP_IMG_V_FLIPPED) {
-		vflip(img);
-		img->flags &= ~FP_IMG_V_FLIPPED;
-	}
-	if (img->flags & FP_IMG_H_FLIPPED) {
-		hflip(img);
-		img->flags &= ~FP_IMG_H_FLIPPED;
-	}
-	if (img->flags & FP_IMG_COLORS_INVERTED) {
-		invert_colors(img);
-		img->flags &= ~FP_IMG_COLORS_INVERTED;
-	}
+	standardize(img, img->flags & FP_IMG_V_FLIPPED,
+		img->flags & FP_IMG_H_FLIPPED,
+		img->flags & FP_IMG_COLORS_INVERTED);
+	img->flags &= ~(FP_IMG_V_FLIPPED | FP_IMG_H_FLIPPED
+		| FP_IMG_COLORS_INVERTED);
 }
 
 /* Based on write_minutiae_XYTQ and bz_load */
 static void minutiae_to_xyt(struct fp_minutiae *minutiae, int bwidth,
-	int bheight, unsigned char *buf)
+	int bheight, unsigned int scale, unsigned char *buf)
 {
 	int i;
 	struct fp_minutia *minutia;
@@ -326,6 +439,8 @@ static void minutiae_to_xyt(struct fp_minutiae *minutiae, int bwidth,
 
 		lfs2nist_minutia_XYT(&c[i].col[0], &c[i].col[1], &c[i].col[2],
 				minutia, bwidth, bheight);
+		c[i].col[0] *= scale;
+		c[i].col[1] *= scale;
 		c[i].col[3] = sround(minutia->reliability * 100.0);
 
 		if (c[i].col[2] > 180)
@@ -346,6 +461,32 @@ static void minutiae_to_xyt(struct fp_minutiae *minutiae, int bwidth,
 #define FP_IMG_STANDARDIZATION_FLAGS (FP_IMG_V_FLIPPED | FP_IMG_H_FLIPPED \
 	| FP_IMG_COLORS_INVERTED)
 
+/* Pixel distances of the LFS parameters, which assume DEFAULT_PPI */
+static void scale_lfsparms(LFSPARMS *lfsparms, unsigned int scale)
+{
+#define SCALE_DIST(field) \
+	lfsparms->field = MAX(lfsparms->field / (int) scale, 1)
+
+	SCALE_DIST(join_line_radius);
+	SCALE_DIST(blocksize);
+	SCALE_DIST(windowoffset);
+	lfsparms->windowsize = lfsparms->blocksize + 2 * lfsparms->windowoffset;
+	SCALE_DIST(dirbin_grid_w);
+	SCALE_DIST(dirbin_grid_h);
+	SCALE_DIST(max_minutia_delta);
+	SCALE_DIST(maxtrans);
+	SCALE_DIST(max_rmtest_dist);
+	SCALE_DIST(max_hook_len);
+	SCALE_DIST(max_half_loop);
+	SCALE_DIST(small_loop_len);
+	SCALE_DIST(inv_block_margin);
+	SCALE_DIST(max_overlap_dist);
+	SCALE_DIST(max_overlap_join_dist);
+	SCALE_DIST(max_malformation_dist);
+
+#undef SCALE_DIST
+}
+
 static int fpi_img_detect_minutiae(struct fp_img *img)
 {
 	struct fp_minutiae *minutiae;
@@ -355,6 +496,8 @@ static int fpi_img_detect_minutiae(struct fp_img *img)
 	int map_w, map_h;
 	unsigned char *bdata;
 	int bw, bh, bd;
+	unsigned int scale = MAX(img->native_scale, 1);
+	LFSPARMS lfsparms = g_lfsparms_V2;
 	GTimer *timer;
 
 	if (img->flags & FP_IMG_STANDARDIZATION_FLAGS) {
@@ -362,13 +505,17 @@ static int fpi_img_detect_minutiae(struct fp_img *img)
 		return -EINVAL;
 	}
 
+	/* Images which weren't enlarged to DEFAULT_PPI get scaled parameters */
+	if (scale > 1)
+		scale_lfsparms(&lfsparms, scale);
+
 	/* 25.4 mm per inch */
 	timer = g_timer_new();
 	r = get_minutiae(&minutiae, &quality_map, &direction_map,
                          &low_contrast_map, &low_flow_map, &high_curve_map,
                          &map_w, &map_h, &bdata, &bw, &bh, &bd,
                          img->data, img->width, img->height, 8,
-						 DEFAULT_PPI / (double)25.4, &g_lfsparms_V2);
+						 DEFAULT_PPI / (double)25.4 / scale, &lfsparms);
 	g_timer_stop(timer);
 	fp_dbg("minutiae scan completed in %f secs", g_timer_elapsed(timer, NULL));
 	g_timer_destroy(timer);
@@ -410,7 +557,8 @@ int fpi_img_to_print_data(struct fp_img_dev *imgdev, struct fp_img *img,
 	print = fpi_print_data_new(FP_DEV(imgdev));
 	item = fpi_print_data_item_new(sizeof(struct xyt_struct));
 	print->type = PRINT_DATA_NBIS_MINUTIAE;
-	minutiae_to_xyt(img->minutiae, img->width, img->height, item->data);
+	minutiae_to_xyt(img->minutiae, img->width, img->height,
+		MAX(img->native_scale, 1), item->data);
 	print->prints = g_slist_prepend(print->prints, item);
 
 	/* FIXME: the print buffer at this point is endian-specific, and will
@@ -421,8 +569,14 @@ int fpi_img_to_print_data(struct fp_img_dev *imgdev, struct fp_img *img,
 	return 0;
 }
 
+/* Bozorth keeps its working tables in global variables, so devices
+ * processing images on separate threads have to take turns */
+G_LOCK_DEFINE_STATIC(bozorth);
+
+/* The comparisons below stop between prints, returning -ECANCELED, once
+ * @cancelled is set with g_atomic_int_set() from another thread */
 int fpi_img_compare_print_data(struct fp_print_data *enrolled_print,
-	struct fp_print_data *new_print)
+	struct fp_print_data *new_print, gboolean *cancelled)
 {
 	int score, max_score = 0, probe_len;
 	struct xyt_struct *pstruct = NULL;
@@ -444,9 +598,14 @@ int fpi_img_compare_print_data(struct fp_print_data *enrolled_print,
 	data_item = new_print->prints->data;
 	pstruct = (struct xyt_struct *)data_item->data;
 
+	G_LOCK(bozorth);
 	probe_len = bozorth_probe_init(pstruct);
 	list_item = enrolled_print->prints;
 	do {
+		if (cancelled && g_atomic_int_get(cancelled)) {
+			max_score = -ECANCELED;
+			break;
+		}
 		data_item = list_item->data;
 		gstruct = (struct xyt_struct *)data_item->data;
 		score = bozorth_to_gallery(probe_len, pstruct, gstruct);
@@ -454,12 +613,14 @@ int fpi_img_compare_print_data(struct fp_print_data *enrolled_print,
 		max_score = max(score, max_score);
 		list_item = g_slist_next(list_item);
 	} while (list_item);
+	G_UNLOCK(bozorth);
 
 	return max_score;
 }
 
 int fpi_img_compare_print_data_to_gallery(struct fp_print_data *print,
-	struct fp_print_data **gallery, int match_threshold, size_t *match_offset)
+	struct fp_print_data **gallery, int match_threshold, size_t *match_offset,
+	gboolean *cancelled)
 {
 	struct xyt_struct *pstruct;
 	struct xyt_struct *gstruct;
@@ -467,7 +628,7 @@ int fpi_img_compare_print_data_to_gallery(struct fp_print_data *print,
 	struct fp_print_data_item *data_item;
 	int probe_len;
 	size_t i = 0;
-	int r;
+	int r = FP_VERIFY_NO_MATCH;
 	GSList *list_item;
 
 	if (g_slist_length(print->prints) != 1) {
@@ -478,21 +639,29 @@ int fpi_img_compare_print_data_to_gallery(struct fp_print_data *print,
 	data_item = print->prints->data;
 	pstruct = (struct xyt_struct *)data_item->data;
 
+	G_LOCK(bozorth);
 	probe_len = bozorth_probe_init(pstruct);
-	while ((gallery_print = gallery[i++])) {
+	while (r != FP_VERIFY_MATCH && (gallery_print = gallery[i++])) {
+		if (cancelled && g_atomic_int_get(cancelled)) {
+			r = -ECANCELED;
+			break;
+		}
 		list_item = gallery_print->prints;
 		do {
 			data_item = list_item->data;
 			gstruct = (struct xyt_struct *)data_item->data;
-			r = bozorth_to_gallery(probe_len, pstruct, gstruct);
-			if (r >= match_threshold) {
+			if (bozorth_to_gallery(probe_len, pstruct, gstruct) >=
+			    match_threshold) {
 				*match_offset = i - 1;
-				return FP_VERIFY_MATCH;
+				r = FP_VERIFY_MATCH;
+				break;
 			}
 			list_item = g_slist_next(list_item);
 		} while (list_item);
 	}
-	return FP_VERIFY_NO_MATCH;
+	G_UNLOCK(bozorth);
+
+	return r;
 }
 
 /**
@@ -614,69 +783,3 @@ API_EXPORTED int fp_minutia_get_coords(struct fp_minutia *minutia, int *coord_x,
 
 	return 0;
 }
-
-/**
- * fpi_std_sq_dev:
- * @buf: buffer (usually bitmap, one byte per pixel)
- * @size: size of @buffer
- *
- * Calculates the squared standard deviation of the individual
- * pixels in the buffer, as per the following formula:
- * |[<!-- -->
- *    mean = sum (buf[0..size]) / size
- *    sq_dev = sum ((buf[0.size] - mean) ^ 2)
- * ]|
- * This function is usually used to determine whether image
- * is empty.
- *
- * Returns: the squared standard deviation for @buffer
- */
-int fpi_std_sq_dev(const unsigned char *buf, int size)
-{
-	int res = 0, mean = 0, i;
-
-	if (size > (INT_MAX / 65536)) {
-		fp_err("%s: we might get an overflow!", __func__);
-		return -EOVERFLOW;
-	}
-
-	for (i = 0; i < size; i++)
-		mean += buf[i];
-
-	mean /= size;
-
-	for (i = 0; i < size; i++) {
-		int dev = (int)buf[i] - mean;
-		res += dev*dev;
-	}
-
-	return res / size;
-}
-
-/**
- * fpi_mean_sq_diff_norm:
- * @buf1: buffer (usually bitmap, one byte per pixel)
- * @buf2: buffer (usually bitmap, one byte per pixel)
- * @size: buffer size of smallest buffer
- *
- * This function calculates the normalized mean square difference of
- * two buffers, usually two lines, as per the following formula:
- * |[<!-- -->
- *    sq_diff = sum ((buf1[0..size] - buf2[0..size]) ^ 2) / size
- * ]|
- *
- * This functions is usually used to get numerical difference
- * between two images.
- *
- * Returns: the normalized mean squared difference between @buf1 and @buf2
- */
-int fpi_mean_sq_diff_norm(unsigned char *buf1, unsigned char *buf2, int size)
-{
-	int res = 0, i;
-	for (i = 0; i < size; i++) {
-		int dev = (int)buf1[i] - (int)buf2[i];
-		res += dev * dev;
-	}
-
-	return res / size;
-}
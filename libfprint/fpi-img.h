@@ -21,6 +21,7 @@
 #define __FPI_IMG_H__
 
 #include <stdint.h>
+#include <glib.h>
 
 struct fp_minutiae;
 
@@ -55,7 +56,9 @@ typedef enum {
  * @flags: @FpiImgFlags flags describing the image contained in the structure
  * @minutiae: an opaque structure representing the detected minutiae
  * @binarized: the binarized image data
- * @data: the start of the image data, which will be of @length size.
+ * @data: the start of the image data, which will be of @length size. This
+ * usually follows the structure in memory, but can also point into a buffer
+ * handed over with fpi_img_new_from_buffer().
  *
  * A structure representing a captured, or processed image. The @flags member
  * will show its current state, including whether whether the binarized form
@@ -69,16 +72,44 @@ struct fp_img {
 	FpiImgFlags flags;
 	/*< private >*/
 	struct fp_minutiae *minutiae;
+	struct fpi_img_pool *pool;
+	gpointer buffer;
+	GDestroyNotify buffer_free;
+	/* Factor fpi_img_resize() skipped, 0 if the image wasn't resized */
+	unsigned int native_scale;
 	/*< public >*/
 	unsigned char *binarized;
-	unsigned char data[0];
+	unsigned char *data;
 };
 
+/* Location of the pixels of an image allocated along with its structure */
+#define FPI_IMG_INLINE_DATA(img) ((unsigned char *) ((img) + 1))
+
 struct fp_img *fpi_img_new(size_t length);
 struct fp_img *fpi_img_new_for_imgdev(struct fp_img_dev *imgdev);
+struct fp_img *fpi_img_new_from_buffer(unsigned char *data, size_t length,
+	gpointer buffer, GDestroyNotify buffer_free);
 struct fp_img *fpi_img_realloc(struct fp_img *img, size_t newsize);
 struct fp_img *fpi_img_resize(struct fp_img *img, unsigned int w_factor, unsigned int h_factor);
 
+struct fpi_img_stats {
+	size_t count;
+	guint64 sum;
+	guint64 sum_sq;
+	unsigned char min;
+	unsigned char max;
+};
+
+void fpi_img_stats_compute(const unsigned char *buf, size_t size,
+	struct fpi_img_stats *stats);
+guint64 fpi_img_stats_sq_dev(const struct fpi_img_stats *stats);
+void fpi_img_histogram(const unsigned char *buf, size_t size,
+	guint32 histogram[256]);
+void fpi_img_histogram_4bpp(const unsigned char *buf, size_t size,
+	guint32 histogram[16]);
+guint64 fpi_img_sq_diff_sum(const unsigned char *buf1,
+	const unsigned char *buf2, size_t size);
+
 int fpi_std_sq_dev(const unsigned char *buf, int size);
 int fpi_mean_sq_diff_norm(unsigned char *buf1, unsigned char *buf2, int size);
 
@@ -24,8 +24,15 @@
 
 #include <config.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <poll.h>
 #include <sys/time.h>
+#ifdef HAVE_TIMERFD
+#include <sys/timerfd.h>
+#endif
 
 #include <glib.h>
 #include <libusb.h>
@@ -57,9 +64,13 @@
  * fp_handle_events_timeout() instead. If you wish to do a non-blocking
  * iteration, call fp_handle_events_timeout() with a zero timeout.
  *
+ * Devices which need to be driven from separate threads can be opened in
+ * their own event context, see fp_event_ctx_new().
+ *
  * How to integrate events handling depends on your main loop implementation.
- * The sister fprintd project includes an implementation of main loop handling
- * that integrates into GLib's main loop. The
+ * Applications using GLib's main loop can attach the #GSource returned by
+ * fp_event_source_new() to their #GMainContext, which handles events
+ * whenever they are due. For other main loops, the
  * [libusb documentation](http://libusb.sourceforge.net/api-1.0/group__poll.html#details)
  * also includes more details about how to integrate libfprint events into
  * your main loop.
@@ -75,16 +86,60 @@
  * for example.
  */
 
-/* this is a singly-linked list of pending timers, sorted with the timer that
- * is expiring soonest at the head. */
-static GSList *active_timers = NULL;
+/* the timeouts and USB events of a group of devices, which are all handled
+ * by the same thread. The default context is the one of fp_handle_events(),
+ * see fp_event_ctx_new() for the others. */
+struct fp_event_ctx {
+	libusb_context *usb_ctx;
+	/* this is a binary min-heap of pending timers, with the timer that is
+	 * expiring soonest at index 0. Timers expiring at the same time are
+	 * ordered by creation, and every timer knows its index in the heap so
+	 * that it can be cancelled without searching for it. */
+	GPtrArray *timers;
+	guint64 timer_serial;
+	int handling_events;
+	/* calls queued from other threads with fpi_dev_post(), most recent
+	 * first */
+	GMutex posted_lock;
+	GSList *posted;
+};
+
+struct posted_call {
+	fpi_timeout_fn callback;
+	struct fp_dev *dev;
+	void *data;
+};
+
+static struct fp_event_ctx default_ctx;
+
+/* shared by all the contexts */
+G_LOCK_DEFINE_STATIC(timeout_stats);
+static struct fp_timeout_stats timeout_stats;
+
+/* timer fd armed with the expiry of the first pending timeout of the
+ * default context, see fp_enable_timer_fd(). It's only updated once per
+ * iteration while events are being handled. */
+static int timer_fd = -1;
 
 /* notifiers for added or removed poll fds */
 static fp_pollfd_added_cb fd_added_cb = NULL;
 static fp_pollfd_removed_cb fd_removed_cb = NULL;
 
+/* sources created with fp_event_source_new(), which poll the USB fds */
+struct fpi_event_source {
+	GSource source;
+	GSList *pollfds;
+};
+
+static GSList *event_sources = NULL;
+
 struct fpi_timeout {
+	struct fp_event_ctx *ctx;
 	struct timeval expiry;
+	guint64 serial;
+	guint heap_index;
+	/* link in the dev->timeouts list */
+	GList *dev_link;
 	fpi_timeout_fn callback;
 	struct fp_dev *dev;
 	void *data;
@@ -92,20 +147,108 @@ struct fpi_timeout {
 };
 
 static gboolean fpi_poll_is_setup(void);
+static void timer_fd_update(struct fp_event_ctx *ctx);
 
-static int timeout_sort_fn(gconstpointer _a, gconstpointer _b)
+static gboolean timeout_before(fpi_timeout *a, fpi_timeout *b)
 {
-	fpi_timeout *a = (fpi_timeout *) _a;
-	fpi_timeout *b = (fpi_timeout *) _b;
-	struct timeval *tv_a = &a->expiry;
-	struct timeval *tv_b = &b->expiry;
+	if (timercmp(&a->expiry, &b->expiry, !=))
+		return timercmp(&a->expiry, &b->expiry, <);
+	return a->serial < b->serial;
+}
 
-	if (timercmp(tv_a, tv_b, <))
-		return -1;
-	else if (timercmp(tv_a, tv_b, >))
-		return 1;
-	else
-		return 0;
+static void heap_set(GPtrArray *heap, guint index, fpi_timeout *timeout)
+{
+	g_ptr_array_index(heap, index) = timeout;
+	timeout->heap_index = index;
+}
+
+static void heap_sift_up(GPtrArray *heap, guint index)
+{
+	fpi_timeout *timeout = g_ptr_array_index(heap, index);
+
+	while (index > 0) {
+		guint parent = (index - 1) / 2;
+		fpi_timeout *p = g_ptr_array_index(heap, parent);
+
+		if (!timeout_before(timeout, p))
+			break;
+		heap_set(heap, index, p);
+		index = parent;
+	}
+	heap_set(heap, index, timeout);
+}
+
+static void heap_sift_down(GPtrArray *heap, guint index)
+{
+	fpi_timeout *timeout = g_ptr_array_index(heap, index);
+	guint len = heap->len;
+
+	while (2 * index + 1 < len) {
+		guint child = 2 * index + 1;
+		fpi_timeout *c = g_ptr_array_index(heap, child);
+
+		if (child + 1 < len &&
+		    timeout_before(g_ptr_array_index(heap, child + 1), c)) {
+			child++;
+			c = g_ptr_array_index(heap, child);
+		}
+		if (!timeout_before(c, timeout))
+			break;
+		heap_set(heap, index, c);
+		index = child;
+	}
+	heap_set(heap, index, timeout);
+}
+
+static void heap_insert(fpi_timeout *timeout)
+{
+	struct fp_event_ctx *ctx = timeout->ctx;
+
+	g_ptr_array_add(ctx->timers, timeout);
+	heap_sift_up(ctx->timers, ctx->timers->len - 1);
+
+	if (timeout->heap_index == 0 && !ctx->handling_events)
+		timer_fd_update(ctx);
+}
+
+/* unlinks a pending timer from the heap and from its device */
+static void timeout_unlink(fpi_timeout *timeout)
+{
+	struct fp_event_ctx *ctx = timeout->ctx;
+	GPtrArray *heap = ctx->timers;
+	guint index = timeout->heap_index;
+	fpi_timeout *last;
+
+	last = g_ptr_array_remove_index_fast(heap, heap->len - 1);
+	if (last != timeout) {
+		heap_set(heap, index, last);
+		if (index > 0 && timeout_before(last,
+		    g_ptr_array_index(heap, (index - 1) / 2)))
+			heap_sift_up(heap, index);
+		else
+			heap_sift_down(heap, index);
+	}
+
+	timeout->dev->timeouts = g_list_delete_link(timeout->dev->timeouts,
+		timeout->dev_link);
+	timeout->dev_link = NULL;
+
+	if (index == 0 && !ctx->handling_events)
+		timer_fd_update(ctx);
+}
+
+static int get_monotonic_time(struct timeval *tv)
+{
+	struct timespec ts;
+	int r;
+
+	r = clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (r < 0) {
+		fp_err("failed to read monotonic clock, errno=%d", errno);
+		return r;
+	}
+	TIMESPEC_TO_TIMEVAL(tv, &ts);
+	return 0;
 }
 
 static void
@@ -161,37 +304,39 @@ fpi_timeout *fpi_timeout_add(unsigned int    msec,
 			     struct fp_dev  *dev,
 			     void           *data)
 {
-	struct timespec ts;
+	struct timeval now;
 	struct timeval add_msec;
 	fpi_timeout *timeout;
 	int r;
 
 	g_return_val_if_fail (dev != NULL, NULL);
-	g_return_val_if_fail (fpi_poll_is_setup(), NULL);
+	g_return_val_if_fail (dev->ctx != NULL || fpi_poll_is_setup(), NULL);
 
 	fp_dbg("in %dms", msec);
 
-	r = clock_gettime(CLOCK_MONOTONIC, &ts);
+	r = get_monotonic_time(&now);
 	if (r < 0) {
-		fp_err("failed to read monotonic clock, errno=%d", errno);
 		BUG();
 		return NULL;
 	}
 
 	timeout = g_new0(fpi_timeout, 1);
+	timeout->ctx = dev->ctx ? dev->ctx : &default_ctx;
 	timeout->callback = callback;
 	timeout->dev = dev;
 	timeout->data = data;
-	TIMESPEC_TO_TIMEVAL(&timeout->expiry, &ts);
+	timeout->expiry = now;
 
 	/* calculate timeout expiry by adding delay to current monotonic clock */
 	timerclear(&add_msec);
 	add_msec.tv_sec = msec / 1000;
 	add_msec.tv_usec = (msec % 1000) * 1000;
 	timeradd(&timeout->expiry, &add_msec, &timeout->expiry);
+	timeout->serial = timeout->ctx->timer_serial++;
 
-	active_timers = g_slist_insert_sorted(active_timers, timeout,
-		timeout_sort_fn);
+	heap_insert(timeout);
+	dev->timeouts = g_list_prepend(dev->timeouts, timeout);
+	timeout->dev_link = dev->timeouts;
 
 	return timeout;
 }
@@ -206,65 +351,39 @@ fpi_timeout *fpi_timeout_add(unsigned int    msec,
 void fpi_timeout_cancel(fpi_timeout *timeout)
 {
 	G_DEBUG_HERE();
-	active_timers = g_slist_remove(active_timers, timeout);
-	fpi_timeout_free(timeout);
-}
-
-void
-fpi_timeout_cancel_for_dev(struct fp_dev *dev)
-{
-	GSList *l;
-
-	g_return_if_fail (dev != NULL);
-
-	l = active_timers;
-	while (l) {
-		struct fpi_timeout *timeout = l->data;
-		GSList *current = l;
+	if (timeout == NULL)
+		return;
 
-		l = l->next;
-		if (timeout->dev == dev) {
-			fpi_timeout_free (timeout);
-			active_timers = g_slist_delete_link (active_timers, current);
-		}
-	}
+	timeout_unlink(timeout);
+	fpi_timeout_free(timeout);
 }
 
-/* get the expiry time and optionally the timeout structure for the next
- * timeout. returns 0 if there are no expired timers, or 1 if the
- * timeval/timeout output parameters were populated. if the returned timeval
- * is zero then it means the timeout has already expired and should be handled
- * ASAP. */
-static int get_next_timeout_expiry(struct timeval *out,
+/* get the expiry time relative to @now and optionally the timeout structure
+ * for the next timeout. returns 0 if there are no pending timers, or 1 if
+ * the timeval/timeout output parameters were populated. if the returned
+ * timeval is zero then it means the timeout has already expired and should
+ * be handled ASAP. */
+static int get_next_timeout_expiry(struct fp_event_ctx *ctx,
+	const struct timeval *now, struct timeval *out,
 	struct fpi_timeout **out_timeout)
 {
-	struct timespec ts;
-	struct timeval tv;
 	struct fpi_timeout *next_timeout;
-	int r;
 
-	if (active_timers == NULL)
+	if (ctx->timers == NULL || ctx->timers->len == 0)
 		return 0;
 
-	r = clock_gettime(CLOCK_MONOTONIC, &ts);
-	if (r < 0) {
-		fp_err("failed to read monotonic clock, errno=%d", errno);
-		return r;
-	}
-	TIMESPEC_TO_TIMEVAL(&tv, &ts);
-
-	next_timeout = active_timers->data;
+	next_timeout = g_ptr_array_index(ctx->timers, 0);
 	if (out_timeout)
 		*out_timeout = next_timeout;
 
-	if (timercmp(&tv, &next_timeout->expiry, >=)) {
+	if (timercmp(now, &next_timeout->expiry, >=)) {
 		if (next_timeout->name)
 			fp_dbg("first timeout '%s' already expired", next_timeout->name);
 		else
 			fp_dbg("first timeout already expired");
 		timerclear(out);
 	} else {
-		timersub(&next_timeout->expiry, &tv, out);
+		timersub(&next_timeout->expiry, now, out);
 		if (next_timeout->name)
 			fp_dbg("next timeout '%s' in %ld.%06lds", next_timeout->name,
 			       out->tv_sec, out->tv_usec);
@@ -275,75 +394,195 @@ static int get_next_timeout_expiry(struct timeval *out,
 	return 1;
 }
 
+static void record_lateness(struct fpi_timeout *timeout,
+	const struct timeval *now)
+{
+	struct timeval late;
+	guint64 usec;
+	int bin = 0;
+
+	timersub(now, &timeout->expiry, &late);
+	usec = (guint64) late.tv_sec * G_USEC_PER_SEC + late.tv_usec;
+	while (bin < FP_TIMEOUT_LATENESS_BINS - 1 && usec >= (1000ULL << bin))
+		bin++;
+
+	G_LOCK(timeout_stats);
+	timeout_stats.dispatched++;
+	timeout_stats.lateness[bin]++;
+	timeout_stats.max_lateness_usec =
+		MAX(timeout_stats.max_lateness_usec, usec);
+	G_UNLOCK(timeout_stats);
+}
+
 /* handle a timeout that has expired */
-static void handle_timeout(struct fpi_timeout *timeout)
+static void handle_timeout(struct fpi_timeout *timeout,
+	const struct timeval *now)
 {
 	G_DEBUG_HERE();
+	record_lateness(timeout, now);
+	/* unlinked first, so that the callback can cancel all the timeouts of
+	 * the device, or add new ones */
+	timeout_unlink(timeout);
 	timeout->callback(timeout->dev, timeout->data);
-	active_timers = g_slist_remove(active_timers, timeout);
 	fpi_timeout_free(timeout);
 }
 
-static int handle_timeouts(void)
+/* handles all the timeouts that had expired at @now, and returns how many
+ * were handled. The heap is looked at again after every callback, so
+ * callbacks can add and cancel timeouts, or even handle events themselves.
+ * Timeouts added by the callbacks are left to the next iteration, so that
+ * this always terminates. */
+static int handle_timeouts(struct fp_event_ctx *ctx,
+	const struct timeval *now)
 {
-	struct timeval next_timeout_expiry;
-	struct fpi_timeout *next_timeout;
-	int r;
+	guint64 serial_limit = ctx->timer_serial;
+	int handled = 0;
 
-	r = get_next_timeout_expiry(&next_timeout_expiry, &next_timeout);
-	if (r <= 0)
-		return r;
+	while (ctx->timers != NULL && ctx->timers->len > 0) {
+		struct fpi_timeout *timeout =
+			g_ptr_array_index(ctx->timers, 0);
 
-	if (!timerisset(&next_timeout_expiry))
-		handle_timeout(next_timeout);
+		if (timercmp(&timeout->expiry, now, >) ||
+		    timeout->serial >= serial_limit)
+			break;
 
-	return 0;
+		handle_timeout(timeout, now);
+		handled++;
+	}
+
+	return handled;
+}
+
+/* runs the calls posted to @ctx, and returns how many there were */
+static int handle_posted_calls(struct fp_event_ctx *ctx)
+{
+	GSList *calls;
+	GSList *elem;
+	int handled = 0;
+
+	g_mutex_lock(&ctx->posted_lock);
+	calls = g_slist_reverse(ctx->posted);
+	ctx->posted = NULL;
+	g_mutex_unlock(&ctx->posted_lock);
+
+	for (elem = calls; elem; elem = g_slist_next(elem)) {
+		struct posted_call *call = elem->data;
+
+		call->callback(call->dev, call->data);
+		handled++;
+	}
+	g_slist_free_full(calls, g_free);
+
+	return handled;
 }
 
 /**
- * fp_handle_events_timeout:
- * @timeout: Maximum timeout for this blocking function
+ * fpi_dev_post:
+ * @dev: a struct #fp_dev
+ * @callback: function to callback
+ * @data: data to pass to @callback, or %NULL
  *
- * Handle any pending events. If a non-zero timeout is specified, the function
- * will potentially block for the specified amount of time, although it may
- * return sooner if events have been handled. The function acts as non-blocking
- * for a zero timeout.
+ * Queues a call to @callback from the thread handling the events of @dev,
+ * as soon as it handles events. Unlike the other functions operating on a
+ * device, this can be called from any thread, which lets work done on
+ * other threads report back to the device.
  *
- * Returns: 0 on success, non-zero on error.
+ * The call can't be cancelled. The caller must make sure that @callback
+ * doesn't use @dev if it was closed in the meantime.
  */
-API_EXPORTED int fp_handle_events_timeout(struct timeval *timeout)
+void fpi_dev_post(struct fp_dev *dev, fpi_timeout_fn callback, void *data)
 {
+	struct fp_event_ctx *ctx = dev->ctx ? dev->ctx : &default_ctx;
+	struct posted_call *call;
+
+	call = g_new(struct posted_call, 1);
+	call->callback = callback;
+	call->dev = dev;
+	call->data = data;
+
+	g_mutex_lock(&ctx->posted_lock);
+	ctx->posted = g_slist_prepend(ctx->posted, call);
+	g_mutex_unlock(&ctx->posted_lock);
+
+#ifdef HAVE_LIBUSB_INTERRUPT
+	/* wakes up the thread if it's waiting for USB events, or any poll()
+	 * of the USB file descriptors */
+	libusb_interrupt_event_handler(ctx->usb_ctx);
+#endif
+}
+
+static int handle_events_timeout(struct fp_event_ctx *ctx,
+	struct timeval *timeout)
+{
+	struct timeval now;
 	struct timeval next_timeout_expiry;
 	struct timeval select_timeout;
-	struct fpi_timeout *next_timeout;
 	int r;
 
-	r = get_next_timeout_expiry(&next_timeout_expiry, &next_timeout);
+	r = get_monotonic_time(&now);
 	if (r < 0)
 		return r;
 
-	if (r) {
-		/* timer already expired? */
-		if (!timerisset(&next_timeout_expiry)) {
-			handle_timeout(next_timeout);
-			return 0;
-		}
+	/* don't block if timeouts or posted calls were handled, the caller
+	 * might want to look at what they did */
+	if (handle_timeouts(ctx, &now) + handle_posted_calls(ctx) > 0) {
+		timerclear(&select_timeout);
+	} else {
+		r = get_next_timeout_expiry(ctx, &now, &next_timeout_expiry,
+			NULL);
 
 		/* choose the smallest of next URB timeout or user specified timeout */
-		if (timercmp(&next_timeout_expiry, timeout, <))
+		if (r && timercmp(&next_timeout_expiry, timeout, <))
 			select_timeout = next_timeout_expiry;
 		else
 			select_timeout = *timeout;
-	} else {
-		select_timeout = *timeout;
 	}
 
-	r = libusb_handle_events_timeout(fpi_usb_ctx, &select_timeout);
+	r = libusb_handle_events_timeout(ctx->usb_ctx, &select_timeout);
 	*timeout = select_timeout;
+	/* fpi_dev_post() interrupts libusb */
+	if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+		return r;
+
+	handle_posted_calls(ctx);
+	if (ctx->timers == NULL || ctx->timers->len == 0)
+		return 0;
+
+	r = get_monotonic_time(&now);
 	if (r < 0)
 		return r;
+	handle_timeouts(ctx, &now);
 
-	return handle_timeouts();
+	return 0;
+}
+
+static int ctx_handle_events_timeout(struct fp_event_ctx *ctx,
+	struct timeval *timeout)
+{
+	int r;
+
+	ctx->handling_events++;
+	r = handle_events_timeout(ctx, timeout);
+	if (--ctx->handling_events == 0)
+		timer_fd_update(ctx);
+
+	return r;
+}
+
+/**
+ * fp_handle_events_timeout:
+ * @timeout: Maximum timeout for this blocking function
+ *
+ * Handle any pending events. If a non-zero timeout is specified, the function
+ * will potentially block for the specified amount of time, although it may
+ * return sooner if events have been handled. The function acts as non-blocking
+ * for a zero timeout.
+ *
+ * Returns: 0 on success, non-zero on error.
+ */
+API_EXPORTED int fp_handle_events_timeout(struct timeval *timeout)
+{
+	return ctx_handle_events_timeout(&default_ctx, timeout);
 }
 
 /**
@@ -364,21 +603,145 @@ API_EXPORTED int fp_handle_events(void)
 }
 
 /**
- * fp_get_next_timeout:
- * @tv: a #timeval structure containing the duration to the next timeout.
+ * fp_event_ctx_new:
  *
- * A zero filled @tv timeout means events are to be handled immediately
+ * Creates a new event context. Devices opened in it with
+ * fp_async_dev_open_in_ctx() or fp_dev_open_in_ctx() have their USB
+ * transfers and timeouts handled by fp_event_ctx_handle_events_timeout()
+ * instead of fp_handle_events(), which lets several devices be driven
+ * from different threads, without a slow operation on one of them
+ * delaying the others.
  *
- * Returns: returns 0 if no timeouts active, or 1 if timeout returned.
+ * An event context, and the devices opened in it, must only be used from
+ * one thread at a time, usually a thread dedicated to them. Functions
+ * which aren't about a specific device, like device discovery, or the
+ * handling of stored prints, can be called from any thread.
+ *
+ * This must be called after fp_init().
+ *
+ * Returns: a new #fp_event_ctx to free with fp_event_ctx_free(), or %NULL
+ * on error
  */
-API_EXPORTED int fp_get_next_timeout(struct timeval *tv)
+API_EXPORTED struct fp_event_ctx *fp_event_ctx_new(void)
+{
+	struct fp_event_ctx *ctx;
+	int r;
+
+	g_return_val_if_fail (default_ctx.timers != NULL, NULL);
+
+	ctx = g_malloc0(sizeof(*ctx));
+	r = libusb_init(&ctx->usb_ctx);
+	if (r < 0) {
+		fp_err("failed to create USB context, error %d", r);
+		g_free(ctx);
+		return NULL;
+	}
+	ctx->timers = g_ptr_array_new();
+	g_mutex_init(&ctx->posted_lock);
+
+	return ctx;
+}
+
+/**
+ * fp_event_ctx_free:
+ * @ctx: a #fp_event_ctx, or %NULL
+ *
+ * Frees an event context created with fp_event_ctx_new(). The devices
+ * opened in @ctx must be closed first.
+ */
+API_EXPORTED void fp_event_ctx_free(struct fp_event_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	handle_posted_calls(ctx);
+	if (ctx->timers->len > 0) {
+		fp_err("%u timeouts still pending, devices weren't closed",
+		       ctx->timers->len);
+		while (ctx->timers->len > 0)
+			fpi_timeout_cancel(g_ptr_array_index(ctx->timers, 0));
+	}
+
+	g_ptr_array_free(ctx->timers, TRUE);
+	g_mutex_clear(&ctx->posted_lock);
+	libusb_exit(ctx->usb_ctx);
+	g_free(ctx);
+}
+
+/**
+ * fp_event_ctx_handle_events_timeout:
+ * @ctx: a #fp_event_ctx
+ * @timeout: Maximum timeout for this blocking function
+ *
+ * Like fp_handle_events_timeout(), but handles the events of the devices
+ * opened in @ctx. Events of other devices aren't handled.
+ *
+ * Returns: 0 on success, non-zero on error.
+ */
+API_EXPORTED int fp_event_ctx_handle_events_timeout(struct fp_event_ctx *ctx,
+	struct timeval *timeout)
+{
+	g_return_val_if_fail (ctx != NULL, -EINVAL);
+
+	return ctx_handle_events_timeout(ctx, timeout);
+}
+
+/* handles the events of @ctx, or of the default context if %NULL, with the
+ * timeout of fp_handle_events(). This is what the synchronous API uses. */
+int fpi_event_ctx_handle_events(struct fp_event_ctx *ctx)
+{
+	struct timeval tv;
+
+	if (!ctx)
+		return fp_handle_events();
+
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	return ctx_handle_events_timeout(ctx, &tv);
+}
+
+/**
+ * fpi_dev_handle_events:
+ * @dev: a struct #fp_dev
+ *
+ * Handles pending events like fp_handle_events() does, but in the event
+ * context @dev was opened in. Drivers should only need this when they
+ * have to wait for a transfer to complete from a function that can't
+ * return before it does.
+ *
+ * Returns: 0 on success, non-zero on error.
+ */
+int fpi_dev_handle_events(struct fp_dev *dev)
+{
+	g_return_val_if_fail (dev != NULL, -EINVAL);
+
+	return fpi_event_ctx_handle_events(dev->ctx);
+}
+
+/* the USB context to open the devices of @ctx in */
+libusb_context *fpi_event_ctx_get_usb_ctx(struct fp_event_ctx *ctx)
+{
+	return ctx ? ctx->usb_ctx : fpi_usb_ctx;
+}
+
+/* get the duration to the next libusb timeout, or fprint timeout if
+ * @fprint_timeouts is set. returns 0 if there are none, or 1 if @tv was
+ * populated */
+static int get_next_timeout(struct timeval *tv, gboolean fprint_timeouts)
 {
 	struct timeval fprint_timeout = { 0, 0 };
 	struct timeval libusb_timeout = { 0, 0 };
+	struct timeval now;
 	int r_fprint;
 	int r_libusb;
 
-	r_fprint = get_next_timeout_expiry(&fprint_timeout, NULL);
+	r_fprint = 0;
+	if (fprint_timeouts) {
+		r_fprint = get_monotonic_time(&now);
+		if (r_fprint == 0)
+			r_fprint = get_next_timeout_expiry(&default_ctx, &now,
+				&fprint_timeout, NULL);
+	}
 	r_libusb = libusb_get_next_timeout(fpi_usb_ctx, &libusb_timeout);
 
 	/* if we have no pending timeouts and the same is true for libusb,
@@ -402,6 +765,36 @@ API_EXPORTED int fp_get_next_timeout(struct timeval *tv)
 	return 1;
 }
 
+/**
+ * fp_get_next_timeout:
+ * @tv: a #timeval structure containing the duration to the next timeout.
+ *
+ * A zero filled @tv timeout means events are to be handled immediately
+ *
+ * Returns: returns 0 if no timeouts active, or 1 if timeout returned.
+ */
+API_EXPORTED int fp_get_next_timeout(struct timeval *tv)
+{
+	/* the timer fd takes care of our timeouts */
+	return get_next_timeout(tv, timer_fd < 0);
+}
+
+/**
+ * fp_get_timeout_stats:
+ * @stats: the #fp_timeout_stats to fill in
+ *
+ * Gets statistics about the internal timeouts that libfprint has handled
+ * since fp_init() was called. Timeouts handled late usually mean that
+ * events aren't handled often enough, which shows as jitter when drivers
+ * poll their devices.
+ */
+API_EXPORTED void fp_get_timeout_stats(struct fp_timeout_stats *stats)
+{
+	G_LOCK(timeout_stats);
+	*stats = timeout_stats;
+	G_UNLOCK(timeout_stats);
+}
+
 /**
  * fp_get_pollfds:
  * @pollfds: output location for a list of pollfds. If non-%NULL, must be
@@ -434,7 +827,7 @@ API_EXPORTED ssize_t fp_get_pollfds(struct fp_pollfd **pollfds)
 	while ((usbfd = usbfds[i++]) != NULL)
 		cnt++;
 
-	ret = g_malloc(sizeof(struct fp_pollfd) * cnt);
+	ret = g_malloc(sizeof(struct fp_pollfd) * (cnt + 1));
 	i = 0;
 	while ((usbfd = usbfds[i]) != NULL) {
 		ret[i].fd = usbfd->fd;
@@ -442,6 +835,12 @@ API_EXPORTED ssize_t fp_get_pollfds(struct fp_pollfd **pollfds)
 		i++;
 	}
 
+	if (timer_fd >= 0) {
+		ret[cnt].fd = timer_fd;
+		ret[cnt].events = POLLIN;
+		cnt++;
+	}
+
 	*pollfds = ret;
 	return cnt;
 }
@@ -461,27 +860,290 @@ API_EXPORTED void fp_set_pollfd_notifiers(fp_pollfd_added_cb added_cb,
 	fd_removed_cb = removed_cb;
 }
 
+/* Arms the timer fd with the expiry of the first pending timeout, which
+ * also clears its expiration count. */
+static void timer_fd_update(struct fp_event_ctx *ctx)
+{
+#ifdef HAVE_TIMERFD
+	struct itimerspec its;
+
+	if (timer_fd < 0 || ctx != &default_ctx)
+		return;
+
+	/* a zero expiry disarms the timer */
+	memset(&its, 0, sizeof(its));
+	if (ctx->timers->len > 0) {
+		fpi_timeout *timeout = g_ptr_array_index(ctx->timers, 0);
+
+		TIMEVAL_TO_TIMESPEC(&timeout->expiry, &its.it_value);
+	}
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		fp_err("failed to arm timer fd, errno=%d", errno);
+#endif
+}
+
+/**
+ * fp_enable_timer_fd:
+ *
+ * Makes libfprint signal its internal timeouts through a file descriptor,
+ * which is returned by fp_get_pollfds(), and passed to the callback set
+ * with fp_set_pollfd_notifiers(), along with the USB file descriptors. The
+ * file descriptor becomes readable when events need to be handled because
+ * a timeout expired.
+ *
+ * fp_get_next_timeout() then only returns the timeouts of libusb. If
+ * libusb_pollfds_handle_timeouts() returns true as well, applications
+ * which poll the file descriptors themselves don't need to keep track of
+ * any timeout.
+ *
+ * This must be called after fp_init(), and is only supported on Linux.
+ *
+ * Returns: 0 on success, -ENOTSUP if the platform doesn't support it, or
+ * another negative error code on failure.
+ */
+API_EXPORTED int fp_enable_timer_fd(void)
+{
+#ifdef HAVE_TIMERFD
+	g_return_val_if_fail (default_ctx.timers != NULL, -EINVAL);
+
+	if (timer_fd >= 0)
+		return 0;
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		fp_err("failed to create timer fd, errno=%d", errno);
+		return -errno;
+	}
+
+	timer_fd_update(&default_ctx);
+	if (fd_added_cb)
+		fd_added_cb(timer_fd, POLLIN);
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static void event_source_add_fd(struct fpi_event_source *source, int fd,
+	short events)
+{
+	GPollFD *pollfd;
+
+	pollfd = g_new0(GPollFD, 1);
+	pollfd->fd = fd;
+	if (events & POLLIN)
+		pollfd->events |= G_IO_IN;
+	if (events & POLLOUT)
+		pollfd->events |= G_IO_OUT;
+
+	source->pollfds = g_slist_prepend(source->pollfds, pollfd);
+	g_source_add_poll(&source->source, pollfd);
+}
+
+static void event_source_remove_fd(struct fpi_event_source *source, int fd)
+{
+	GSList *elem;
+
+	for (elem = source->pollfds; elem; elem = g_slist_next(elem)) {
+		GPollFD *pollfd = elem->data;
+
+		if (pollfd->fd != fd)
+			continue;
+
+		g_source_remove_poll(&source->source, pollfd);
+		g_free(pollfd);
+		source->pollfds = g_slist_delete_link(source->pollfds, elem);
+		return;
+	}
+}
+
+static void event_source_add_usb_fds(struct fpi_event_source *source)
+{
+	const struct libusb_pollfd **usbfds;
+	size_t i;
+
+	usbfds = libusb_get_pollfds(fpi_usb_ctx);
+	if (!usbfds) {
+		fp_err("failed to get USB file descriptors");
+		return;
+	}
+
+	for (i = 0; usbfds[i] != NULL; i++)
+		event_source_add_fd(source, usbfds[i]->fd, usbfds[i]->events);
+	free(usbfds);
+}
+
+static void event_source_remove_all_fds(struct fpi_event_source *source)
+{
+	while (source->pollfds)
+		event_source_remove_fd(source,
+			((GPollFD *) source->pollfds->data)->fd);
+}
+
+static gboolean event_source_prepare(GSource *source, gint *timeout)
+{
+	struct timeval tv;
+
+	*timeout = -1;
+	if (default_ctx.timers == NULL || !get_next_timeout(&tv, TRUE))
+		return FALSE;
+
+	if (!timerisset(&tv)) {
+		*timeout = 0;
+		return TRUE;
+	}
+
+	/* rounded up, so that we don't wake up just before the expiry */
+	*timeout = MIN((gint64) tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000,
+		G_MAXINT);
+	return FALSE;
+}
+
+static gboolean event_source_check(GSource *source)
+{
+	struct fpi_event_source *event_source =
+		(struct fpi_event_source *) source;
+	struct timeval tv;
+	GSList *elem;
+
+	for (elem = event_source->pollfds; elem; elem = g_slist_next(elem)) {
+		GPollFD *pollfd = elem->data;
+
+		if (pollfd->revents)
+			return TRUE;
+	}
+
+	return default_ctx.timers != NULL && get_next_timeout(&tv, TRUE) &&
+		!timerisset(&tv);
+}
+
+static gboolean event_source_dispatch(GSource *source, GSourceFunc callback,
+	gpointer user_data)
+{
+	struct timeval zero_timeout = { 0, 0 };
+	int r;
+
+	/* fp_exit() was called */
+	if (default_ctx.timers == NULL)
+		return G_SOURCE_CONTINUE;
+
+	r = fp_handle_events_timeout(&zero_timeout);
+	if (r < 0)
+		fp_err("failed to handle events, error %d", r);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void event_source_finalize(GSource *source)
+{
+	struct fpi_event_source *event_source =
+		(struct fpi_event_source *) source;
+
+	g_slist_free_full(event_source->pollfds, g_free);
+	event_source->pollfds = NULL;
+	event_sources = g_slist_remove(event_sources, event_source);
+}
+
+static GSourceFuncs event_source_funcs = {
+	.prepare = event_source_prepare,
+	.check = event_source_check,
+	.dispatch = event_source_dispatch,
+	.finalize = event_source_finalize,
+};
+
+/**
+ * fp_event_source_new:
+ *
+ * Creates a #GSource that handles libfprint events as part of a GLib main
+ * loop. It polls the USB file descriptors, and its timeout is that of the
+ * next libusb or libfprint timeout, so the main loop only wakes up when
+ * events are due, and there is no need to call fp_handle_events()
+ * periodically.
+ *
+ * Attach it with g_source_attach() to the #GMainContext iterated by the
+ * thread that uses libfprint. The file descriptors are kept up to date
+ * without calling fp_set_pollfd_notifiers().
+ *
+ * This must be called after fp_init(). The source stops handling events
+ * once fp_exit() is called.
+ *
+ * Returns: (transfer full): a new #GSource, to release with
+ * g_source_unref(), or %NULL on error
+ */
+API_EXPORTED struct _GSource *fp_event_source_new(void)
+{
+	struct fpi_event_source *source;
+
+	g_return_val_if_fail (default_ctx.timers != NULL, NULL);
+
+	source = (struct fpi_event_source *) g_source_new(&event_source_funcs,
+		sizeof(*source));
+	g_source_set_name(&source->source, "libfprint events");
+	source->pollfds = NULL;
+	event_source_add_usb_fds(source);
+	event_sources = g_slist_prepend(event_sources, source);
+
+	return &source->source;
+}
+
 static void add_pollfd(int fd, short events, void *user_data)
 {
+	GSList *elem;
+
+	for (elem = event_sources; elem; elem = g_slist_next(elem))
+		event_source_add_fd(elem->data, fd, events);
+
 	if (fd_added_cb)
 		fd_added_cb(fd, events);
 }
 
 static void remove_pollfd(int fd, void *user_data)
 {
+	GSList *elem;
+
+	for (elem = event_sources; elem; elem = g_slist_next(elem))
+		event_source_remove_fd(elem->data, fd);
+
 	if (fd_removed_cb)
 		fd_removed_cb(fd);
 }
 
 void fpi_poll_init(void)
 {
+	GSList *elem;
+
+	default_ctx.usb_ctx = fpi_usb_ctx;
+	default_ctx.timers = g_ptr_array_new();
 	libusb_set_pollfd_notifiers(fpi_usb_ctx, add_pollfd, remove_pollfd, NULL);
+
+	/* sources that outlived a previous fp_exit() */
+	for (elem = event_sources; elem; elem = g_slist_next(elem))
+		event_source_add_usb_fds(elem->data);
 }
 
 void fpi_poll_exit(void)
 {
-	g_slist_free_full(active_timers, (GDestroyNotify) fpi_timeout_free);
-	active_timers = NULL;
+	GSList *elem;
+
+	handle_posted_calls(&default_ctx);
+	if (default_ctx.timers) {
+		while (default_ctx.timers->len > 0)
+			fpi_timeout_cancel(g_ptr_array_index(default_ctx.timers, 0));
+		g_ptr_array_free(default_ctx.timers, TRUE);
+		default_ctx.timers = NULL;
+	}
+	G_LOCK(timeout_stats);
+	memset(&timeout_stats, 0, sizeof(timeout_stats));
+	G_UNLOCK(timeout_stats);
+	if (timer_fd >= 0) {
+		if (fd_removed_cb)
+			fd_removed_cb(timer_fd);
+		close(timer_fd);
+		timer_fd = -1;
+	}
+	for (elem = event_sources; elem; elem = g_slist_next(elem))
+		event_source_remove_all_fds(elem->data);
 	fd_added_cb = NULL;
 	fd_removed_cb = NULL;
 	libusb_set_pollfd_notifiers(fpi_usb_ctx, NULL, NULL, NULL);
@@ -490,25 +1152,15 @@ void fpi_poll_exit(void)
 static gboolean
 fpi_poll_is_setup(void)
 {
-	return (fd_added_cb != NULL && fd_removed_cb != NULL);
+	return (fd_added_cb != NULL && fd_removed_cb != NULL) ||
+		event_sources != NULL;
 }
 
 void
 fpi_timeout_cancel_all_for_dev(struct fp_dev *dev)
 {
-	GSList *l;
-
 	g_return_if_fail (dev != NULL);
 
-	l = active_timers;
-	while (l) {
-		struct fpi_timeout *timeout = l->data;
-		GSList *current = l;
-
-		l = l->next;
-		if (timeout->dev == dev) {
-			g_free (timeout);
-			active_timers = g_slist_delete_link (active_timers, current);
-		}
-	}
+	while (dev->timeouts)
+		fpi_timeout_cancel(dev->timeouts->data);
 }
@@ -47,5 +47,6 @@ fpi_timeout *fpi_timeout_add(unsigned int    msec,
 void fpi_timeout_set_name(fpi_timeout *timeout,
 			  const char  *name);
 void fpi_timeout_cancel(fpi_timeout *timeout);
+int fpi_dev_handle_events(struct fp_dev *dev);
 
 #endif
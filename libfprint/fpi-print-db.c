@@ -0,0 +1,1380 @@
+/*
+ * Single-file print database
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define FP_COMPONENT "print-db"
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "fp_internal.h"
+
+/*
+ * The database is a single file, laid out as follows, with all the integers
+ * stored little-endian:
+ *
+ *   header slots | record | record | index | record | index | ...
+ *
+ * Records hold prints serialized with fp_print_data_get_data(), and are only
+ * ever appended. Every change appends its records, then a complete sorted
+ * index of the live records, and finally points one of the two header slots
+ * at that index, with a higher generation than the other slot. A crash at
+ * any point leaves at least one valid header referring to a complete index,
+ * and whatever was written past it is overwritten by the next change.
+ *
+ * Superseded records and indexes are accounted as dead bytes, and the file
+ * is rewritten once they make up most of it. The magic of both header slots
+ * of the old file is then overwritten, so that processes still reading it
+ * notice without having to stat the path.
+ */
+
+#define DB_MAGIC		"FPDB"
+#define DB_REPLACED_MAGIC	"FPDR"
+#define DB_RECORD_MAGIC		"FPRC"
+#define DB_VERSION		1
+#define DB_HEADER_SLOT_SIZE	64
+#define DB_DATA_OFFSET		(2 * DB_HEADER_SLOT_SIZE)
+#define DB_ALIGN		8
+#define DB_COMPACT_MIN_DEAD	(1024 * 1024)
+/* Staged records are written out past the committed data in chunks of
+ * this size, so that large batches don't need to be held in memory */
+#define DB_TXN_FLUSH_SIZE	(1024 * 1024)
+
+struct fpi_print_db_header {
+	char magic[4];
+	uint32_t version;
+	uint64_t generation;
+	uint64_t index_offset;
+	uint64_t end_offset;
+	uint64_t dead_bytes;
+	uint32_t index_count;
+	uint32_t index_checksum;
+	/* CRC-32 of all the fields above */
+	uint32_t checksum;
+} __attribute__((__packed__));
+
+/* Records are DB_ALIGN aligned, and their header keeps the serialized print
+ * aligned to FP_PRINT_DATA_VIEW_ALIGN, so that views can use it in place */
+struct fpi_print_db_record {
+	char magic[4];
+	uint32_t length;
+	/* CRC-32 of the serialized print */
+	uint32_t checksum;
+	unsigned char data[0];
+} __attribute__((__packed__));
+
+/* The index is sorted by user, driver ID, devtype and finger. Its entries
+ * are a multiple of DB_ALIGN in size, like the records. */
+struct fpi_print_db_entry {
+	/* NUL-padded, but not NUL-terminated if FP_PRINT_DB_USER_MAX long */
+	char user[FP_PRINT_DB_USER_MAX];
+	uint16_t driver_id;
+	uint32_t devtype;
+	uint8_t finger;
+	uint8_t reserved;
+	uint64_t record_offset;
+} __attribute__((__packed__));
+
+/* The header in use, in host byte order */
+struct db_state {
+	int slot;
+	guint64 generation;
+	guint64 index_offset;
+	guint64 end_offset;
+	guint64 dead_bytes;
+	guint32 index_count;
+};
+
+struct fp_print_db {
+	char *path;
+	int fd;
+	gboolean read_only;
+	const unsigned char *map;
+	size_t map_size;
+	/* Galleries loaded from the database refer to map */
+	gboolean map_borrowed;
+	/* Older mappings still referred to by galleries, kept until the
+	 * database is closed */
+	GSList *old_maps;
+	struct db_state state;
+	/* Points into map, valid until the next refresh */
+	const struct fpi_print_db_entry *index;
+	/* A transaction holds the lock */
+	gboolean in_txn;
+};
+
+/* Changes are staged in a transaction while holding the file lock, and only
+ * become visible to readers once committed. */
+struct db_txn {
+	/* Staged records not written out yet */
+	GByteArray *records;
+	/* Size of the staged records already written past the committed data */
+	guint64 flushed;
+	GArray *entries;
+	guint64 dead_bytes;
+};
+
+struct db_old_map {
+	const unsigned char *map;
+	size_t size;
+};
+
+struct fp_print_db_batch {
+	struct fp_print_db *db;
+	struct db_txn txn;
+	gboolean active;
+	/* The first write error, which fails the whole batch */
+	int error;
+	guint count;
+};
+
+/**
+ * SECTION: print_db
+ * @title: Print database
+ * @short_description: Single-file print storage for many users
+ *
+ * The print database stores the prints of any number of users in a single
+ * file, keyed by user name, device type and finger. It is an alternative to
+ * fp_print_data_save() and fp_print_data_load(), which only handle the
+ * prints of the current user, one file per finger.
+ *
+ * Lookups binary-search an index within the memory-mapped file, and loading
+ * a print doesn't involve any system call unless the database changed since
+ * the previous operation on it. Changes are appended to the file and then
+ * committed atomically, so that the database is left intact if the process
+ * or system crashes while saving a print.
+ *
+ * The database can be shared between processes. Changes made by other
+ * processes are picked up by the next operation on the database, which
+ * remaps the file if it grew.
+ */
+
+static guint32 crc_table[256];
+
+static gpointer crc_table_init(gpointer data)
+{
+	guint32 i, j;
+
+	for (i = 0; i < 256; i++) {
+		guint32 c = i;
+
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc_table[i] = c;
+	}
+	return NULL;
+}
+
+static guint32 db_crc32(const void *buf, size_t len)
+{
+	static GOnce once = G_ONCE_INIT;
+	const unsigned char *p = buf;
+	guint32 crc = 0xffffffff;
+
+	g_once(&once, crc_table_init, NULL);
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+static int db_pwrite(int fd, const void *buf, size_t len, guint64 offset)
+{
+	const unsigned char *p = buf;
+
+	while (len) {
+		ssize_t r = pwrite(fd, p, len, offset);
+
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += r;
+		len -= r;
+		offset += r;
+	}
+	return 0;
+}
+
+static int db_sync(int fd)
+{
+	while (fdatasync(fd) < 0) {
+		if (errno != EINTR)
+			return -errno;
+	}
+	return 0;
+}
+
+static int db_sync_dir(const char *path)
+{
+	char *dirpath = g_path_get_dirname(path);
+	int fd, r = 0;
+
+	fd = open(dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	g_free(dirpath);
+	if (fd < 0)
+		return -errno;
+	if (fsync(fd) < 0)
+		r = -errno;
+	close(fd);
+	return r;
+}
+
+static int db_lock(struct fp_print_db *db)
+{
+	while (flock(db->fd, LOCK_EX) < 0) {
+		if (errno != EINTR)
+			return -errno;
+	}
+	return 0;
+}
+
+static void db_unlock(struct fp_print_db *db)
+{
+	flock(db->fd, LOCK_UN);
+}
+
+static int db_make_key(struct fpi_print_db_entry *key, const char *user,
+	uint16_t driver_id, uint32_t devtype, enum fp_finger finger)
+{
+	size_t len;
+
+	if (!user)
+		user = g_get_user_name();
+	len = strlen(user);
+	if (len == 0 || len > FP_PRINT_DB_USER_MAX) {
+		fp_err("invalid user name '%s'", user);
+		return -EINVAL;
+	}
+	if (finger < LEFT_THUMB || finger > RIGHT_LITTLE) {
+		fp_err("invalid finger %d", finger);
+		return -EINVAL;
+	}
+
+	memset(key, 0, sizeof(*key));
+	memcpy(key->user, user, len);
+	key->driver_id = GUINT16_TO_LE(driver_id);
+	key->devtype = GUINT32_TO_LE(devtype);
+	key->finger = finger;
+	return 0;
+}
+
+static int db_entry_cmp(const void *a, const void *b)
+{
+	const struct fpi_print_db_entry *ea = a;
+	const struct fpi_print_db_entry *eb = b;
+	guint32 va, vb;
+	int r;
+
+	r = memcmp(ea->user, eb->user, sizeof(ea->user));
+	if (r)
+		return r;
+
+	va = GUINT16_FROM_LE(ea->driver_id);
+	vb = GUINT16_FROM_LE(eb->driver_id);
+	if (va != vb)
+		return va < vb ? -1 : 1;
+
+	va = GUINT32_FROM_LE(ea->devtype);
+	vb = GUINT32_FROM_LE(eb->devtype);
+	if (va != vb)
+		return va < vb ? -1 : 1;
+
+	return (int) ea->finger - (int) eb->finger;
+}
+
+static void db_unmap(struct fp_print_db *db)
+{
+	if (db->map && db->map_borrowed) {
+		struct db_old_map *old = g_new(struct db_old_map, 1);
+
+		old->map = db->map;
+		old->size = db->map_size;
+		db->old_maps = g_slist_prepend(db->old_maps, old);
+	} else if (db->map) {
+		munmap((void *) db->map, db->map_size);
+	}
+	db->map = NULL;
+	db->map_borrowed = FALSE;
+	db->map_size = 0;
+	db->index = NULL;
+}
+
+static int db_map(struct fp_print_db *db)
+{
+	struct stat st;
+	void *map;
+
+	db_unmap(db);
+	if (fstat(db->fd, &st) < 0)
+		return -errno;
+	if (st.st_size == 0)
+		return 0;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, db->fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+	db->map = map;
+	db->map_size = st.st_size;
+	return 0;
+}
+
+/* Returns 1 if the header is valid, 0 if not, or -EAGAIN if it refers to
+ * data past the end of the mapping */
+static int db_read_header(struct fp_print_db *db, int slot,
+	struct db_state *state)
+{
+	struct fpi_print_db_header header;
+	guint64 index_size;
+
+	memcpy(&header, db->map + slot * DB_HEADER_SLOT_SIZE, sizeof(header));
+	if (memcmp(header.magic, DB_MAGIC, sizeof(header.magic)) != 0)
+		return 0;
+	if (GUINT32_FROM_LE(header.checksum) !=
+	    db_crc32(&header, G_STRUCT_OFFSET(struct fpi_print_db_header, checksum)))
+		return 0;
+	if (GUINT32_FROM_LE(header.version) != DB_VERSION) {
+		fp_dbg("unsupported database version %u",
+		       GUINT32_FROM_LE(header.version));
+		return 0;
+	}
+
+	state->slot = slot;
+	state->generation = GUINT64_FROM_LE(header.generation);
+	state->index_offset = GUINT64_FROM_LE(header.index_offset);
+	state->end_offset = GUINT64_FROM_LE(header.end_offset);
+	state->dead_bytes = GUINT64_FROM_LE(header.dead_bytes);
+	state->index_count = GUINT32_FROM_LE(header.index_count);
+
+	/* The index must lie within the committed data */
+	index_size = (guint64) state->index_count *
+		sizeof(struct fpi_print_db_entry);
+	if (state->end_offset > db->map_size)
+		return -EAGAIN;
+	if (state->index_offset < DB_DATA_OFFSET ||
+	    state->index_offset > state->end_offset ||
+	    index_size > state->end_offset - state->index_offset)
+		return 0;
+
+	return GUINT32_FROM_LE(header.index_checksum) ==
+		db_crc32(db->map + state->index_offset, index_size);
+}
+
+/* Picks the newest valid header. The index is only verified once per
+ * header, and headers older than the one in use are skipped, so calling
+ * this before every lookup is cheap, and doesn't involve any system call.
+ *
+ * Returns -EAGAIN if the newest header refers to data past the end of the
+ * mapping and @may_grow is set, and -ESTALE if the file was replaced. */
+static int db_load_state(struct fp_print_db *db, gboolean may_grow)
+{
+	struct db_state states[2];
+	struct fpi_print_db_header header;
+	int slot, r, newest = -1;
+
+	if (db->map_size < DB_DATA_OFFSET) {
+		fp_err("%s is not a print database", db->path);
+		return -EIO;
+	}
+	if (memcmp(db->map, DB_REPLACED_MAGIC, 4) == 0 ||
+	    memcmp(db->map + DB_HEADER_SLOT_SIZE, DB_REPLACED_MAGIC, 4) == 0)
+		return -ESTALE;
+
+	for (slot = 0; slot < 2; slot++) {
+		memcpy(&header, db->map + slot * DB_HEADER_SLOT_SIZE,
+		       sizeof(header));
+
+		/* Unchanged since it was last verified. Generations start at
+		 * 1, so a zero one means that no header was verified yet. */
+		if (db->state.generation && slot == db->state.slot &&
+		    GUINT64_FROM_LE(header.generation) == db->state.generation &&
+		    GUINT32_FROM_LE(header.checksum) ==
+		    db_crc32(&header, G_STRUCT_OFFSET(struct fpi_print_db_header, checksum))) {
+			states[slot] = db->state;
+		} else if (GUINT64_FROM_LE(header.generation) <=
+			   db->state.generation) {
+			/* Superseded by the header in use */
+			continue;
+		} else {
+			r = db_read_header(db, slot, &states[slot]);
+			if (r == -EAGAIN && may_grow)
+				return r;
+			if (r <= 0)
+				continue;
+		}
+
+		if (newest < 0 ||
+		    states[slot].generation > states[newest].generation)
+			newest = slot;
+	}
+
+	if (newest < 0 && db->state.generation) {
+		/* The header in use was overwritten with an older one, which
+		 * only happens if the file was recreated in place */
+		memset(&db->state, 0, sizeof(db->state));
+		return db_load_state(db, may_grow);
+	}
+	if (newest < 0) {
+		fp_err("no valid header in %s", db->path);
+		return -EIO;
+	}
+
+	db->state = states[newest];
+	db->index = (const struct fpi_print_db_entry *)
+		(db->map + db->state.index_offset);
+	return 0;
+}
+
+static int db_reopen(struct fp_print_db *db);
+
+/* Picks up the latest committed changes, remapping the file if it grew, and
+ * reopening it if it was replaced. Nothing but the mapping is accessed when
+ * the database didn't change. */
+static int db_refresh(struct fp_print_db *db)
+{
+	size_t map_size;
+	int r;
+
+	if (!db->map) {
+		r = db_map(db);
+		if (r < 0)
+			return r;
+	}
+
+	r = db_load_state(db, TRUE);
+	while (r == -EAGAIN || r == -ESTALE) {
+		if (r == -ESTALE) {
+			r = db_reopen(db);
+			if (r < 0)
+				return r;
+		}
+		map_size = db->map_size;
+		r = db_map(db);
+		if (r < 0)
+			return r;
+		/* Headers referring past the end of a file which didn't grow
+		 * are corrupted, rather than newer */
+		r = db_load_state(db, db->map_size != map_size);
+	}
+	return r;
+}
+
+static int db_write_header(int fd, int slot, const struct db_state *state,
+	guint32 index_checksum)
+{
+	struct fpi_print_db_header header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, DB_MAGIC, sizeof(header.magic));
+	header.version = GUINT32_TO_LE(DB_VERSION);
+	header.generation = GUINT64_TO_LE(state->generation);
+	header.index_offset = GUINT64_TO_LE(state->index_offset);
+	header.end_offset = GUINT64_TO_LE(state->end_offset);
+	header.dead_bytes = GUINT64_TO_LE(state->dead_bytes);
+	header.index_count = GUINT32_TO_LE(state->index_count);
+	header.index_checksum = GUINT32_TO_LE(index_checksum);
+	header.checksum = GUINT32_TO_LE(db_crc32(&header,
+		G_STRUCT_OFFSET(struct fpi_print_db_header, checksum)));
+
+	return db_pwrite(fd, &header, sizeof(header),
+			 slot * DB_HEADER_SLOT_SIZE);
+}
+
+/* Writes an empty database to a new file */
+static int db_init_file(int fd)
+{
+	unsigned char empty[DB_DATA_OFFSET];
+	struct db_state state;
+	int r;
+
+	memset(empty, 0, sizeof(empty));
+	r = db_pwrite(fd, empty, sizeof(empty), 0);
+	if (r < 0)
+		return r;
+
+	memset(&state, 0, sizeof(state));
+	state.generation = 1;
+	state.index_offset = DB_DATA_OFFSET;
+	state.end_offset = DB_DATA_OFFSET;
+	r = db_write_header(fd, 0, &state, db_crc32(NULL, 0));
+	if (r < 0)
+		return r;
+	return db_sync(fd);
+}
+
+/* Returns the size taken by the record at @offset, or 0 if it is corrupted */
+static size_t db_get_record(struct fp_print_db *db, guint64 offset,
+	const unsigned char **data, size_t *length)
+{
+	const struct fpi_print_db_record *record;
+	size_t len;
+
+	if (offset < DB_DATA_OFFSET ||
+	    offset > db->state.end_offset - sizeof(*record))
+		return 0;
+
+	record = (const struct fpi_print_db_record *) (db->map + offset);
+	len = GUINT32_FROM_LE(record->length);
+	if (memcmp(record->magic, DB_RECORD_MAGIC, sizeof(record->magic)) != 0 ||
+	    len > db->state.end_offset - offset - sizeof(*record))
+		return 0;
+	if (GUINT32_FROM_LE(record->checksum) != db_crc32(record->data, len))
+		return 0;
+
+	if (data)
+		*data = record->data;
+	if (length)
+		*length = len;
+	return (sizeof(*record) + len + DB_ALIGN - 1) & ~(DB_ALIGN - 1);
+}
+
+static const struct fpi_print_db_entry *db_lookup(struct fp_print_db *db,
+	const struct fpi_print_db_entry *key)
+{
+	return bsearch(key, db->index, db->state.index_count,
+		       sizeof(*key), db_entry_cmp);
+}
+
+/* Returns 1 if another process replaced the file while compacting it,
+ * 0 if not */
+static int db_is_replaced(struct fp_print_db *db)
+{
+	struct stat st_fd, st_path;
+
+	if (fstat(db->fd, &st_fd) < 0)
+		return -errno;
+	if (g_stat(db->path, &st_path) < 0)
+		return -errno;
+	return st_fd.st_dev != st_path.st_dev || st_fd.st_ino != st_path.st_ino;
+}
+
+/* Switches to the file now found at the path of the database. The lock on
+ * the old file, if any, is released by closing it. */
+static int db_reopen(struct fp_print_db *db)
+{
+	int fd;
+
+	fp_dbg("%s was replaced, reopening", db->path);
+	fd = open(db->path, (db->read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	close(db->fd);
+	db->fd = fd;
+	db_unmap(db);
+	memset(&db->state, 0, sizeof(db->state));
+	return 0;
+}
+
+/* Reopens the database if another process replaced the file while
+ * compacting it. Must be called with the lock held. */
+static int db_check_replaced(struct fp_print_db *db)
+{
+	int r;
+
+	r = db_is_replaced(db);
+	if (r <= 0)
+		return r;
+
+	r = db_reopen(db);
+	if (r < 0)
+		return r;
+	r = db_lock(db);
+	if (r < 0)
+		return r;
+	return db_check_replaced(db);
+}
+
+/* Same as db_check_replaced(), for readers, which don't take the lock.
+ * Compacting replaces the file only once the new one is complete, so it
+ * can be read right away. Replaced files are marked as such, so this is
+ * only needed if the process compacting the database died before marking
+ * the old file, and is done once per gallery load rather than for every
+ * print. */
+static int db_check_replaced_unlocked(struct fp_print_db *db)
+{
+	int r;
+
+	/* Nobody can replace the file while a batch holds the lock */
+	if (db->in_txn)
+		return 0;
+
+	r = db_is_replaced(db);
+	if (r > 0)
+		r = db_reopen(db);
+	return r;
+}
+
+static int db_txn_begin(struct fp_print_db *db, struct db_txn *txn)
+{
+	int r;
+
+	if (db->read_only)
+		return -EROFS;
+	if (db->in_txn) {
+		fp_err("a batch is already in progress on %s", db->path);
+		return -EBUSY;
+	}
+
+	r = db_lock(db);
+	if (r < 0)
+		return r;
+
+	r = db_check_replaced(db);
+	if (r == 0)
+		r = db_refresh(db);
+	if (r < 0) {
+		db_unlock(db);
+		return r;
+	}
+
+	txn->records = g_byte_array_new();
+	txn->flushed = 0;
+	txn->entries = g_array_sized_new(FALSE, FALSE,
+		sizeof(struct fpi_print_db_entry), db->state.index_count + 1);
+	g_array_append_vals(txn->entries, db->index, db->state.index_count);
+	/* The current index is superseded by the one written on commit */
+	txn->dead_bytes = db->state.dead_bytes +
+		db->state.end_offset - db->state.index_offset;
+	db->in_txn = TRUE;
+	return 0;
+}
+
+static void db_txn_abort(struct fp_print_db *db, struct db_txn *txn)
+{
+	g_byte_array_free(txn->records, TRUE);
+	g_array_free(txn->entries, TRUE);
+	db->in_txn = FALSE;
+	db_unlock(db);
+}
+
+/* Finds where @key is or would be in the staged index */
+static gboolean db_txn_find(struct db_txn *txn,
+	const struct fpi_print_db_entry *key, guint *index)
+{
+	guint lo = 0, hi = txn->entries->len;
+
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+		int r = db_entry_cmp(key, &g_array_index(txn->entries,
+			struct fpi_print_db_entry, mid));
+
+		if (r == 0) {
+			*index = mid;
+			return TRUE;
+		}
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	*index = lo;
+	return FALSE;
+}
+
+static int db_txn_flush(struct fp_print_db *db, struct db_txn *txn)
+{
+	int r;
+
+	r = db_pwrite(db->fd, txn->records->data, txn->records->len,
+		      db->state.end_offset + txn->flushed);
+	if (r < 0)
+		return r;
+
+	txn->flushed += txn->records->len;
+	g_byte_array_set_size(txn->records, 0);
+	return 0;
+}
+
+static int db_txn_put(struct fp_print_db *db, struct db_txn *txn,
+	const struct fpi_print_db_entry *key, const unsigned char *buf,
+	size_t len)
+{
+	static const unsigned char padding[DB_ALIGN] = { 0, };
+	struct fpi_print_db_record record;
+	struct fpi_print_db_entry *entry;
+	guint64 offset;
+	guint i;
+
+	offset = db->state.end_offset + txn->flushed + txn->records->len;
+	memcpy(record.magic, DB_RECORD_MAGIC, sizeof(record.magic));
+	record.length = GUINT32_TO_LE(len);
+	record.checksum = GUINT32_TO_LE(db_crc32(buf, len));
+	g_byte_array_append(txn->records, (guint8 *) &record, sizeof(record));
+	g_byte_array_append(txn->records, buf, len);
+	g_byte_array_append(txn->records, padding,
+		(DB_ALIGN - txn->records->len % DB_ALIGN) % DB_ALIGN);
+
+	if (db_txn_find(txn, key, &i)) {
+		entry = &g_array_index(txn->entries, struct fpi_print_db_entry, i);
+		/* Records staged earlier in this transaction aren't accounted
+		 * as dead, which only delays compaction */
+		if (GUINT64_FROM_LE(entry->record_offset) < db->state.end_offset)
+			txn->dead_bytes += db_get_record(db,
+				GUINT64_FROM_LE(entry->record_offset), NULL, NULL);
+	} else {
+		g_array_insert_val(txn->entries, i, *key);
+		entry = &g_array_index(txn->entries, struct fpi_print_db_entry, i);
+	}
+	entry->record_offset = GUINT64_TO_LE(offset);
+
+	if (txn->records->len >= DB_TXN_FLUSH_SIZE)
+		return db_txn_flush(db, txn);
+	return 0;
+}
+
+static gboolean db_txn_remove(struct fp_print_db *db, struct db_txn *txn,
+	const struct fpi_print_db_entry *key)
+{
+	struct fpi_print_db_entry *entry;
+	guint i;
+
+	if (!db_txn_find(txn, key, &i))
+		return FALSE;
+
+	entry = &g_array_index(txn->entries, struct fpi_print_db_entry, i);
+	if (GUINT64_FROM_LE(entry->record_offset) < db->state.end_offset)
+		txn->dead_bytes += db_get_record(db,
+			GUINT64_FROM_LE(entry->record_offset), NULL, NULL);
+	g_array_remove_index(txn->entries, i);
+	return TRUE;
+}
+
+static int db_compact(struct fp_print_db *db);
+
+static int db_txn_commit(struct fp_print_db *db, struct db_txn *txn)
+{
+	struct db_state state;
+	size_t index_size;
+	guint32 index_checksum;
+	guint64 live_bytes;
+	int r;
+
+	index_size = txn->entries->len * sizeof(struct fpi_print_db_entry);
+	index_checksum = db_crc32(txn->entries->data, index_size);
+
+	state.slot = !db->state.slot;
+	state.generation = db->state.generation + 1;
+	state.index_offset = db->state.end_offset + txn->flushed +
+		txn->records->len;
+	state.end_offset = state.index_offset + index_size;
+	state.dead_bytes = txn->dead_bytes;
+	state.index_count = txn->entries->len;
+
+	/* Everything the new header refers to must be on disk before the
+	 * header itself */
+	r = db_txn_flush(db, txn);
+	if (r == 0)
+		r = db_pwrite(db->fd, txn->entries->data, index_size,
+			      state.index_offset);
+	if (r == 0)
+		r = db_sync(db->fd);
+	if (r == 0)
+		r = db_write_header(db->fd, state.slot, &state, index_checksum);
+	if (r == 0)
+		r = db_sync(db->fd);
+	if (r == 0)
+		r = db_refresh(db);
+
+	live_bytes = state.end_offset - DB_DATA_OFFSET - state.dead_bytes;
+	if (r == 0 && state.dead_bytes > DB_COMPACT_MIN_DEAD &&
+	    state.dead_bytes > live_bytes) {
+		/* The changes are already committed, a failure to compact
+		 * only means that the file stays larger than needed */
+		if (db_compact(db) < 0)
+			fp_warn("couldn't compact %s", db->path);
+	}
+
+	if (r < 0)
+		fp_err("couldn't write to %s: %s", db->path, g_strerror(-r));
+	db_txn_abort(db, txn);
+	return r;
+}
+
+/* Copies the live records into a new file, which then replaces the
+ * database. Must be called with the lock held. */
+static int db_compact(struct fp_print_db *db)
+{
+	const struct fpi_print_db_entry *old_index = db->index;
+	struct fpi_print_db_entry *entries;
+	struct db_state state;
+	size_t index_size;
+	char *tmp_path;
+	guint64 offset = DB_DATA_OFFSET;
+	guint32 i;
+	int fd, r;
+
+	tmp_path = g_strdup_printf("%s.XXXXXX", db->path);
+	fd = g_mkstemp_full(tmp_path, O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		r = -errno;
+		g_free(tmp_path);
+		return r;
+	}
+
+	fp_dbg("compacting %s, %" G_GUINT64_FORMAT " dead bytes", db->path,
+	       db->state.dead_bytes);
+
+	index_size = db->state.index_count * sizeof(*entries);
+	entries = g_malloc(index_size);
+	memcpy(entries, old_index, index_size);
+
+	r = 0;
+	for (i = 0; r == 0 && i < db->state.index_count; i++) {
+		guint64 old_offset = GUINT64_FROM_LE(old_index[i].record_offset);
+		size_t size = db_get_record(db, old_offset, NULL, NULL);
+
+		if (size == 0) {
+			fp_err("corrupted record at %" G_GUINT64_FORMAT,
+			       old_offset);
+			r = -EIO;
+			break;
+		}
+		r = db_pwrite(fd, db->map + old_offset, size, offset);
+		entries[i].record_offset = GUINT64_TO_LE(offset);
+		offset += size;
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.generation = db->state.generation + 1;
+	state.index_offset = offset;
+	state.end_offset = offset + index_size;
+	state.index_count = db->state.index_count;
+
+	if (r == 0)
+		r = db_pwrite(fd, entries, index_size, state.index_offset);
+	if (r == 0)
+		r = ftruncate(fd, state.end_offset) < 0 ? -errno : 0;
+	if (r == 0)
+		r = db_write_header(fd, 0, &state,
+				    db_crc32(entries, index_size));
+	if (r == 0)
+		r = db_sync(fd);
+	if (r == 0)
+		r = g_rename(tmp_path, db->path) < 0 ? -errno : 0;
+	g_free(entries);
+
+	if (r < 0) {
+		close(fd);
+		g_unlink(tmp_path);
+		g_free(tmp_path);
+		return r;
+	}
+	g_free(tmp_path);
+	db_sync_dir(db->path);
+
+	/* Processes still reading the old file reopen the database once they
+	 * see this */
+	db_pwrite(db->fd, DB_REPLACED_MAGIC, 4, 0);
+	db_pwrite(db->fd, DB_REPLACED_MAGIC, 4, DB_HEADER_SLOT_SIZE);
+
+	/* The lock on the old file is released by closing it */
+	close(db->fd);
+	db->fd = fd;
+	db_unmap(db);
+	memset(&db->state, 0, sizeof(db->state));
+	r = db_lock(db);
+	if (r < 0)
+		return r;
+	return db_refresh(db);
+}
+
+/**
+ * fp_print_db_open:
+ * @path: (nullable): the path of the database file, or %NULL for the
+ * default database in the current user's home directory
+ * @db: output location for the opened database. Must be closed with
+ * fp_print_db_close() after use.
+ *
+ * Opens a print database, creating it if the file doesn't exist. If the
+ * file can't be written to, the database is opened read-only, and functions
+ * changing it will fail with -EROFS.
+ *
+ * Returns: 0 on success, negative on error
+ */
+API_EXPORTED int fp_print_db_open(const char *path, struct fp_print_db **db)
+{
+	struct fp_print_db *pdb;
+	gboolean read_only = FALSE;
+	int fd, r;
+
+	g_return_val_if_fail (db != NULL, -EINVAL);
+
+	pdb = g_malloc0(sizeof(*pdb));
+	if (path) {
+		pdb->path = g_strdup(path);
+	} else {
+		const char *store = fpi_data_get_store_dir();
+
+		if (!store) {
+			g_free(pdb);
+			return -ENOENT;
+		}
+		pdb->path = g_build_filename(store, "prints.db", NULL);
+	}
+
+	fd = open(pdb->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+		fd = open(pdb->path, O_RDONLY | O_CLOEXEC);
+		read_only = TRUE;
+	}
+	if (fd < 0) {
+		r = -errno;
+		fp_err("couldn't open %s: %s", pdb->path, g_strerror(errno));
+		g_free(pdb->path);
+		g_free(pdb);
+		return r;
+	}
+	pdb->fd = fd;
+	pdb->read_only = read_only;
+
+	r = db_map(pdb);
+	if (r == 0 && pdb->map_size == 0 && !read_only) {
+		/* Another process might be creating it too */
+		r = db_lock(pdb);
+		if (r == 0) {
+			r = db_map(pdb);
+			if (r == 0 && pdb->map_size == 0)
+				r = db_init_file(fd);
+			if (r == 0)
+				r = db_map(pdb);
+			db_unlock(pdb);
+		}
+	}
+	if (r == 0)
+		r = db_refresh(pdb);
+
+	if (r < 0) {
+		fp_print_db_close(pdb);
+		return r;
+	}
+
+	fp_dbg("opened %s with %u prints", pdb->path, pdb->state.index_count);
+	*db = pdb;
+	return 0;
+}
+
+/**
+ * fp_print_db_close:
+ * @db: (nullable): the database to close. If %NULL, function simply returns.
+ *
+ * Closes a print database opened with fp_print_db_open(). Galleries loaded
+ * with fp_print_db_load_gallery() must be freed beforehand.
+ */
+API_EXPORTED void fp_print_db_close(struct fp_print_db *db)
+{
+	if (!db)
+		return;
+
+	db_unmap(db);
+	while (db->old_maps) {
+		struct db_old_map *old = db->old_maps->data;
+
+		munmap((void *) old->map, old->size);
+		g_free(old);
+		db->old_maps = g_slist_delete_link(db->old_maps, db->old_maps);
+	}
+	close(db->fd);
+	g_free(db->path);
+	g_free(db);
+}
+
+/**
+ * fp_print_db_save:
+ * @db: the database
+ * @user: (nullable): the name of the user the print belongs to, at most
+ * %FP_PRINT_DB_USER_MAX bytes long, or %NULL for the current user
+ * @data: the stored print to save
+ * @finger: the finger that this print corresponds to
+ *
+ * Saves a stored print to the database, replacing any print previously
+ * saved for the same user, finger and device type. The print is on disk
+ * by the time this function returns.
+ *
+ * Returns: 0 on success, negative on error
+ */
+API_EXPORTED int fp_print_db_save(struct fp_print_db *db, const char *user,
+	struct fp_print_data *data, enum fp_finger finger)
+{
+	struct fpi_print_db_entry key;
+	struct db_txn txn;
+	unsigned char *buf;
+	size_t len;
+	int r;
+
+	r = db_make_key(&key, user, data->driver_id, data->devtype, finger);
+	if (r < 0)
+		return r;
+
+	len = fp_print_data_get_data(data, &buf);
+	if (!len)
+		return -ENOMEM;
+
+	r = db_txn_begin(db, &txn);
+	if (r == 0) {
+		r = db_txn_put(db, &txn, &key, buf, len);
+		if (r == 0)
+			r = db_txn_commit(db, &txn);
+		else
+			db_txn_abort(db, &txn);
+	}
+	g_free(buf);
+	return r;
+}
+
+/**
+ * fp_print_db_load:
+ * @db: the database
+ * @user: (nullable): the name of the user the print belongs to, or %NULL
+ * for the current user
+ * @dev: the device you are loading the print for
+ * @finger: the finger of the print you are loading
+ * @data: output location to put the corresponding stored print. Must be
+ * freed with fp_print_data_free() after use.
+ *
+ * Loads a print previously saved to the database with fp_print_db_save().
+ *
+ * Returns: 0 on success, -ENOENT if there is no such print, or another
+ * negative error code if the print is corrupted or incompatible with @dev
+ */
+API_EXPORTED int fp_print_db_load(struct fp_print_db *db, const char *user,
+	struct fp_dev *dev, enum fp_finger finger, struct fp_print_data **data)
+{
+	const struct fpi_print_db_entry *entry;
+	struct fpi_print_db_entry key;
+	struct fp_print_data *fdata;
+	const unsigned char *buf;
+	size_t len;
+	int r;
+
+	r = db_make_key(&key, user, dev->drv->id, dev->devtype, finger);
+	if (r < 0)
+		return r;
+
+	r = db_refresh(db);
+	if (r < 0)
+		return r;
+
+	entry = db_lookup(db, &key);
+	if (!entry)
+		return -ENOENT;
+
+	if (!db_get_record(db, GUINT64_FROM_LE(entry->record_offset),
+			   &buf, &len)) {
+		fp_err("corrupted record in %s", db->path);
+		return -EIO;
+	}
+
+	fdata = fp_print_data_from_data((unsigned char *) buf, len);
+	if (!fdata)
+		return -EIO;
+
+	if (!fp_dev_supports_print_data(dev, fdata)) {
+		fp_err("print data is not compatible!");
+		fp_print_data_free(fdata);
+		return -EINVAL;
+	}
+
+	*data = fdata;
+	return 0;
+}
+
+/**
+ * fp_print_db_load_gallery:
+ * @db: the database
+ * @dev: the device you are loading the prints for
+ * @gallery: output location for the %NULL-terminated gallery. Must be
+ * freed with fp_print_data_gallery_free() after use, and before closing
+ * @db.
+ * @users: (nullable): output location for the %NULL-terminated list of the
+ * users the prints belong to, in the same order as @gallery. Must be freed
+ * with g_strfreev() after use.
+ * @fingers: (nullable): output location for the fingers the prints
+ * correspond to, in the same order as @gallery. Must be freed with g_free()
+ * after use.
+ *
+ * Loads all the prints saved to the database for the device type of @dev,
+ * in the order of the user names, as a gallery suitable for
+ * fp_identify_finger() or fp_async_identify_start(). The prints are views
+ * of the memory-mapped records, as created by
+ * fp_print_data_gallery_view_from_data(), so the gallery takes a single
+ * allocation, and the records are only copied where they need decoding.
+ *
+ * Returns: the number of prints in the gallery, or negative on error
+ */
+API_EXPORTED int fp_print_db_load_gallery(struct fp_print_db *db,
+	struct fp_dev *dev, struct fp_print_data ***gallery, char ***users,
+	enum fp_finger **fingers)
+{
+	const struct fpi_print_db_entry **entries;
+	struct fp_print_data **prints;
+	unsigned char **bufs;
+	size_t *buflens;
+	size_t count = 0;
+	guint32 i;
+	int r, j, num_prints;
+
+	r = db_check_replaced_unlocked(db);
+	if (r == 0)
+		r = db_refresh(db);
+	if (r < 0)
+		return r;
+
+	entries = g_new(const struct fpi_print_db_entry *, db->state.index_count);
+	bufs = g_new(unsigned char *, db->state.index_count);
+	buflens = g_new(size_t, db->state.index_count);
+	for (i = 0; i < db->state.index_count; i++) {
+		const struct fpi_print_db_entry *entry = &db->index[i];
+		const unsigned char *buf;
+
+		if (!fpi_print_data_compatible(dev->drv->id, dev->devtype, 0,
+				GUINT16_FROM_LE(entry->driver_id),
+				GUINT32_FROM_LE(entry->devtype), 0))
+			continue;
+
+		if (!db_get_record(db, GUINT64_FROM_LE(entry->record_offset),
+				   &buf, &buflens[count])) {
+			fp_err("corrupted record in %s", db->path);
+			r = -EIO;
+			goto out;
+		}
+		entries[count] = entry;
+		bufs[count] = (unsigned char *) buf;
+		count++;
+	}
+
+	r = fpi_print_data_gallery_from_data(bufs, buflens, count, TRUE,
+		&prints);
+	if (r < 0)
+		goto out;
+	if (count)
+		db->map_borrowed = TRUE;
+
+	/* Prints of the right device type but the wrong data type are left
+	 * out, they are still freed along with the gallery */
+	num_prints = 0;
+	for (j = 0; j < r; j++) {
+		if (!fp_dev_supports_print_data(dev, prints[j])) {
+			fp_err("print data is not compatible!");
+			continue;
+		}
+		entries[num_prints] = entries[j];
+		prints[num_prints++] = prints[j];
+	}
+	prints[num_prints] = NULL;
+
+	if (users) {
+		*users = g_new(char *, num_prints + 1);
+		for (j = 0; j < num_prints; j++)
+			(*users)[j] = g_strndup(entries[j]->user,
+						FP_PRINT_DB_USER_MAX);
+		(*users)[num_prints] = NULL;
+	}
+	if (fingers) {
+		*fingers = g_new(enum fp_finger, num_prints);
+		for (j = 0; j < num_prints; j++)
+			(*fingers)[j] = entries[j]->finger;
+	}
+
+	fp_dbg("loaded %d prints", num_prints);
+	*gallery = prints;
+	r = num_prints;
+
+out:
+	g_free(entries);
+	g_free(bufs);
+	g_free(buflens);
+	return r;
+}
+
+/**
+ * fp_print_db_delete:
+ * @db: the database
+ * @user: (nullable): the name of the user the print belongs to, or %NULL
+ * for the current user
+ * @dev: the device that the print belongs to
+ * @finger: the finger of the print you are deleting
+ *
+ * Removes a print previously saved to the database with fp_print_db_save().
+ *
+ * Returns: 0 on success, -ENOENT if there is no such print, or another
+ * negative error code on failure
+ */
+API_EXPORTED int fp_print_db_delete(struct fp_print_db *db, const char *user,
+	struct fp_dev *dev, enum fp_finger finger)
+{
+	struct fpi_print_db_entry key;
+	struct db_txn txn;
+	int r;
+
+	r = db_make_key(&key, user, dev->drv->id, dev->devtype, finger);
+	if (r < 0)
+		return r;
+
+	r = db_txn_begin(db, &txn);
+	if (r < 0)
+		return r;
+
+	if (!db_txn_remove(db, &txn, &key)) {
+		db_txn_abort(db, &txn);
+		return -ENOENT;
+	}
+	return db_txn_commit(db, &txn);
+}
+
+/**
+ * fp_print_db_batch_new:
+ * @db: the database
+ *
+ * Starts a batch of changes to a print database. Prints saved to the batch
+ * with fp_print_db_batch_save() only become visible once the batch is
+ * committed with fp_print_db_batch_commit(), all at once, and with a single
+ * pair of disk syncs. This is much faster than fp_print_db_save() when
+ * saving many prints, e.g. when importing them.
+ *
+ * Other processes can't change the database from the first print saved to
+ * the batch until it is committed or freed, and no other batch or change
+ * can be made to @db in the meantime.
+ *
+ * Returns: a new batch, to free with fp_print_db_batch_free() before
+ * closing @db
+ */
+API_EXPORTED struct fp_print_db_batch *fp_print_db_batch_new(
+	struct fp_print_db *db)
+{
+	struct fp_print_db_batch *batch;
+
+	batch = g_malloc0(sizeof(*batch));
+	batch->db = db;
+	return batch;
+}
+
+/**
+ * fp_print_db_batch_save:
+ * @batch: the batch
+ * @user: (nullable): the name of the user the print belongs to, at most
+ * %FP_PRINT_DB_USER_MAX bytes long, or %NULL for the current user
+ * @data: the stored print to save
+ * @finger: the finger that this print corresponds to
+ *
+ * Adds a stored print to a batch, replacing any print saved for the same
+ * user, finger and device type when the batch is committed. The print
+ * data is written out straight away, so @data can be freed as soon as this
+ * returns.
+ *
+ * An invalid print only fails this call, and the rest of the batch can
+ * still be committed. Write errors fail the whole batch, and are returned
+ * again by fp_print_db_batch_commit().
+ *
+ * Returns: 0 on success, negative on error
+ */
+API_EXPORTED int fp_print_db_batch_save(struct fp_print_db_batch *batch,
+	const char *user, struct fp_print_data *data, enum fp_finger finger)
+{
+	struct fpi_print_db_entry key;
+	unsigned char *buf;
+	size_t len;
+	int r;
+
+	if (batch->error < 0)
+		return batch->error;
+
+	r = db_make_key(&key, user, data->driver_id, data->devtype, finger);
+	if (r < 0)
+		return r;
+
+	len = fp_print_data_get_data(data, &buf);
+	if (!len)
+		return -ENOMEM;
+
+	if (!batch->active) {
+		r = db_txn_begin(batch->db, &batch->txn);
+		if (r < 0) {
+			g_free(buf);
+			return r;
+		}
+		batch->active = TRUE;
+	}
+
+	r = db_txn_put(batch->db, &batch->txn, &key, buf, len);
+	g_free(buf);
+	if (r < 0) {
+		fp_err("couldn't write to %s: %s", batch->db->path,
+		       g_strerror(-r));
+		batch->error = r;
+		return r;
+	}
+
+	batch->count++;
+	return 0;
+}
+
+/**
+ * fp_print_db_batch_commit:
+ * @batch: the batch
+ *
+ * Makes all the prints saved to the batch visible at once. The database is
+ * left unchanged if this fails, including if the process or system crashes
+ * while committing. The batch is empty afterwards, and can be reused.
+ *
+ * Returns: 0 on success, negative on error
+ */
+API_EXPORTED int fp_print_db_batch_commit(struct fp_print_db_batch *batch)
+{
+	int r = batch->error;
+
+	if (batch->active) {
+		if (r == 0) {
+			fp_dbg("committing %u prints", batch->count);
+			r = db_txn_commit(batch->db, &batch->txn);
+		} else {
+			db_txn_abort(batch->db, &batch->txn);
+		}
+	}
+
+	batch->active = FALSE;
+	batch->error = 0;
+	batch->count = 0;
+	return r;
+}
+
+/**
+ * fp_print_db_batch_free:
+ * @batch: (nullable): the batch to free. If %NULL, function simply returns.
+ *
+ * Frees a batch, discarding any prints saved to it since it was last
+ * committed.
+ */
+API_EXPORTED void fp_print_db_batch_free(struct fp_print_db_batch *batch)
+{
+	if (!batch)
+		return;
+
+	if (batch->active)
+		db_txn_abort(batch->db, &batch->txn);
+	g_free(batch);
+}
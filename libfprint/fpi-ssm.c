@@ -24,6 +24,7 @@
 
 #include <config.h>
 #include <errno.h>
+#include <string.h>
 
 /**
  * SECTION:fpi-ssm
@@ -74,6 +75,15 @@
  * Your completion callback should examine the return value of
  * fpi_ssm_get_error() in order to determine whether the #fpi_ssm completed or
  * failed. An error code of zero indicates successful completion.
+ *
+ * A completed or failed #fpi_ssm can be started again with fpi_ssm_start(),
+ * which is cheaper than freeing it and creating a new one for every run of
+ * a capture loop. Freed machines are also kept for reuse by fpi_ssm_new().
+ *
+ * Every machine is named after its state handler function. When the
+ * `FP_SSM_TRACE` environment variable is set to 1, the time spent in each
+ * state, the number of runs and the failures of every machine are recorded
+ * per device, and reported in the debug log when the device is closed.
  */
 
 struct fpi_ssm {
@@ -86,34 +96,226 @@ struct fpi_ssm {
 	int error;
 	ssm_completed_fn callback;
 	ssm_handler_fn handler;
+	const char *name;
+	/* trace of the machines with this name, if the device is traced */
+	struct ssm_trace_entry *trace;
+	/* monotonic time the current state was entered at, 0 if not traced */
+	gint64 entered;
+	/* next freed machine in the pool */
+	fpi_ssm *next;
+};
+
+/* Freed machines are kept in a global pool, as they can outlive the
+ * device they were created for. Drivers rarely have more than a couple of
+ * machines running at once. */
+#define SSM_POOL_MAX	16
+
+G_LOCK_DEFINE_STATIC(ssm_pool);
+static fpi_ssm *ssm_pool;
+static int ssm_pool_size;
+/* -1 until the environment has been checked */
+static int ssm_pool_enabled = -1;
+
+struct ssm_trace_state {
+	guint64 entries;
+	gint64 total_us;
+	gint64 max_us;
+	guint64 failures;
+};
+
+struct ssm_trace_entry {
+	const char *name;
+	int nr_states;
+	guint64 runs;
+	guint64 failures;
+	struct ssm_trace_state *states;
+};
+
+/* The trace of a device is only touched by the thread driving it */
+struct fpi_ssm_trace {
+	/* machine name to struct ssm_trace_entry */
+	GHashTable *machines;
 };
 
+static void trace_entry_free(gpointer data)
+{
+	struct ssm_trace_entry *entry = data;
+
+	g_free(entry->states);
+	g_free(entry);
+}
+
+/**
+ * fpi_ssm_trace_new:
+ *
+ * Creates the state machine trace of a newly opened device. Tracing is
+ * enabled by setting the `FP_SSM_TRACE` environment variable to 1.
+ *
+ * Returns: a new trace to close with fpi_ssm_trace_close(), or %NULL if
+ * tracing is disabled
+ */
+struct fpi_ssm_trace *fpi_ssm_trace_new(void)
+{
+	const char *env = g_getenv("FP_SSM_TRACE");
+	struct fpi_ssm_trace *trace;
+
+	if (!env || !g_str_equal(env, "1"))
+		return NULL;
+
+	trace = g_malloc0(sizeof(*trace));
+	trace->machines = g_hash_table_new_full(g_str_hash, g_str_equal,
+		NULL, trace_entry_free);
+	return trace;
+}
+
+/**
+ * fpi_ssm_trace_close:
+ * @trace: the trace of a device being closed, or %NULL
+ *
+ * Reports the state machines recorded in @trace, then frees it.
+ */
+void fpi_ssm_trace_close(struct fpi_ssm_trace *trace)
+{
+	if (!trace)
+		return;
+
+	fpi_ssm_trace_dump(trace);
+	g_hash_table_destroy(trace->machines);
+	g_free(trace);
+}
+
+static gint trace_entry_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct ssm_trace_entry *ea = a;
+	const struct ssm_trace_entry *eb = b;
+
+	return strcmp(ea->name, eb->name);
+}
+
 /**
- * fpi_ssm_new:
+ * fpi_ssm_trace_dump:
+ * @trace: the trace of a device, or %NULL
+ *
+ * Writes the number of runs and failures of every state machine recorded
+ * in @trace to the debug log, along with how many times each state was
+ * entered, the total and longest time spent in it, and how many times the
+ * machine failed from it. The time spent in a state includes waiting for
+ * the transfers and timeouts it started, which makes the slowest protocol
+ * steps stand out.
+ */
+void fpi_ssm_trace_dump(struct fpi_ssm_trace *trace)
+{
+	GList *entries;
+	GList *elem;
+
+	if (!trace)
+		return;
+
+	entries = g_list_sort(g_hash_table_get_values(trace->machines),
+		trace_entry_cmp);
+	for (elem = entries; elem; elem = elem->next) {
+		struct ssm_trace_entry *entry = elem->data;
+		int i;
+
+		fp_dbg("%s: %" G_GUINT64_FORMAT " runs, %" G_GUINT64_FORMAT
+			" failed", entry->name, entry->runs, entry->failures);
+		for (i = 0; i < entry->nr_states; i++) {
+			struct ssm_trace_state *state = &entry->states[i];
+
+			if (!state->entries)
+				continue;
+			fp_dbg("  state %d: %" G_GUINT64_FORMAT " entries, %"
+				G_GINT64_FORMAT " us total, %" G_GINT64_FORMAT
+				" us max, %" G_GUINT64_FORMAT " failures", i,
+				state->entries, state->total_us, state->max_us,
+				state->failures);
+		}
+	}
+	g_list_free(entries);
+}
+
+static struct ssm_trace_entry *trace_lookup(struct fpi_ssm_trace *trace,
+	const char *name, int nr_states)
+{
+	struct ssm_trace_entry *entry;
+
+	entry = g_hash_table_lookup(trace->machines, name);
+	if (!entry) {
+		entry = g_malloc0(sizeof(*entry));
+		entry->name = name;
+		g_hash_table_insert(trace->machines, (gpointer) name, entry);
+	}
+	if (entry->nr_states < nr_states) {
+		entry->states = g_renew(struct ssm_trace_state, entry->states,
+			nr_states);
+		memset(entry->states + entry->nr_states, 0,
+		       (nr_states - entry->nr_states) * sizeof(*entry->states));
+		entry->nr_states = nr_states;
+	}
+	return entry;
+}
+
+/* Accounts for the time spent in the current state, when leaving it */
+static void trace_leave(fpi_ssm *machine, gboolean failed)
+{
+	struct ssm_trace_state *state;
+	gint64 elapsed;
+
+	if (!machine->entered)
+		return;
+
+	state = &machine->trace->states[machine->cur_state];
+	elapsed = g_get_monotonic_time() - machine->entered;
+	state->total_us += elapsed;
+	state->max_us = MAX(state->max_us, elapsed);
+	if (failed)
+		state->failures++;
+	machine->entered = 0;
+}
+
+/**
+ * fpi_ssm_new_full:
  * @dev: a #fp_dev fingerprint device
  * @handler: the callback function
  * @nr_states: the number of states
  * @user_data: the user data to pass to callbacks
+ * @name: a static string naming the machine in the debug log and traces
  *
- * Allocate a new ssm, with @nr_states states. The @handler callback
- * will be called after each state transition.
+ * Same as fpi_ssm_new(), but with an explicit @name.
  *
  * Returns: a new #fpi_ssm state machine
  */
-fpi_ssm *fpi_ssm_new(struct fp_dev  *dev,
-		     ssm_handler_fn  handler,
-		     int             nr_states,
-		     void           *user_data)
+fpi_ssm *fpi_ssm_new_full(struct fp_dev  *dev,
+			  ssm_handler_fn  handler,
+			  int             nr_states,
+			  void           *user_data,
+			  const char     *name)
 {
-	fpi_ssm *machine;
+	fpi_ssm *machine = NULL;
 	BUG_ON(nr_states < 1);
 
-	machine = g_malloc0(sizeof(*machine));
+	G_LOCK(ssm_pool);
+	if (ssm_pool_enabled < 0) {
+		const char *env = g_getenv("FP_SSM_POOL");
+		ssm_pool_enabled = !env || !g_str_equal(env, "0");
+	}
+	if (ssm_pool) {
+		machine = ssm_pool;
+		ssm_pool = machine->next;
+		ssm_pool_size--;
+	}
+	G_UNLOCK(ssm_pool);
+
+	if (machine)
+		memset(machine, 0, sizeof(*machine));
+	else
+		machine = g_malloc0(sizeof(*machine));
 	machine->handler = handler;
 	machine->nr_states = nr_states;
 	machine->dev = dev;
 	machine->completed = TRUE;
 	machine->user_data = user_data;
+	machine->name = name ? name : "ssm";
 	return machine;
 }
 
@@ -143,13 +345,64 @@ void fpi_ssm_free(fpi_ssm *machine)
 {
 	if (!machine)
 		return;
+
+	G_LOCK(ssm_pool);
+	if (ssm_pool_enabled > 0 && ssm_pool_size < SSM_POOL_MAX) {
+		machine->next = ssm_pool;
+		ssm_pool = machine;
+		ssm_pool_size++;
+		machine = NULL;
+	}
+	G_UNLOCK(ssm_pool);
+
 	g_free(machine);
 }
 
+/**
+ * fpi_ssm_exit:
+ *
+ * Frees the machines kept for reuse by fpi_ssm_new(). Called by fp_exit().
+ */
+void fpi_ssm_exit(void)
+{
+	fpi_ssm *machine;
+
+	G_LOCK(ssm_pool);
+	machine = ssm_pool;
+	ssm_pool = NULL;
+	ssm_pool_size = 0;
+	ssm_pool_enabled = -1;
+	G_UNLOCK(ssm_pool);
+
+	while (machine) {
+		fpi_ssm *next = machine->next;
+
+		g_free(machine);
+		machine = next;
+	}
+}
+
+/**
+ * fpi_ssm_get_name:
+ * @machine: an #fpi_ssm state machine
+ *
+ * Returns: the name of @machine, which is the name of its state handler
+ * unless it was created with fpi_ssm_new_full()
+ */
+const char *fpi_ssm_get_name(fpi_ssm *machine)
+{
+	return machine->name;
+}
+
 /* Invoke the state handler */
 static void __ssm_call_handler(fpi_ssm *machine)
 {
-	fp_dbg("%p entering state %d", machine, machine->cur_state);
+	fp_dbg("%s %p entering state %d", machine->name, machine,
+	       machine->cur_state);
+	if (machine->trace) {
+		machine->trace->states[machine->cur_state].entries++;
+		machine->entered = g_get_monotonic_time();
+	}
 	machine->handler(machine, machine->dev, machine->user_data);
 }
 
@@ -169,6 +422,12 @@ void fpi_ssm_start(fpi_ssm *ssm, ssm_completed_fn callback)
 	ssm->cur_state = 0;
 	ssm->completed = FALSE;
 	ssm->error = 0;
+	ssm->trace = NULL;
+	if (ssm->dev && ssm->dev->ssm_trace) {
+		ssm->trace = trace_lookup(ssm->dev->ssm_trace, ssm->name,
+			ssm->nr_states);
+		ssm->trace->runs++;
+	}
 	__ssm_call_handler(ssm);
 }
 
@@ -210,8 +469,12 @@ void fpi_ssm_start_subsm(fpi_ssm *parent, fpi_ssm *child)
 void fpi_ssm_mark_completed(fpi_ssm *machine)
 {
 	BUG_ON(machine->completed);
+	trace_leave(machine, machine->error != 0);
+	if (machine->trace && machine->error)
+		machine->trace->failures++;
 	machine->completed = TRUE;
-	fp_dbg("%p completed with status %d", machine, machine->error);
+	fp_dbg("%s %p completed with status %d", machine->name, machine,
+	       machine->error);
 	if (machine->callback)
 		machine->callback(machine, machine->dev, machine->user_data);
 }
@@ -225,7 +488,8 @@ void fpi_ssm_mark_completed(fpi_ssm *machine)
  */
 void fpi_ssm_mark_failed(fpi_ssm *machine, int error)
 {
-	fp_dbg("error %d from state %d", error, machine->cur_state);
+	fp_dbg("%s error %d from state %d", machine->name, error,
+	       machine->cur_state);
 	BUG_ON(error == 0);
 	machine->error = error;
 	fpi_ssm_mark_completed(machine);
@@ -244,6 +508,7 @@ void fpi_ssm_next_state(fpi_ssm *machine)
 	g_return_if_fail (machine != NULL);
 
 	BUG_ON(machine->completed);
+	trace_leave(machine, FALSE);
 	machine->cur_state++;
 	if (machine->cur_state == machine->nr_states) {
 		fpi_ssm_mark_completed(machine);
@@ -285,6 +550,7 @@ void fpi_ssm_jump_to_state(fpi_ssm *machine, int state)
 {
 	BUG_ON(machine->completed);
 	BUG_ON(state >= machine->nr_states);
+	trace_leave(machine, FALSE);
 	machine->cur_state = state;
 	__ssm_call_handler(machine);
 }
@@ -65,10 +65,26 @@ typedef void (*ssm_handler_fn)(fpi_ssm *ssm,
 			       void *user_data);
 
 /* for library and drivers */
-fpi_ssm *fpi_ssm_new(struct fp_dev *dev,
-		     ssm_handler_fn handler,
-		     int nr_states,
-		     void *user_data);
+fpi_ssm *fpi_ssm_new_full(struct fp_dev *dev,
+			  ssm_handler_fn handler,
+			  int nr_states,
+			  void *user_data,
+			  const char *name);
+/**
+ * fpi_ssm_new:
+ * @dev: a #fp_dev fingerprint device
+ * @handler: the callback function
+ * @nr_states: the number of states
+ * @user_data: the user data to pass to callbacks
+ *
+ * Allocate a new ssm, with @nr_states states. The @handler callback
+ * will be called after each state transition. The machine is named after
+ * @handler, see fpi_ssm_new_full().
+ *
+ * Returns: a new #fpi_ssm state machine
+ */
+#define fpi_ssm_new(dev, handler, nr_states, user_data) \
+	fpi_ssm_new_full(dev, handler, nr_states, user_data, #handler)
 void fpi_ssm_free(fpi_ssm *machine);
 void fpi_ssm_start(fpi_ssm *ssm, ssm_completed_fn callback);
 void fpi_ssm_start_subsm(fpi_ssm *parent, fpi_ssm *child);
@@ -83,5 +99,6 @@ void *fpi_ssm_get_user_data(fpi_ssm *machine);
 void fpi_ssm_set_error(struct fpi_ssm *machine, int error);
 int fpi_ssm_get_error(fpi_ssm *machine);
 int fpi_ssm_get_cur_state(fpi_ssm *machine);
+const char *fpi_ssm_get_name(fpi_ssm *machine);
 
 #endif
@@ -49,18 +49,37 @@ static void sync_open_cb(struct fp_dev *dev, int status, void *user_data)
  * Returns: the opened device handle, or %NULL on error
  */
 API_EXPORTED struct fp_dev *fp_dev_open(struct fp_dscv_dev *ddev)
+{
+	return fp_dev_open_in_ctx(ddev, NULL);
+}
+
+/**
+ * fp_dev_open_in_ctx:
+ * @ddev: the struct #fp_dscv_dev discovered device to open
+ * @ctx: the #fp_event_ctx to open the device in, or %NULL for the default
+ * event context
+ *
+ * Like fp_dev_open(), but opens the device in @ctx, see
+ * fp_async_dev_open_in_ctx(). The synchronous functions called on the
+ * returned device only handle the events of @ctx, so several devices opened
+ * in their own contexts can be used at the same time from separate threads.
+ *
+ * Returns: the opened device handle, or %NULL on error
+ */
+API_EXPORTED struct fp_dev *fp_dev_open_in_ctx(struct fp_dscv_dev *ddev,
+	struct fp_event_ctx *ctx)
 {
 	struct fp_dev *dev = NULL;
 	struct sync_open_data *odata = g_malloc0(sizeof(*odata));
 	int r;
 
 	G_DEBUG_HERE();
-	r = fp_async_dev_open(ddev, sync_open_cb, odata);
+	r = fp_async_dev_open_in_ctx(ddev, ctx, sync_open_cb, odata);
 	if (r)
 		goto out;
 
 	while (!odata->dev)
-		if (fp_handle_events() < 0)
+		if (fpi_event_ctx_handle_events(ctx) < 0)
 			goto out;
 
 	if (odata->status == 0)
@@ -89,15 +108,18 @@ static void sync_close_cb(struct fp_dev *dev, void *user_data)
  */
 API_EXPORTED void fp_dev_close(struct fp_dev *dev)
 {
+	struct fp_event_ctx *ctx;
 	gboolean closed = FALSE;
 
 	if (!dev)
 		return;
 
 	G_DEBUG_HERE();
+	/* dev is freed once closed */
+	ctx = dev->ctx;
 	fp_async_dev_close(dev, sync_close_cb, &closed);
 	while (!closed)
-		if (fp_handle_events() < 0)
+		if (fpi_event_ctx_handle_events(ctx) < 0)
 			break;
 }
 
@@ -220,7 +242,7 @@ API_EXPORTED int fp_enroll_finger_img(struct fp_dev *dev,
 	edata = dev->enroll_stage_cb_data;
 
 	while (!edata->populated) {
-		r = fp_handle_events();
+		r = fpi_event_ctx_handle_events(dev->ctx);
 		if (r < 0) {
 			g_free(edata);
 			goto err;
@@ -283,7 +305,7 @@ out:
 err:
 	if (fp_async_enroll_stop(dev, enroll_stop_cb, &stopped) == 0)
 		while (!stopped)
-			if (fp_handle_events() < 0)
+			if (fpi_event_ctx_handle_events(dev->ctx) < 0)
 				break;
 	return r;
 }
@@ -373,7 +395,7 @@ API_EXPORTED int fp_verify_finger_img(struct fp_dev *dev,
 	}
 
 	while (!vdata->populated) {
-		r = fp_handle_events();
+		r = fpi_event_ctx_handle_events(dev->ctx);
 		if (r < 0) {
 			g_free(vdata);
 			goto err;
@@ -415,7 +437,7 @@ err:
 	fp_dbg("ending verification");
 	if (fp_async_verify_stop(dev, verify_stop_cb, &stopped) == 0)
 		while (!stopped)
-			if (fp_handle_events() < 0)
+			if (fpi_event_ctx_handle_events(dev->ctx) < 0)
 				break;
 
 	return r;
@@ -516,7 +538,7 @@ API_EXPORTED int fp_identify_finger_img(struct fp_dev *dev,
 	}
 
 	while (!idata->populated) {
-		r = fp_handle_events();
+		r = fpi_event_ctx_handle_events(dev->ctx);
 		if (r < 0)
 			goto err_stop;
 	}
@@ -555,7 +577,7 @@ API_EXPORTED int fp_identify_finger_img(struct fp_dev *dev,
 err_stop:
 	if (fp_async_identify_stop(dev, identify_stop_cb, &stopped) == 0)
 		while (!stopped)
-			if (fp_handle_events() < 0)
+			if (fpi_event_ctx_handle_events(dev->ctx) < 0)
 				break;
 
 err:
@@ -652,7 +674,7 @@ API_EXPORTED int fp_dev_img_capture(struct fp_dev *dev, int unconditional,
 	}
 
 	while (!vdata->populated) {
-		r = fp_handle_events();
+		r = fpi_event_ctx_handle_events(dev->ctx);
 		if (r < 0) {
 			g_free(vdata);
 			goto err;
@@ -682,7 +704,7 @@ err:
 	fp_dbg("ending capture");
 	if (fp_async_capture_stop(dev, capture_stop_cb, &stopped) == 0)
 		while (!stopped)
-			if (fp_handle_events() < 0)
+			if (fpi_event_ctx_handle_events(dev->ctx) < 0)
 				break;
 
 	return r;
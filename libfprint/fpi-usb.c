@@ -17,8 +17,11 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#define FP_COMPONENT "usb"
+
 #include "fpi-usb.h"
 #include "drivers_api.h"
+#include "fp_internal.h"
 
 /**
  * SECTION:fpi-usb
@@ -34,6 +37,7 @@
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -65,8 +69,216 @@ struct fpi_usb_transfer {
 	struct fp_dev *dev;
 	fpi_usb_transfer_cb_fn callback;
 	void *user_data;
+
+	/* the pool the transfer goes back to, if any */
+	struct fpi_usb_pool *pool;
+	/* size class of the buffer if it came from the pool, or -1 */
+	int buffer_class;
+	/* next idle transfer in the pool */
+	fpi_usb_transfer *next;
 };
 
+/* Register accesses and status polls submit small transfers back to back,
+ * and a few drivers read whole frames the same way. Buffers are rounded up
+ * to the next of these sizes so that they can be reused by transfers of
+ * slightly different lengths; larger ones aren't pooled. */
+static const size_t pool_buffer_sizes[] = { 64, 512, 4096, 32768 };
+#define POOL_NUM_CLASSES	G_N_ELEMENTS(pool_buffer_sizes)
+
+/* Drivers rarely have more than a couple of transfers in flight */
+#define POOL_MAX_TRANSFERS	8
+#define POOL_MAX_BUFFERS	8
+
+/* Like the image pool, every transfer allocated from the pool holds a
+ * reference, as transfers can complete after their device is closed. Idle
+ * buffers are chained through their first bytes. */
+struct fpi_usb_pool {
+	gint refcount;
+	GMutex lock;
+	gboolean closed;
+	fpi_usb_transfer *transfers;
+	guint num_transfers;
+	gpointer buffers[POOL_NUM_CLASSES];
+	guint num_buffers[POOL_NUM_CLASSES];
+	struct fpi_usb_pool_stats stats;
+};
+
+static struct fpi_usb_pool *pool_ref(struct fpi_usb_pool *pool)
+{
+	g_atomic_int_inc(&pool->refcount);
+	return pool;
+}
+
+static void pool_unref(struct fpi_usb_pool *pool)
+{
+	if (!g_atomic_int_dec_and_test(&pool->refcount))
+		return;
+
+	BUG_ON(pool->transfers != NULL);
+	g_mutex_clear(&pool->lock);
+	g_free(pool);
+}
+
+static int pool_buffer_class(size_t length)
+{
+	guint i;
+
+	for (i = 0; i < POOL_NUM_CLASSES; i++) {
+		if (length <= pool_buffer_sizes[i])
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * fpi_usb_pool_new:
+ *
+ * Creates the pool of transfers and buffers of a newly opened device.
+ * Pooling can be disabled by setting the `FP_USB_POOL` environment
+ * variable to 0, in which case transfers are allocated and freed as usual.
+ *
+ * Returns: a new pool to close with fpi_usb_pool_close(), or %NULL if
+ * pooling is disabled
+ */
+struct fpi_usb_pool *fpi_usb_pool_new(void)
+{
+	const char *env = g_getenv("FP_USB_POOL");
+	struct fpi_usb_pool *pool;
+
+	if (env && g_str_equal(env, "0"))
+		return NULL;
+
+	pool = g_malloc0(sizeof(*pool));
+	pool->refcount = 1;
+	g_mutex_init(&pool->lock);
+	return pool;
+}
+
+/**
+ * fpi_usb_pool_close:
+ * @pool: the pool of a device being closed, or %NULL
+ *
+ * Frees the idle transfers and buffers of @pool and drops the device's
+ * reference on it. Transfers still in flight are freed normally once
+ * they complete.
+ */
+void fpi_usb_pool_close(struct fpi_usb_pool *pool)
+{
+	fpi_usb_transfer *transfers;
+	gpointer buffers[POOL_NUM_CLASSES];
+	guint i;
+
+	if (!pool)
+		return;
+
+	g_mutex_lock(&pool->lock);
+	pool->closed = TRUE;
+	transfers = pool->transfers;
+	pool->transfers = NULL;
+	pool->num_transfers = 0;
+	for (i = 0; i < POOL_NUM_CLASSES; i++) {
+		buffers[i] = pool->buffers[i];
+		pool->buffers[i] = NULL;
+		pool->num_buffers[i] = 0;
+	}
+	fp_dbg("transfers: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT
+	       " misses; buffers: %" G_GUINT64_FORMAT " hits, %"
+	       G_GUINT64_FORMAT " misses", pool->stats.transfer_hits,
+	       pool->stats.transfer_misses, pool->stats.buffer_hits,
+	       pool->stats.buffer_misses);
+	g_mutex_unlock(&pool->lock);
+
+	while (transfers) {
+		fpi_usb_transfer *next = transfers->next;
+
+		libusb_free_transfer(transfers->transfer);
+		g_free(transfers);
+		pool_unref(pool);
+		transfers = next;
+	}
+	for (i = 0; i < POOL_NUM_CLASSES; i++) {
+		while (buffers[i]) {
+			gpointer next = *(gpointer *) buffers[i];
+
+			g_free(buffers[i]);
+			buffers[i] = next;
+		}
+	}
+	pool_unref(pool);
+}
+
+/**
+ * fpi_usb_pool_get_stats:
+ * @pool: a pool, or %NULL
+ * @stats: the counters to fill in
+ *
+ * Gets the counters of @pool. A hit is a transfer or buffer that was
+ * reused, a miss one that had to be allocated. Once a driver is polling
+ * the device, only the hit counters should keep increasing. All the
+ * counters are zero if @pool is %NULL.
+ */
+void fpi_usb_pool_get_stats(struct fpi_usb_pool *pool,
+	struct fpi_usb_pool_stats *stats)
+{
+	if (!pool) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	g_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	g_mutex_unlock(&pool->lock);
+}
+
+/* Returns a buffer of at least @length bytes, which is only remembered as
+ * pooled by the transfer it is used for */
+static unsigned char *pool_get_buffer(struct fpi_usb_pool *pool,
+	size_t length, int *buffer_class)
+{
+	gpointer buffer = NULL;
+	int c = pool ? pool_buffer_class(length) : -1;
+
+	*buffer_class = c;
+	if (c < 0)
+		return g_malloc(length);
+
+	g_mutex_lock(&pool->lock);
+	if (!pool->closed && pool->buffers[c]) {
+		buffer = pool->buffers[c];
+		pool->buffers[c] = *(gpointer *) buffer;
+		pool->num_buffers[c]--;
+		pool->stats.buffer_hits++;
+	} else {
+		pool->stats.buffer_misses++;
+	}
+	g_mutex_unlock(&pool->lock);
+
+	if (!buffer)
+		buffer = g_malloc(pool_buffer_sizes[c]);
+	return buffer;
+}
+
+static void pool_put_buffer(struct fpi_usb_pool *pool, gpointer buffer,
+	int buffer_class)
+{
+	gboolean keep = FALSE;
+
+	if (buffer && buffer_class >= 0) {
+		g_mutex_lock(&pool->lock);
+		keep = !pool->closed &&
+			pool->num_buffers[buffer_class] < POOL_MAX_BUFFERS;
+		if (keep) {
+			*(gpointer *) buffer = pool->buffers[buffer_class];
+			pool->buffers[buffer_class] = buffer;
+			pool->num_buffers[buffer_class]++;
+		}
+		g_mutex_unlock(&pool->lock);
+	}
+
+	if (!keep)
+		g_free(buffer);
+}
+
 /**
  * fpi_usb_alloc:
  *
@@ -86,16 +298,88 @@ fpi_usb_alloc(void)
 	return transfer;
 }
 
+/**
+ * fpi_usb_alloc_buffer:
+ * @length: the size of the buffer
+ *
+ * Allocates a buffer for a transfer which will receive image data. The
+ * buffer is allocated with g_malloc() and is suitably aligned to be used
+ * as the pixel storage of an #fp_img, so that once the transfer completes,
+ * the driver can hand it over with fpi_usb_transfer_steal_buffer() and
+ * fpi_img_new_from_buffer() instead of copying the image out of it.
+ *
+ * Returns: a new buffer, to free with g_free()
+ */
+unsigned char *
+fpi_usb_alloc_buffer(size_t length)
+{
+	/* g_malloc() memory is aligned for any basic type, which is all
+	 * the image processing code needs. */
+	return g_malloc(length);
+}
+
+/**
+ * fpi_usb_transfer_steal_buffer:
+ * @transfer: a struct #libusb_transfer
+ *
+ * Takes the ownership of the buffer of @transfer, so that it is not freed
+ * along with the transfer, whether the transfer was created with
+ * fpi_usb_fill_bulk_transfer() or uses the `LIBUSB_TRANSFER_FREE_BUFFER`
+ * flag. This is usually called from the transfer callback, to hand over
+ * the received data to an #fp_img with fpi_img_new_from_buffer().
+ *
+ * Returns: the transfer buffer, now owned by the caller
+ */
+unsigned char *
+fpi_usb_transfer_steal_buffer(struct libusb_transfer *transfer)
+{
+	unsigned char *buffer;
+
+	g_return_val_if_fail (transfer != NULL, NULL);
+
+	buffer = transfer->buffer;
+	transfer->buffer = NULL;
+	transfer->flags &= ~LIBUSB_TRANSFER_FREE_BUFFER;
+
+	return buffer;
+}
+
 static fpi_usb_transfer *
 fpi_usb_transfer_new(struct fp_dev          *dev,
 		     fpi_ssm                *ssm,
 		     fpi_usb_transfer_cb_fn  callback,
 		     void                   *user_data)
 {
-	fpi_usb_transfer *transfer;
+	struct fpi_usb_pool *pool = dev->usb_pool;
+	fpi_usb_transfer *transfer = NULL;
+
+	if (pool) {
+		g_mutex_lock(&pool->lock);
+		if (pool->transfers) {
+			transfer = pool->transfers;
+			pool->transfers = transfer->next;
+			pool->num_transfers--;
+			pool->stats.transfer_hits++;
+		} else {
+			pool->stats.transfer_misses++;
+		}
+		g_mutex_unlock(&pool->lock);
+	}
+
+	if (transfer) {
+		/* The libusb_fill_*() functions set everything else */
+		transfer->transfer->flags = 0;
+		transfer->transfer->status = 0;
+		transfer->transfer->actual_length = 0;
+	} else {
+		transfer = g_new0(fpi_usb_transfer, 1);
+		transfer->transfer = fpi_usb_alloc();
+		if (pool)
+			transfer->pool = pool_ref(pool);
+	}
 
-	transfer = g_new0(fpi_usb_transfer, 1);
-	transfer->transfer = fpi_usb_alloc();
+	transfer->buffer_class = -1;
+	transfer->next = NULL;
 	transfer->dev = dev;
 	transfer->ssm = ssm;
 	transfer->callback = callback;
@@ -107,12 +391,39 @@ fpi_usb_transfer_new(struct fp_dev          *dev,
 void
 fpi_usb_transfer_free(fpi_usb_transfer *transfer)
 {
+	struct fpi_usb_pool *pool;
+	gboolean keep;
+
 	if (transfer == NULL)
 		return;
 
-	g_free(transfer->transfer->buffer);
-	libusb_free_transfer(transfer->transfer);
-	g_free(transfer);
+	pool = transfer->pool;
+	if (!pool) {
+		g_free(transfer->transfer->buffer);
+		libusb_free_transfer(transfer->transfer);
+		g_free(transfer);
+		return;
+	}
+
+	/* a stolen buffer isn't the transfer's anymore */
+	pool_put_buffer(pool, transfer->transfer->buffer,
+			transfer->buffer_class);
+	transfer->transfer->buffer = NULL;
+
+	g_mutex_lock(&pool->lock);
+	keep = !pool->closed && pool->num_transfers < POOL_MAX_TRANSFERS;
+	if (keep) {
+		transfer->next = pool->transfers;
+		pool->transfers = transfer;
+		pool->num_transfers++;
+	}
+	g_mutex_unlock(&pool->lock);
+
+	if (!keep) {
+		libusb_free_transfer(transfer->transfer);
+		g_free(transfer);
+		pool_unref(pool);
+	}
 }
 
 static void
@@ -134,10 +445,12 @@ fpi_usb_transfer_cb (struct libusb_transfer *transfer)
  * @dev: a struct #fp_dev fingerprint device
  * @ssm: the current #fpi_ssm state machine
  * @endpoint: the USB end point
- * @buffer: a buffer allocated with g_malloc() or another GLib function.
+ * @buffer: (nullable): a buffer allocated with g_malloc() or another GLib
+ * function, or %NULL to receive data in a buffer recycled from the
+ * device's previous transfers.
  * Note that the returned #fpi_usb_transfer will own this buffer, so it
  * should not be freed manually.
- * @length: the size of @buffer
+ * @length: the size of @buffer, or of the data to receive
  * @callback: the callback function that will be called once the fpi_usb_submit_transfer()
  * call finishes.
  * @user_data: a user data pointer to pass to the callback
@@ -171,6 +484,9 @@ fpi_usb_fill_bulk_transfer (struct fp_dev          *dev,
 					ssm,
 					callback,
 					user_data);
+	if (!buffer)
+		buffer = pool_get_buffer(transfer->pool, length,
+					 &transfer->buffer_class);
 
 	libusb_fill_bulk_transfer(transfer->transfer,
 				  fpi_dev_get_usb_dev(dev),
@@ -184,6 +500,301 @@ fpi_usb_fill_bulk_transfer (struct fp_dev          *dev,
 	return transfer;
 }
 
+/**
+ * fpi_usb_fill_control_transfer:
+ * @dev: a struct #fp_dev fingerprint device
+ * @ssm: the current #fpi_ssm state machine
+ * @request_type: the bmRequestType field of the setup packet
+ * @request: the bRequest field of the setup packet
+ * @value: the wValue field of the setup packet
+ * @index: the wIndex field of the setup packet
+ * @data: (nullable): the data to send for host-to-device requests, or %NULL
+ * @length: the wLength field of the setup packet, the size of @data
+ * @callback: the callback function that will be called once the fpi_usb_submit_transfer()
+ * call finishes.
+ * @user_data: a user data pointer to pass to the callback
+ * @timeout: timeout for the transfer in milliseconds, or 0 for no timeout
+ *
+ * Like fpi_usb_fill_bulk_transfer(), but for a control transfer, which is
+ * how many sensors read and write their registers. The buffer holding the
+ * setup packet and the data is recycled from the device's previous
+ * transfers, and @data is copied to it. Device-to-host data can be read
+ * with `libusb_control_transfer_get_data()` in @callback. The transfer
+ * fails if fewer than @length bytes are received.
+ *
+ * Returns: a #fpi_usb_transfer transfer struct, to be passed to
+ * fpi_usb_submit_transfer().
+ */
+fpi_usb_transfer *
+fpi_usb_fill_control_transfer (struct fp_dev          *dev,
+			       fpi_ssm                *ssm,
+			       uint8_t                 request_type,
+			       uint8_t                 request,
+			       uint16_t                value,
+			       uint16_t                index,
+			       const unsigned char    *data,
+			       uint16_t                length,
+			       fpi_usb_transfer_cb_fn  callback,
+			       void                   *user_data,
+			       unsigned int            timeout)
+{
+	fpi_usb_transfer *transfer;
+	unsigned char *buffer;
+
+	g_return_val_if_fail (dev != NULL, NULL);
+	g_return_val_if_fail (callback != NULL, NULL);
+
+	transfer = fpi_usb_transfer_new(dev,
+					ssm,
+					callback,
+					user_data);
+	buffer = pool_get_buffer(transfer->pool,
+				 LIBUSB_CONTROL_SETUP_SIZE + length,
+				 &transfer->buffer_class);
+
+	libusb_fill_control_setup(buffer, request_type, request, value, index,
+				  length);
+	if (data)
+		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+	libusb_fill_control_transfer(transfer->transfer,
+				     fpi_dev_get_usb_dev(dev),
+				     buffer,
+				     fpi_usb_transfer_cb,
+				     transfer,
+				     timeout);
+	transfer->transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK;
+
+	return transfer;
+}
+
+/**
+ * fpi_usb_reg:
+ * @reg: the address of the register
+ * @value: the value to write to it
+ *
+ * A register write, as listed in the tables passed to
+ * fpi_usb_write_regs().
+ */
+
+/**
+ * fpi_usb_regs_protocol:
+ * @request_type: the bmRequestType of the control transfers writing
+ * registers
+ * @request: their bRequest
+ * @reg_in_index: %TRUE if the address of the first register written goes
+ * in wIndex, %FALSE if it goes in wValue
+ * @max_regs: the largest number of consecutive registers a single
+ * transfer can write, or 1 if each transfer only writes one register
+ * @max_in_flight: the largest number of transfers to queue at once, or 1
+ * to wait for each transfer before submitting the next one
+ * @timeout: timeout for each transfer in milliseconds, or 0 for no timeout
+ *
+ * How a device expects its registers to be written. The values written by
+ * a transfer are its data, in the order of their addresses.
+ */
+
+/**
+ * fpi_usb_regs_cb_fn:
+ * @dev: the struct #fp_dev on which the registers were written
+ * @ssm: the #fpi_ssm state machine passed to fpi_usb_write_regs()
+ * @status: 0 on success, or a negative error code
+ * @user_data: the user data passed to fpi_usb_write_regs()
+ *
+ * Called once all the registers were written, or writing failed.
+ */
+
+struct regs_run {
+	uint16_t reg;
+	uint16_t offset;
+	uint16_t length;
+};
+
+struct regs_batch {
+	struct fp_dev *dev;
+	fpi_ssm *ssm;
+	fpi_usb_regs_cb_fn callback;
+	void *user_data;
+	struct fpi_usb_regs_protocol protocol;
+
+	unsigned char *values;
+	struct regs_run *runs;
+	int num_runs;
+	int next_run;
+	int in_flight;
+	int status;
+};
+
+static void regs_batch_complete(struct regs_batch *batch)
+{
+	struct fp_dev *dev = batch->dev;
+	fpi_ssm *ssm = batch->ssm;
+	fpi_usb_regs_cb_fn callback = batch->callback;
+	void *user_data = batch->user_data;
+	int status = batch->status;
+
+	g_free(batch->values);
+	g_free(batch->runs);
+	g_free(batch);
+
+	if (callback)
+		callback(dev, ssm, status, user_data);
+	else if (status)
+		fpi_ssm_mark_failed(ssm, status);
+	else
+		fpi_ssm_next_state(ssm);
+}
+
+static void regs_batch_transfer_cb(struct libusb_transfer *transfer,
+				   struct fp_dev          *dev,
+				   fpi_ssm                *ssm,
+				   void                   *user_data);
+
+/* Queues transfers until @max_in_flight are queued. Returns FALSE if a
+ * transfer couldn't be submitted. */
+static gboolean regs_batch_submit(struct regs_batch *batch)
+{
+	const struct fpi_usb_regs_protocol *protocol = &batch->protocol;
+
+	while (batch->next_run < batch->num_runs &&
+	       batch->in_flight < MAX(protocol->max_in_flight, 1)) {
+		struct regs_run *run = &batch->runs[batch->next_run];
+		fpi_usb_transfer *transfer;
+		int r;
+
+		transfer = fpi_usb_fill_control_transfer(batch->dev,
+			batch->ssm,
+			protocol->request_type,
+			protocol->request,
+			protocol->reg_in_index ? 0 : run->reg,
+			protocol->reg_in_index ? run->reg : 0,
+			batch->values + run->offset,
+			run->length,
+			regs_batch_transfer_cb,
+			batch,
+			protocol->timeout);
+
+		r = fpi_usb_submit_transfer(transfer);
+		if (r < 0) {
+			batch->status = r;
+			return FALSE;
+		}
+		batch->next_run++;
+		batch->in_flight++;
+	}
+
+	return TRUE;
+}
+
+static void regs_batch_transfer_cb(struct libusb_transfer *transfer,
+				   struct fp_dev          *dev,
+				   fpi_ssm                *ssm,
+				   void                   *user_data)
+{
+	struct regs_batch *batch = user_data;
+	struct libusb_control_setup *setup =
+		libusb_control_transfer_get_setup(transfer);
+
+	batch->in_flight--;
+	/* LIBUSB_TRANSFER_SHORT_NOT_OK only applies to data received, so
+	 * short writes have to be caught here */
+	if (batch->status == 0) {
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+			batch->status = -EIO;
+		else if (transfer->actual_length !=
+			 libusb_le16_to_cpu(setup->wLength))
+			batch->status = -EPROTO;
+	}
+
+	/* after an error, wait for the transfers already queued */
+	if (batch->status == 0)
+		regs_batch_submit(batch);
+	if (batch->in_flight == 0)
+		regs_batch_complete(batch);
+}
+
+/**
+ * fpi_usb_write_regs:
+ * @dev: a struct #fp_dev fingerprint device
+ * @ssm: the current #fpi_ssm state machine
+ * @protocol: how the registers of @dev are written
+ * @regs: the registers to write, in order
+ * @num_regs: the number of items of @regs
+ * @callback: (nullable): the callback to call once the registers are
+ * written, or %NULL to move @ssm to its next state then, or mark it as
+ * failed
+ * @user_data: a user data pointer to pass to the callback
+ *
+ * Writes a table of registers with as few transfers as @protocol allows:
+ * runs of consecutive registers are written by the same transfer, and up
+ * to @max_in_flight transfers are queued on the control endpoint, which
+ * completes them in order. Once a transfer failed, or wrote fewer values
+ * than requested, no more transfers are submitted. @regs is copied, so it
+ * doesn't need to outlive this call.
+ *
+ * Returns: 0 on success, or the error of the first transfer if it
+ * couldn't be submitted, in which case @callback isn't called and @ssm
+ * isn't changed
+ */
+int
+fpi_usb_write_regs(struct fp_dev                      *dev,
+		   fpi_ssm                            *ssm,
+		   const struct fpi_usb_regs_protocol *protocol,
+		   const struct fpi_usb_reg           *regs,
+		   size_t                              num_regs,
+		   fpi_usb_regs_cb_fn                  callback,
+		   void                               *user_data)
+{
+	struct regs_batch *batch;
+	size_t i;
+	int r;
+
+	g_return_val_if_fail (dev != NULL, -EINVAL);
+	g_return_val_if_fail (protocol != NULL, -EINVAL);
+	g_return_val_if_fail (regs != NULL && num_regs > 0, -EINVAL);
+	g_return_val_if_fail (num_regs <= G_MAXUINT16, -EINVAL);
+	g_return_val_if_fail (callback != NULL || ssm != NULL, -EINVAL);
+
+	batch = g_new0(struct regs_batch, 1);
+	batch->dev = dev;
+	batch->ssm = ssm;
+	batch->callback = callback;
+	batch->user_data = user_data;
+	batch->protocol = *protocol;
+	batch->values = g_malloc(num_regs);
+	batch->runs = g_new(struct regs_run, num_regs);
+
+	for (i = 0; i < num_regs; i++) {
+		struct regs_run *run = NULL;
+
+		fp_dbg("set %02x=%02x", regs[i].reg, regs[i].value);
+		batch->values[i] = regs[i].value;
+
+		if (batch->num_runs > 0)
+			run = &batch->runs[batch->num_runs - 1];
+		if (run && run->length < MAX(protocol->max_regs, 1) &&
+		    regs[i].reg == run->reg + run->length) {
+			run->length++;
+			continue;
+		}
+
+		run = &batch->runs[batch->num_runs++];
+		run->reg = regs[i].reg;
+		run->offset = i;
+		run->length = 1;
+	}
+	fp_dbg("%" G_GSIZE_FORMAT " registers in %d transfers", num_regs,
+	       batch->num_runs);
+
+	if (regs_batch_submit(batch) || batch->in_flight > 0)
+		return 0;
+
+	r = batch->status;
+	g_free(batch->values);
+	g_free(batch->runs);
+	g_free(batch);
+	return r;
+}
+
 /**
  * fpi_usb_submit_transfer:
  * @transfer: a #fpi_usb_transfer struct
@@ -234,3 +845,335 @@ fpi_usb_cancel_transfer(fpi_usb_transfer *transfer)
 
 	return libusb_cancel_transfer(transfer->transfer);
 }
+
+/**
+ * fpi_usb_stream:
+ *
+ * A set of bulk transfers kept queued on an endpoint by
+ * fpi_usb_stream_start(), to read a continuous flow of data, usually
+ * images, without the gaps a single transfer would leave between its
+ * completion and its resubmission.
+ */
+
+/**
+ * fpi_usb_stream_data_cb_fn:
+ * @stream: the #fpi_usb_stream
+ * @dev: the struct #fp_dev the stream reads from
+ * @data: the data received by a transfer
+ * @length: the length of @data
+ * @user_data: the user data passed to fpi_usb_stream_new()
+ *
+ * Called for each transfer of @stream that completed, in the order in
+ * which the transfers were submitted. @data is only valid until the
+ * callback returns, after which the transfer is submitted again, unless
+ * the stream was stopped from the callback.
+ */
+
+/**
+ * fpi_usb_stream_stopped_cb_fn:
+ * @stream: the #fpi_usb_stream
+ * @dev: the struct #fp_dev the stream reads from
+ * @status: 0 if the stream was stopped with fpi_usb_stream_stop(), or a
+ * negative error code if a transfer failed
+ * @user_data: the user data passed to fpi_usb_stream_new()
+ *
+ * Called once the last transfer of @stream completed after it was
+ * stopped. The stream can be started again, or freed, from this callback.
+ */
+
+enum stream_slot_state {
+	SLOT_IDLE,
+	SLOT_FLYING,
+	/* completed, waiting for the transfers before it */
+	SLOT_DONE,
+	/* handed to the data callback */
+	SLOT_DELIVERING,
+};
+
+struct stream_slot {
+	fpi_usb_stream *stream;
+	struct libusb_transfer *transfer;
+	enum stream_slot_state state;
+	gboolean cancelling;
+};
+
+struct fpi_usb_stream {
+	struct fp_dev *dev;
+	fpi_usb_stream_data_cb_fn data_cb;
+	fpi_usb_stream_stopped_cb_fn stopped_cb;
+	void *user_data;
+
+	struct stream_slot *slots;
+	int num_slots;
+	/* next slot to deliver, the oldest one submitted */
+	int head;
+	/* slots which aren't idle */
+	int num_busy;
+	gboolean stopping;
+	gboolean freed;
+	int status;
+};
+
+static void stream_destroy(fpi_usb_stream *stream)
+{
+	int i;
+
+	for (i = 0; i < stream->num_slots; i++) {
+		g_free(stream->slots[i].transfer->buffer);
+		libusb_free_transfer(stream->slots[i].transfer);
+	}
+	g_free(stream->slots);
+	g_free(stream);
+}
+
+/* Called whenever a slot goes idle while stopping. This must be the last
+ * thing to touch @stream, as the callback might free it. */
+static void stream_check_stopped(fpi_usb_stream *stream)
+{
+	int status = stream->status;
+
+	if (stream->num_busy > 0)
+		return;
+
+	if (stream->freed) {
+		stream_destroy(stream);
+		return;
+	}
+
+	fp_dbg("stream stopped, status %d", status);
+	stream->stopping = FALSE;
+	stream->status = 0;
+	stream->stopped_cb(stream, stream->dev, status, stream->user_data);
+}
+
+static void stream_cancel(fpi_usb_stream *stream)
+{
+	int i;
+
+	for (i = 0; i < stream->num_slots; i++) {
+		struct stream_slot *slot = &stream->slots[i];
+		int r;
+
+		if (slot->state == SLOT_DONE) {
+			/* data arriving after the stop isn't delivered */
+			slot->state = SLOT_IDLE;
+			stream->num_busy--;
+		} else if (slot->state == SLOT_FLYING && !slot->cancelling) {
+			r = libusb_cancel_transfer(slot->transfer);
+			if (r < 0)
+				fp_dbg("cancel failed error %d", r);
+			slot->cancelling = TRUE;
+		}
+	}
+}
+
+static void stream_fail(fpi_usb_stream *stream, int status)
+{
+	stream->status = status;
+	fpi_usb_stream_stop(stream);
+}
+
+/* Hands the completed transfers at the head of the queue to the driver,
+ * and submits them again */
+static void stream_deliver(fpi_usb_stream *stream)
+{
+	for (;;) {
+		struct stream_slot *slot = &stream->slots[stream->head];
+		struct libusb_transfer *transfer = slot->transfer;
+		int r;
+
+		if (slot->state != SLOT_DONE)
+			return;
+
+		slot->state = SLOT_DELIVERING;
+		stream->head = (stream->head + 1) % stream->num_slots;
+		stream->data_cb(stream, stream->dev, transfer->buffer,
+				transfer->actual_length, stream->user_data);
+
+		if (stream->stopping) {
+			slot->state = SLOT_IDLE;
+			stream->num_busy--;
+			stream_check_stopped(stream);
+			return;
+		}
+
+		r = libusb_submit_transfer(transfer);
+		if (r < 0) {
+			fp_warn("failed resubmit, error %d", r);
+			slot->state = SLOT_IDLE;
+			stream->num_busy--;
+			stream_fail(stream, r);
+			return;
+		}
+		slot->state = SLOT_FLYING;
+	}
+}
+
+static void stream_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct stream_slot *slot = transfer->user_data;
+	fpi_usb_stream *stream = slot->stream;
+
+	slot->cancelling = FALSE;
+
+	/* don't care about error or success if we're terminating */
+	if (stream->stopping) {
+		slot->state = SLOT_IDLE;
+		stream->num_busy--;
+		stream_check_stopped(stream);
+		return;
+	}
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		fp_warn("bad status %d, stopping stream", transfer->status);
+		slot->state = SLOT_IDLE;
+		stream->num_busy--;
+		stream_fail(stream, -EIO);
+		return;
+	}
+
+	slot->state = SLOT_DONE;
+	stream_deliver(stream);
+}
+
+/**
+ * fpi_usb_stream_new:
+ * @dev: a struct #fp_dev fingerprint device
+ * @endpoint: the USB end point to read from
+ * @num_transfers: the number of transfers to keep queued
+ * @length: the size of each transfer
+ * @timeout: timeout for each transfer in milliseconds, or 0 for no timeout
+ * @data_cb: the callback to call with the data of each completed transfer
+ * @stopped_cb: the callback to call once the stream is stopped
+ * @user_data: a user data pointer to pass to the callbacks
+ *
+ * Creates a stream reading @endpoint with @num_transfers bulk transfers
+ * of @length bytes. The transfers and their buffers are allocated once,
+ * and reused until the stream is freed.
+ *
+ * Returns: a new #fpi_usb_stream, to free with fpi_usb_stream_free()
+ */
+fpi_usb_stream *
+fpi_usb_stream_new (struct fp_dev                *dev,
+		    unsigned char                 endpoint,
+		    int                           num_transfers,
+		    int                           length,
+		    unsigned int                  timeout,
+		    fpi_usb_stream_data_cb_fn     data_cb,
+		    fpi_usb_stream_stopped_cb_fn  stopped_cb,
+		    void                         *user_data)
+{
+	fpi_usb_stream *stream;
+	int i;
+
+	g_return_val_if_fail (dev != NULL, NULL);
+	g_return_val_if_fail (num_transfers > 0, NULL);
+	g_return_val_if_fail (data_cb != NULL, NULL);
+	g_return_val_if_fail (stopped_cb != NULL, NULL);
+
+	stream = g_new0(fpi_usb_stream, 1);
+	stream->dev = dev;
+	stream->data_cb = data_cb;
+	stream->stopped_cb = stopped_cb;
+	stream->user_data = user_data;
+	stream->num_slots = num_transfers;
+	stream->slots = g_new0(struct stream_slot, num_transfers);
+
+	for (i = 0; i < num_transfers; i++) {
+		struct stream_slot *slot = &stream->slots[i];
+
+		slot->stream = stream;
+		slot->transfer = fpi_usb_alloc();
+		libusb_fill_bulk_transfer(slot->transfer,
+					  fpi_dev_get_usb_dev(dev),
+					  endpoint,
+					  g_malloc(length),
+					  length,
+					  stream_transfer_cb,
+					  slot,
+					  timeout);
+	}
+
+	return stream;
+}
+
+/**
+ * fpi_usb_stream_start:
+ * @stream: a stopped #fpi_usb_stream
+ *
+ * Submits all the transfers of @stream. If some of them couldn't be
+ * submitted, the stream is stopped as if one had failed, and the
+ * #fpi_usb_stream_stopped_cb_fn callback gets the error.
+ *
+ * Returns: 0 on success, or the error of the first transfer if none could
+ * be submitted, in which case the stream stays stopped
+ */
+int
+fpi_usb_stream_start(fpi_usb_stream *stream)
+{
+	int i;
+
+	g_return_val_if_fail (stream != NULL, -EINVAL);
+	g_return_val_if_fail (stream->num_busy == 0 && !stream->stopping,
+			      -EBUSY);
+
+	stream->head = 0;
+	for (i = 0; i < stream->num_slots; i++) {
+		struct stream_slot *slot = &stream->slots[i];
+		int r = libusb_submit_transfer(slot->transfer);
+
+		if (r < 0) {
+			if (i == 0)
+				return r;
+			stream_fail(stream, r);
+			return 0;
+		}
+		slot->state = SLOT_FLYING;
+		stream->num_busy++;
+	}
+
+	return 0;
+}
+
+/**
+ * fpi_usb_stream_stop:
+ * @stream: a #fpi_usb_stream
+ *
+ * Cancels the transfers of @stream. No data is delivered anymore, and the
+ * #fpi_usb_stream_stopped_cb_fn callback is called once the last transfer
+ * completed, which might be before this function returns if none was
+ * queued. Stopping a stream which is already stopping does nothing.
+ */
+void
+fpi_usb_stream_stop(fpi_usb_stream *stream)
+{
+	g_return_if_fail (stream != NULL);
+
+	if (stream->stopping)
+		return;
+
+	stream->stopping = TRUE;
+	stream_cancel(stream);
+	stream_check_stopped(stream);
+}
+
+/**
+ * fpi_usb_stream_free:
+ * @stream: a #fpi_usb_stream, or %NULL
+ *
+ * Frees @stream. If some of its transfers are still queued, they are
+ * cancelled without calling any callback, and the stream is freed once
+ * they complete, so this must be called before the device is closed.
+ */
+void
+fpi_usb_stream_free(fpi_usb_stream *stream)
+{
+	if (stream == NULL)
+		return;
+
+	stream->freed = TRUE;
+	stream->stopping = TRUE;
+	stream_cancel(stream);
+	if (stream->num_busy == 0)
+		stream_destroy(stream);
+}
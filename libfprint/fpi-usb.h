@@ -55,6 +55,8 @@ typedef void(*fpi_usb_transfer_cb_fn) (struct libusb_transfer *transfer,
 				       void                   *user_data);
 
 struct libusb_transfer *fpi_usb_alloc(void) __attribute__((returns_nonnull));
+unsigned char *fpi_usb_alloc_buffer(size_t length) __attribute__((returns_nonnull));
+unsigned char *fpi_usb_transfer_steal_buffer(struct libusb_transfer *transfer);
 
 fpi_usb_transfer *fpi_usb_fill_bulk_transfer (struct fp_dev          *dev,
 					      fpi_ssm                *ssm,
@@ -64,7 +66,69 @@ fpi_usb_transfer *fpi_usb_fill_bulk_transfer (struct fp_dev          *dev,
 					      fpi_usb_transfer_cb_fn  callback,
 					      void                   *user_data,
 					      unsigned int            timeout);
+fpi_usb_transfer *fpi_usb_fill_control_transfer (struct fp_dev          *dev,
+						 fpi_ssm                *ssm,
+						 uint8_t                 request_type,
+						 uint8_t                 request,
+						 uint16_t                value,
+						 uint16_t                index,
+						 const unsigned char    *data,
+						 uint16_t                length,
+						 fpi_usb_transfer_cb_fn  callback,
+						 void                   *user_data,
+						 unsigned int            timeout);
 int fpi_usb_submit_transfer (fpi_usb_transfer *transfer);
 int fpi_usb_cancel_transfer (fpi_usb_transfer *transfer);
 
+struct fpi_usb_reg {
+	uint16_t reg;
+	uint8_t  value;
+};
+
+struct fpi_usb_regs_protocol {
+	uint8_t      request_type;
+	uint8_t      request;
+	gboolean     reg_in_index;
+	uint16_t     max_regs;
+	int          max_in_flight;
+	unsigned int timeout;
+};
+
+typedef void(*fpi_usb_regs_cb_fn) (struct fp_dev *dev,
+				   fpi_ssm       *ssm,
+				   int            status,
+				   void          *user_data);
+
+int fpi_usb_write_regs (struct fp_dev                      *dev,
+			fpi_ssm                            *ssm,
+			const struct fpi_usb_regs_protocol *protocol,
+			const struct fpi_usb_reg           *regs,
+			size_t                              num_regs,
+			fpi_usb_regs_cb_fn                  callback,
+			void                               *user_data);
+
+typedef struct fpi_usb_stream fpi_usb_stream;
+
+typedef void(*fpi_usb_stream_data_cb_fn) (fpi_usb_stream *stream,
+					  struct fp_dev  *dev,
+					  unsigned char  *data,
+					  int             length,
+					  void           *user_data);
+typedef void(*fpi_usb_stream_stopped_cb_fn) (fpi_usb_stream *stream,
+					     struct fp_dev  *dev,
+					     int             status,
+					     void           *user_data);
+
+fpi_usb_stream *fpi_usb_stream_new (struct fp_dev                *dev,
+				    unsigned char                 endpoint,
+				    int                           num_transfers,
+				    int                           length,
+				    unsigned int                  timeout,
+				    fpi_usb_stream_data_cb_fn     data_cb,
+				    fpi_usb_stream_stopped_cb_fn  stopped_cb,
+				    void                         *user_data);
+int fpi_usb_stream_start (fpi_usb_stream *stream);
+void fpi_usb_stream_stop (fpi_usb_stream *stream);
+void fpi_usb_stream_free (fpi_usb_stream *stream);
+
 #endif
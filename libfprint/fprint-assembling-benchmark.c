@@ -0,0 +1,91 @@
+/*
+ * Replays image assembling dumps recorded with FP_ASSEMBLING_DUMP_DIR
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fp_internal.h"
+
+static void usage (const char *prgname)
+{
+    fprintf (stderr, "Usage: %s [-n ITERATIONS] DUMP...\n", prgname);
+}
+
+static void print_result (const char *path,
+			  struct fprint_assembling_replay_result *result)
+{
+    printf ("%s: %s, %zu %s\n", path,
+	    result->lines ? "lines" : "frames",
+	    result->num_items,
+	    result->lines ? "lines" : "stripes");
+    printf ("  time: min %.3f ms, mean %.3f ms over %u iterations\n",
+	    result->min_time * 1000, result->mean_time * 1000,
+	    result->iterations);
+
+    if (result->lines) {
+	printf ("  deviation calls: %lu\n", result->deviation_calls);
+    } else if (result->estimated) {
+	printf ("  direction: %s, error %d, reverse error %d\n",
+		result->reverse ? "reverse" : "forward",
+		result->error, result->rev_error);
+	printf ("  deltas differing from recording: %zu\n",
+		result->delta_mismatches);
+    } else {
+	printf ("  direction: %s (hardware movement estimation)\n",
+		result->reverse ? "reverse" : "forward");
+    }
+
+    printf ("  image: %dx%d sha256 %s\n", result->width, result->height,
+	    result->checksum);
+}
+
+int main (int argc, char **argv)
+{
+    unsigned int iterations = 10;
+    int i, ret = 0;
+
+    for (i = 1; i < argc; i++) {
+	if (g_str_equal (argv[i], "-n") && i + 1 < argc) {
+	    iterations = strtoul (argv[++i], NULL, 10);
+	} else if (argv[i][0] == '-') {
+	    usage (argv[0]);
+	    return 1;
+	} else {
+	    break;
+	}
+    }
+
+    if (i == argc || iterations == 0) {
+	usage (argv[0]);
+	return 1;
+    }
+
+    for (; i < argc; i++) {
+	struct fprint_assembling_replay_result result;
+
+	if (fprint_assembling_replay (argv[i], iterations, &result) < 0) {
+	    fprintf (stderr, "%s: could not replay dump\n", argv[i]);
+	    ret = 1;
+	    continue;
+	}
+	print_result (argv[i], &result);
+    }
+
+    return ret;
+}
@@ -78,6 +78,14 @@ struct fp_driver;
  */
 struct fp_print_data;
 
+/**
+ * fp_print_db:
+ *
+ * #fp_print_db is an opaque structure type.  You must access it using the
+ * functions in this section.
+ */
+struct fp_print_db;
+
 /**
  * fp_img:
  *
@@ -86,6 +94,14 @@ struct fp_print_data;
  */
 struct fp_img;
 
+/**
+ * fp_event_ctx:
+ *
+ * #fp_event_ctx is an opaque structure type.  You must access it using the
+ * functions in this section.
+ */
+struct fp_event_ctx;
+
 /* misc/general stuff */
 
 /**
@@ -164,6 +180,8 @@ int fp_dscv_print_delete(struct fp_dscv_print *print) LIBFPRINT_DEPRECATED;
 
 /* Device handling */
 struct fp_dev *fp_dev_open(struct fp_dscv_dev *ddev);
+struct fp_dev *fp_dev_open_in_ctx(struct fp_dscv_dev *ddev,
+	struct fp_event_ctx *ctx);
 void fp_dev_close(struct fp_dev *dev);
 struct fp_driver *fp_dev_get_driver(struct fp_dev *dev);
 int fp_dev_get_nr_enroll_stages(struct fp_dev *dev);
@@ -286,6 +304,59 @@ struct fp_print_data *fp_print_data_from_data(unsigned char *buf,
 	size_t buflen);
 uint16_t fp_print_data_get_driver_id(struct fp_print_data *data);
 uint32_t fp_print_data_get_devtype(struct fp_print_data *data);
+int fp_print_data_gallery_from_data(unsigned char **bufs, size_t *buflens,
+	size_t count, struct fp_print_data ***gallery);
+int fp_print_data_gallery_load_dir(const char *path,
+	struct fp_print_data ***gallery, char ***names);
+void fp_print_data_gallery_free(struct fp_print_data **gallery);
+
+/**
+ * FP_PRINT_DATA_VIEW_ALIGN:
+ *
+ * The alignment of the item data within a stored print view. Data which is
+ * aligned to this in the caller's buffer is used in place, other data is
+ * copied. fp_print_data_get_data() aligns uncompressed item data to this
+ * within the compressed prints it writes when `FP_PRINT_DATA_COMPRESS` is
+ * set to 1.
+ */
+#define FP_PRINT_DATA_VIEW_ALIGN 4
+
+struct fp_print_data *fp_print_data_view_new(const unsigned char *buf,
+	size_t buflen);
+int fp_print_data_gallery_view_from_data(unsigned char **bufs,
+	size_t *buflens, size_t count, struct fp_print_data ***gallery);
+
+/**
+ * FP_PRINT_DB_USER_MAX:
+ *
+ * The maximum length in bytes of the user names in a #fp_print_db.
+ */
+#define FP_PRINT_DB_USER_MAX 32
+
+int fp_print_db_open(const char *path, struct fp_print_db **db);
+void fp_print_db_close(struct fp_print_db *db);
+int fp_print_db_save(struct fp_print_db *db, const char *user,
+	struct fp_print_data *data, enum fp_finger finger);
+int fp_print_db_load(struct fp_print_db *db, const char *user,
+	struct fp_dev *dev, enum fp_finger finger, struct fp_print_data **data);
+int fp_print_db_load_gallery(struct fp_print_db *db, struct fp_dev *dev,
+	struct fp_print_data ***gallery, char ***users, enum fp_finger **fingers);
+int fp_print_db_delete(struct fp_print_db *db, const char *user,
+	struct fp_dev *dev, enum fp_finger finger);
+
+/**
+ * fp_print_db_batch:
+ *
+ * #fp_print_db_batch is an opaque structure type.  You must access it using
+ * the functions in this section.
+ */
+struct fp_print_db_batch;
+
+struct fp_print_db_batch *fp_print_db_batch_new(struct fp_print_db *db);
+int fp_print_db_batch_save(struct fp_print_db_batch *batch, const char *user,
+	struct fp_print_data *data, enum fp_finger finger);
+int fp_print_db_batch_commit(struct fp_print_db_batch *batch);
+void fp_print_db_batch_free(struct fp_print_db_batch *batch);
 
 /* Image handling */
 
@@ -324,9 +395,41 @@ struct fp_pollfd {
 
 int fp_handle_events_timeout(struct timeval *timeout);
 int fp_handle_events(void);
+struct fp_event_ctx *fp_event_ctx_new(void);
+void fp_event_ctx_free(struct fp_event_ctx *ctx);
+int fp_event_ctx_handle_events_timeout(struct fp_event_ctx *ctx,
+	struct timeval *timeout);
 ssize_t fp_get_pollfds(struct fp_pollfd **pollfds);
 int fp_get_next_timeout(struct timeval *tv);
 
+/**
+ * FP_TIMEOUT_LATENESS_BINS:
+ *
+ * The number of bins in the lateness histogram of #fp_timeout_stats.
+ */
+#define FP_TIMEOUT_LATENESS_BINS 8
+
+/**
+ * fp_timeout_stats:
+ * @dispatched: the number of timeouts handled
+ * @lateness: histogram of how late timeouts were handled. The first bin
+ * counts timeouts handled less than 1 millisecond late, the second ones
+ * between 1 and 2 milliseconds late, the third ones between 2 and 4
+ * milliseconds late and so on, and the last bin all the later ones.
+ * @max_lateness_usec: the longest time a timeout was handled late, in
+ * microseconds
+ *
+ * Statistics about the timeouts handled by libfprint, as returned by
+ * fp_get_timeout_stats().
+ */
+struct fp_timeout_stats {
+	uint64_t dispatched;
+	uint64_t lateness[FP_TIMEOUT_LATENESS_BINS];
+	uint64_t max_lateness_usec;
+};
+
+void fp_get_timeout_stats(struct fp_timeout_stats *stats);
+
 /**
  * fp_pollfd_added_cb:
  * @fd: the new file descriptor
@@ -348,6 +451,11 @@ typedef void (*fp_pollfd_added_cb)(int fd, short int events);
 typedef void (*fp_pollfd_removed_cb)(int fd);
 void fp_set_pollfd_notifiers(fp_pollfd_added_cb added_cb,
 	fp_pollfd_removed_cb removed_cb);
+int fp_enable_timer_fd(void);
+
+/* Declared here so that GLib headers aren't needed, matches GLib's GSource */
+struct _GSource;
+struct _GSource *fp_event_source_new(void);
 
 /* Library */
 int fp_init(void);
@@ -394,6 +502,8 @@ typedef void (*fp_dev_open_cb)(struct fp_dev *dev, int status, void *user_data);
 
 int fp_async_dev_open(struct fp_dscv_dev *ddev, fp_dev_open_cb callback,
 	void *user_data);
+int fp_async_dev_open_in_ctx(struct fp_dscv_dev *ddev,
+	struct fp_event_ctx *ctx, fp_dev_open_cb callback, void *user_data);
 
 void fp_async_dev_close(struct fp_dev *dev, fp_operation_stop_cb callback,
 	void *user_data);